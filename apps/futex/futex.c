@@ -0,0 +1,133 @@
+#include <kernel/time/time.h>
+#include <novino/syscalls.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define ROUNDS 100000
+#define PINGS  10000
+
+static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+static volatile uint32_t spinlock = 0;
+static volatile size_t counter = 0;
+static volatile int turn = 0;
+
+static size_t now()
+{
+    timeval_t tv;
+    sys_gettime(&tv);
+    return tv.tv_sec * 1000000000UL + tv.tv_nsec;
+}
+
+static void *spin_entry(void *arg)
+{
+    for(int i = 0; i < ROUNDS; i++)
+    {
+        while(__atomic_exchange_n(&spinlock, 1, __ATOMIC_ACQUIRE))
+        {
+            asm volatile("pause");
+        }
+        counter++;
+        __atomic_store_n(&spinlock, 0, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void *mutex_entry(void *arg)
+{
+    for(int i = 0; i < ROUNDS; i++)
+    {
+        pthread_mutex_lock(&mutex);
+        counter++;
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+// Two threads hand a turn back and forth through a condition variable
+static void *ping_entry(void *arg)
+{
+    int self = (int)(size_t)arg;
+
+    for(int i = 0; i < PINGS; i++)
+    {
+        pthread_mutex_lock(&mutex);
+        while(turn != self)
+        {
+            pthread_cond_wait(&cond, &mutex);
+        }
+        turn = !self;
+        pthread_cond_broadcast(&cond);
+        pthread_mutex_unlock(&mutex);
+    }
+    return NULL;
+}
+
+static int run(const char *name, void *(*entry)(void*), int count)
+{
+    pthread_t threads[count];
+    size_t start, elapsed;
+
+    counter = 0;
+    start = now();
+
+    for(int i = 0; i < count; i++)
+    {
+        if(pthread_create(threads + i, NULL, entry, (void*)(size_t)i))
+        {
+            printf("error: failed to create thread %d\n", i);
+            count = i;
+            break;
+        }
+    }
+
+    for(int i = 0; i < count; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    elapsed = now() - start;
+    if(counter != (size_t)count * ROUNDS && entry != ping_entry)
+    {
+        printf("error: %s counted %lu instead of %lu\n", name, counter, (size_t)count * ROUNDS);
+        return 1;
+    }
+
+    if(entry == ping_entry)
+    {
+        printf("%-8s %d threads: %lu ns per handoff\n", name, count, elapsed / (2 * PINGS));
+    }
+    else
+    {
+        printf("%-8s %d threads: %lu ns per section\n", name, count, elapsed / (count * ROUNDS));
+    }
+
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    int threads = 4;
+
+    if(argc > 1)
+    {
+        threads = atoi(argv[1]);
+    }
+
+    if(threads < 1 || threads > 64)
+    {
+        printf("Usage: %s [threads]\n", argv[0]);
+        return 0;
+    }
+
+    for(int n = 1; n <= threads; n *= 2)
+    {
+        if(run("spinlock", spin_entry, n) || run("mutex", mutex_entry, n))
+        {
+            return 1;
+        }
+    }
+
+    return run("condvar", ping_entry, 2);
+}
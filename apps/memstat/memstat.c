@@ -19,6 +19,32 @@ size_t getint(const char *data, const char *name)
     return atol(data + len);
 }
 
+char *getstr(const char *data, const char *name, char *str)
+{
+    const char *d;
+    char *s;
+    char buf[32];
+    size_t len;
+
+    len = sprintf(buf, "%s=", name);
+    data = strstr(data, buf);
+    if(!data)
+    {
+        return 0;
+    }
+
+    d = data + len;
+    s = str;
+
+    while(*d && *d != ';')
+    {
+        *s++ = *d++;
+    }
+
+    *s = '\0';
+    return str;
+}
+
 int main(int argc, char *argv[])
 {
     int bufsz = 4096;
@@ -42,5 +68,102 @@ int main(int argc, char *argv[])
     printf("Free  : %lu MB\n", free/1000000);
     printf("Heap  : %lu MB\n", heap/1000000);
 
+    size_t zpool = getint(data, "zero.pool");
+    size_t zhits = getint(data, "zero.hits");
+    size_t zmisses = getint(data, "zero.misses");
+    size_t zrate = (zhits + zmisses) ? (100 * zhits) / (zhits + zmisses) : 0;
+
+    printf("Zeroed: %lu pages, %lu%% hit rate (%lu hits, %lu misses)\n", zpool, zrate, zhits, zmisses);
+
+    size_t nodes = getint(data, "nodes");
+    char key[32];
+
+    if(nodes > 1)
+    {
+        printf("\n%-6s %-10s %-10s %-10s\n", "NODE", "TOTAL", "USED", "FREE");
+
+        for(int i = 0; i < nodes; i++)
+        {
+            sprintf(key, "node%d.total", i);
+            size_t ntotal = getint(data, key);
+            sprintf(key, "node%d.used", i);
+            size_t nused = getint(data, key);
+            sprintf(key, "node%d.free", i);
+            size_t nfree = getint(data, key);
+            printf("%-6d %-7lu MB %-7lu MB %-7lu MB\n", i, ntotal/1000000, nused/1000000, nfree/1000000);
+        }
+    }
+
+    size_t cores = getint(data, "cores");
+
+    if(cores)
+    {
+        printf("\n%-6s %-8s %-12s %-12s\n", "CORE", "CACHED", "HITS", "MISSES");
+    }
+
+    for(int i = 0; i < cores; i++)
+    {
+        sprintf(key, "core%d.cached", i);
+        size_t cached = getint(data, key);
+        sprintf(key, "core%d.hits", i);
+        size_t hits = getint(data, key);
+        sprintf(key, "core%d.misses", i);
+        size_t misses = getint(data, key);
+        printf("%-6d %-8lu %-12lu %-12lu\n", i, cached, hits, misses);
+    }
+
+    size_t caches = getint(data, "caches");
+    char name[32];
+
+    if(caches)
+    {
+        printf("\n%-16s %-6s %-8s %-8s\n", "CACHE", "SIZE", "ACTIVE", "TOTAL");
+    }
+
+    for(int i = 0; i < caches; i++)
+    {
+        sprintf(key, "cache%d.name", i);
+        getstr(data, key, name);
+        sprintf(key, "cache%d.size", i);
+        size_t size = getint(data, key);
+        sprintf(key, "cache%d.active", i);
+        size_t active = getint(data, key);
+        sprintf(key, "cache%d.total", i);
+        size_t total = getint(data, key);
+        printf("%-16s %-6lu %-8lu %-8lu\n", name, size, active, total);
+    }
+
+    len = sys_sysinfo(6, 0, data, bufsz);
+    if(len == bufsz)
+    {
+        printf("error: buffer too small");
+        return 1;
+    }
+
+    size_t images = getint(data, "images");
+    char mount[32];
+
+    if(images)
+    {
+        printf("\n%-16s %-8s %-8s %-8s %-8s %-6s\n", "IMAGE", "MOUNT", "INODE", "PAGES", "LOADED", "REFS");
+    }
+
+    for(int i = 0; i < images; i++)
+    {
+        sprintf(key, "image%d.name", i);
+        getstr(data, key, name);
+        sprintf(key, "image%d.mount", i);
+        getstr(data, key, mount);
+        sprintf(key, "image%d.ino", i);
+        size_t ino = getint(data, key);
+        sprintf(key, "image%d.pages", i);
+        size_t pages = getint(data, key);
+        sprintf(key, "image%d.loaded", i);
+        size_t loaded = getint(data, key);
+        sprintf(key, "image%d.refs", i);
+        size_t refs = getint(data, key);
+        printf("%-16s %-8s %-8lu %-8lu %-8lu %-6lu\n", name, mount, ino, pages, loaded, refs);
+    }
+
     return 0;
 }
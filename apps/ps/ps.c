@@ -23,6 +23,9 @@ typedef struct {
     size_t uid;
     size_t gid;
     size_t mem;
+    size_t flt;
+    size_t small;
+    size_t large;
     size_t cpu;
     size_t nth;
     thread_t threads[];
@@ -186,6 +189,9 @@ void print_pid(int pid)
     p->uid = getint(data, "uid");
     p->gid = getint(data, "gid");
     p->mem = getint(data, "memsz");
+    p->flt = getint(data, "minflt");
+    p->small = getint(data, "smallpages");
+    p->large = getint(data, "largepages");
     p->cpu = 0;
     p->nth = nth;
 
@@ -210,23 +216,29 @@ void print_pid(int pid)
 
     if(tflg)
     {
-        printf("%-6d %-6d %-6s %-16s %-8lu %-8lu %-6c\n",
+        printf("%-6d %-6d %-6s %-16s %-8lu %-8lu %-8lu %-8lu %-8lu %-6c\n",
             p->pid,
             p->ppid,
             "",
             p->name,
             p->mem,
+            p->flt,
+            p->small,
+            p->large,
             p->cpu / 1000000,
             process_state(p)
         );
     }
     else
     {
-        printf("%-6d %-6d %-16s %-8lu %-8lu %-6c\n",
+        printf("%-6d %-6d %-16s %-8lu %-8lu %-8lu %-8lu %-8lu %-6c\n",
             p->pid,
             p->ppid,
             p->name,
             p->mem,
+            p->flt,
+            p->small,
+            p->large,
             p->cpu / 1000000,
             process_state(p)
         );
@@ -241,12 +253,15 @@ void print_pid(int pid)
     for(int i = 0; i < p->nth; i++)
     {
         t = p->threads + i;
-        printf("%-6d %-6d %-6d %-16s %-8s %-8lu %-6c\n",
+        printf("%-6d %-6d %-6d %-16s %-8s %-8s %-8s %-8s %-8lu %-6c\n",
             p->pid,
             p->ppid,
             t->tid,
             t->name,
             "",
+            "",
+            "",
+            "",
             t->cpu / 1000000,
             thread_state(t)
         );
@@ -297,23 +312,29 @@ int main(int argc, char *argv[])
 
     if(tflg)
     {
-        printf("%-6s %-6s %-6s %-16s %-8s %-8s %-6s\n",
+        printf("%-6s %-6s %-6s %-16s %-8s %-8s %-8s %-8s %-8s %-6s\n",
             "PID",
             "PPID",
             "TID",
             "NAME",
             "MEM",
+            "MINFLT",
+            "SMALL",
+            "LARGE",
             "CPU",
             "STATE"
         );
     }
     else
     {
-        printf("%-6s %-6s %-16s %-8s %-8s %-6s\n",
+        printf("%-6s %-6s %-16s %-8s %-8s %-8s %-8s %-8s %-6s\n",
             "PID",
             "PPID",
             "NAME",
             "MEM",
+            "MINFLT",
+            "SMALL",
+            "LARGE",
             "CPU",
             "STATE"
         );
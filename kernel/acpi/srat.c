@@ -1,4 +1,5 @@
 #include <kernel/acpi/srat.h>
+#include <kernel/mem/numa.h>
 
 static srat_t *srat = 0;
 static uint16_t entry_count;
@@ -8,6 +9,8 @@ static uint64_t entry_end;
 void acpi_srat_parse(uint64_t address)
 {
     srat_apic_t *entry;
+    srat_mem_t *mem;
+    srat_x2apic_t *x2apic;
     header_t *hdr;
     uint64_t ptr;
 
@@ -23,6 +26,33 @@ void acpi_srat_parse(uint64_t address)
     while(ptr < entry_end)
     {
         entry = (srat_apic_t*)ptr;
+
+        switch(entry->type)
+        {
+            case SRAT_APIC:
+                if(entry->flags & SRAT_ENABLED)
+                {
+                    numa_add_cpu(entry->lo_pdm | (entry->hi_pdm << 8), entry->apic_id);
+                }
+                break;
+
+            case SRAT_MEMORY:
+                mem = (srat_mem_t*)ptr;
+                if(mem->flags & SRAT_ENABLED)
+                {
+                    numa_add_memory(mem->pdm, mem->range_base, mem->range_length);
+                }
+                break;
+
+            case SRAT_X2APIC:
+                x2apic = (srat_x2apic_t*)ptr;
+                if(x2apic->flags & SRAT_ENABLED)
+                {
+                    numa_add_cpu(x2apic->pdm, x2apic->x2apic_id);
+                }
+                break;
+        }
+
         ptr += entry->length;
         entry_count++;
     }
@@ -2,6 +2,14 @@
 
 #include <kernel/acpi/defs.h>
 
+enum {
+    SRAT_APIC   = 0, // Processor Local APIC Affinity
+    SRAT_MEMORY = 1, // Memory Affinity
+    SRAT_X2APIC = 2, // Processor Local x2APIC Affinity
+};
+
+#define SRAT_ENABLED 1
+
 typedef struct {
     header_t hdr;
     uint8_t reserved[12];
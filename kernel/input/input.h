@@ -17,6 +17,7 @@ void input_mouse_init();
 void input_kbd_usb_boot_protocol(uint64_t curr, uint64_t prev);
 void input_kbd_write(int code, int value);
 void input_kbd_auto_repeat();
+bool input_kbd_repeating();
 void input_kbd_init();
 
 void input_init();
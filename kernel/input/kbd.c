@@ -55,6 +55,11 @@ void input_kbd_auto_repeat()
     }
 }
 
+bool input_kbd_repeating()
+{
+    return (repeat_code != 0);
+}
+
 void input_kbd_write(int code, int value)
 {
     pipe_t *pipe = pipes.head;
@@ -36,4 +36,5 @@ enum {
     ENOACK,       // No ACK from device
     EPIPE,        // Broken pipe
     EFAULT,       // Bad address
+    EAGAIN,       // Resource temporarily unavailable
 };
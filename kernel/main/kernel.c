@@ -2,6 +2,9 @@
 #include <kernel/sched/kthreads.h>
 #include <kernel/sched/scheduler.h>
 #include <kernel/sched/execve.h>
+#include <kernel/sched/futex.h>
+#include <kernel/sched/mutex.h>
+#include <kernel/sched/rcu.h>
 #include <kernel/term/console.h>
 #include <kernel/term/term.h>
 #include <kernel/input/input.h>
@@ -14,6 +17,7 @@
 #include <kernel/x86/isr.h>
 #include <kernel/x86/gdt.h>
 #include <kernel/x86/irq.h>
+#include <kernel/x86/percpu.h>
 #include <kernel/x86/smp.h>
 #include <kernel/x86/fpu.h>
 #include <kernel/mem/heap.h>
@@ -22,6 +26,7 @@
 #include <kernel/mem/mtrr.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/time/timer.h>
 #include <kernel/time/time.h>
 #include <kernel/pci/pci.h>
 #include <kernel/vfs/initrd.h>
@@ -78,6 +83,77 @@ static void system_mount(const char *cmdline)
     }
 }
 
+static void system_bench(const char *cmdline)
+{
+    char list[64];
+
+    if(getstr(cmdline, "bench", list) == NULL)
+    {
+        return;
+    }
+
+    if(strstr(list, "pmm"))
+    {
+        pmm_benchmark();
+    }
+
+    if(strstr(list, "heap"))
+    {
+        heap_benchmark();
+    }
+
+    if(strstr(list, "vmm"))
+    {
+        vmm_benchmark();
+    }
+
+    if(strstr(list, "sched"))
+    {
+        scheduler_benchmark();
+    }
+
+    if(strstr(list, "mutex"))
+    {
+        mutex_benchmark();
+    }
+
+    if(strstr(list, "percpu"))
+    {
+        percpu_benchmark();
+    }
+
+    if(strstr(list, "timer"))
+    {
+        timer_benchmark();
+    }
+
+    if(strstr(list, "sleep"))
+    {
+        thread_sleep_benchmark();
+    }
+
+    if(strstr(list, "rcu"))
+    {
+        rcu_benchmark();
+    }
+}
+
+static void system_lockstat(const char *cmdline)
+{
+    char value[8];
+
+    if(getstr(cmdline, "lockstat", value) == NULL)
+    {
+        return;
+    }
+
+    if(strcmp(value, "on") == 0)
+    {
+        lock_stats_enable();
+        kp_info("main", "recording lock statistics");
+    }
+}
+
 static void spawn_init()
 {
     pid_t pid;
@@ -101,6 +177,7 @@ void kmain(bootstruct_t *bs)
 {
     // Descriptor tables
     gdt_init();
+    percpu_init_boot();
     idt_init();
 
     // Exceptions and stack tracing
@@ -147,6 +224,9 @@ void kmain(bootstruct_t *bs)
     // Information from the ACPI tables are needed by several other modules
     acpi_init(bs->rsdp_address);
 
+    // The SRAT table splits physical memory into NUMA nodes
+    pmm_init_nodes();
+
     // Interrupt handling
     lapic_init();
     ioapic_init();
@@ -157,12 +237,16 @@ void kmain(bootstruct_t *bs)
     // Time
     time_init();
 
+    // Optional lock statistics, read through sysinfo
+    system_lockstat(bs->cmdline);
+
     // File systems
     vfs_init();
     initrd_init(bs->initrd_address, bs->initrd_size);
 
     // Multitasking
     kthreads_init();
+    futex_init();
     smp_init();
     scheduler_init();
 
@@ -176,6 +260,9 @@ void kmain(bootstruct_t *bs)
     acpi_enable();
     pci_route_init();
 
+    // Optional self-benchmarks
+    system_bench(bs->cmdline);
+
     // start init process
     system_mount(bs->cmdline);
     term_switch(1);
@@ -228,3 +228,117 @@ void *list_iterate_reverse(list_t *list, void *item)
     link = item + list->offset;
     return link->prev;
 }
+
+// The following functions are for lists that readers walk forwards without the lock,
+// see rcu.h. Items are published with a release store once their links are set, and
+// removed items keep their next pointer, so a reader standing on one still finds the
+// rest of the list. Removed items may only be freed after a grace period.
+
+void list_insert_rcu(list_t *list, void *item)
+{
+    link_t *link = item + list->offset;
+    link_t *temp;
+
+    acquire_lock(&list->lock);
+
+    link->next = list->head;
+    link->prev = 0;
+    list->length++;
+
+    if(list->tail == 0)
+    {
+        list->tail = item;
+    }
+
+    if(link->next)
+    {
+        temp = link->next + list->offset;
+        temp->prev = item;
+    }
+
+    __atomic_store_n(&list->head, item, __ATOMIC_RELEASE);
+    release_lock(&list->lock);
+}
+
+void list_append_rcu(list_t *list, void *item)
+{
+    link_t *link = item + list->offset;
+    link_t *temp;
+
+    acquire_lock(&list->lock);
+
+    link->prev = list->tail;
+    link->next = 0;
+    list->tail = item;
+    list->length++;
+
+    if(link->prev)
+    {
+        temp = link->prev + list->offset;
+        __atomic_store_n(&temp->next, item, __ATOMIC_RELEASE);
+    }
+    else
+    {
+        __atomic_store_n(&list->head, item, __ATOMIC_RELEASE);
+    }
+
+    release_lock(&list->lock);
+}
+
+bool list_remove_rcu(list_t *list, void *item)
+{
+    link_t *link = item + list->offset;
+    link_t *temp;
+    bool status;
+
+    status = false;
+    acquire_lock(&list->lock);
+
+    if(list->head == item)
+    {
+        __atomic_store_n(&list->head, link->next, __ATOMIC_RELEASE);
+        status = true;
+    }
+
+    if(list->tail == item)
+    {
+        list->tail = link->prev;
+        status = true;
+    }
+
+    if(link->prev)
+    {
+        temp = link->prev + list->offset;
+        __atomic_store_n(&temp->next, link->next, __ATOMIC_RELEASE);
+        status = true;
+    }
+
+    if(link->next)
+    {
+        temp = link->next + list->offset;
+        temp->prev = link->prev;
+        status = true;
+    }
+
+    if(status)
+    {
+        link->prev = 0;
+        list->length--;
+    }
+
+    release_lock(&list->lock);
+    return status;
+}
+
+void *list_iterate_rcu(list_t *list, void *item)
+{
+    link_t *link;
+
+    if(!item)
+    {
+        return __atomic_load_n(&list->head, __ATOMIC_ACQUIRE);
+    }
+
+    link = item + list->offset;
+    return __atomic_load_n(&link->next, __ATOMIC_ACQUIRE);
+}
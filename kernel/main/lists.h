@@ -30,3 +30,8 @@ void *list_pop(list_t *list);
 void *list_head(list_t *list);
 void *list_iterate(list_t *list, void *item);
 void *list_iterate_reverse(list_t *list, void *item);
+
+void list_insert_rcu(list_t *list, void *item);
+void list_append_rcu(list_t *list, void *item);
+bool list_remove_rcu(list_t *list, void *item);
+void *list_iterate_rcu(list_t *list, void *item);
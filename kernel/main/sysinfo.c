@@ -1,5 +1,7 @@
 #include <kernel/sched/process.h>
+#include <kernel/mem/image.h>
 #include <kernel/mem/heap.h>
+#include <kernel/mem/slab.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/sysinfo.h>
@@ -53,6 +55,8 @@ static void sysinfo_meminfo(sysinfo_t *sys)
     sysinfo_write(sys, "total=%lu", total);
     sysinfo_write(sys, "free=%lu", free);
     sysinfo_write(sys, "heap=%lu", heap_get_size());
+    sysinfo_pmminfo(sys);
+    sysinfo_slabinfo(sys);
 }
 
 int sysinfo(size_t req, size_t id, void *buf, size_t len)
@@ -78,6 +82,12 @@ int sysinfo(size_t req, size_t id, void *buf, size_t len)
             break;
         case SI_CPUINFO:
             break;
+        case SI_IMAGES:
+            sysinfo_imagelist(&sys);
+            break;
+        case SI_LOCKSTAT:
+            sysinfo_lockstat(&sys);
+            break;
         default:
             break;
     }
@@ -8,6 +8,8 @@ enum {
     SI_PROCINFO = 3,
     SI_CPULIST  = 4,
     SI_CPUINFO  = 5,
+    SI_IMAGES   = 6,
+    SI_LOCKSTAT = 7,
 };
 
 typedef struct {
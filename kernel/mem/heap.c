@@ -1,11 +1,18 @@
 #include <kernel/mem/heap.h>
 #include <kernel/mem/slmm.h>
+#include <kernel/mem/slab.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/mem/pmm.h>
+#include <kernel/sched/kthreads.h>
+#include <kernel/sched/threads.h>
+#include <kernel/time/time.h>
+#include <kernel/x86/smp.h>
+#include <kernel/atomic.h>
 #include <kernel/debug.h>
 #include <string.h>
 
 static heap_t heap;
+static spinlock_t lock = 0;
 
 // HEAP_HEADER_SIZE must be an integer multiple of HEAP_DATA_ALIGN
 // HEAP_DATA_ALIGN must be able to fit two pointers
@@ -106,78 +113,73 @@ static void glue_chunk(chunk_t *chunk, int prev, int next)
     }
 }
 
-static size_t heap_sbrk(size_t size)
+// Lays out an arena as a free chunk between two guard blocks
+static chunk_t *heap_arena(size_t addr, size_t size)
 {
-    size_t addr, end;
-
-    size = align_size(size, HEAP_SBRK_SIZE);
-    addr = heap.start + heap.size;
-    end = addr + size;
-    size = 0;
+    chunk_t *first, *last, *middle;
 
-    if(end > heap.start + KHEAP_SIZE)
-    {
-        return 0;
-    }
+    // front guard block
+    first = (void*)addr;
+    first->prev = 0;
+    first->next = first + 1;
+    first->size = 0;
+    first->free = 0;
 
-    while(addr < end)
-    {
-        if(vmm_alloc_page(addr))
-        {
-            kp_warn("heap", "failed to expand heap size");
-            break;
-        }
-        else
-        {
-            addr += PAGE_SIZE;
-            size += PAGE_SIZE;
-        }
-    }
+    // rear guard block
+    last = (void*)(addr + size - HEAP_HEADER_SIZE);
+    last->prev = first->next;
+    last->next = 0;
+    last->size = 0;
+    last->free = 0;
 
-    heap.size += size;
-    heap.end += size;
+    // middle free block
+    middle = first->next;
+    middle->prev = first;
+    middle->next = last;
+    middle->size = chunk_size(middle);
+    middle->free = 1;
 
-    return size;
+    return middle;
 }
 
-static chunk_t *heap_expand(size_t size)
+// Maps a new arena with room for size bytes, called without the heap lock
+// The address range is reserved under the lock and mapped after releasing it, so
+// concurrent expansions get separate arenas, each with its own guard blocks.
+static bool heap_expand(size_t size)
 {
-    chunk_t *old;
-    chunk_t *new;
+    chunk_t *middle;
+    uint32_t flags;
+    size_t addr;
+
+    size = align_size(size + 3 * HEAP_HEADER_SIZE, HEAP_SBRK_SIZE);
 
-    // make room for header
-    size = size + HEAP_HEADER_SIZE;
+    acquire_safe_lock(&lock, &flags);
 
-    // allocate memory
-    old = (void*)(heap.end - HEAP_HEADER_SIZE);
-    if(heap_sbrk(size) < size)
+    addr = heap.end;
+    if(addr + size > heap.start + KHEAP_SIZE)
     {
-        return 0;
+        release_safe_lock(&lock, &flags);
+        return false;
     }
-    new = (void*)(heap.end - HEAP_HEADER_SIZE);
-
-    // turn old rear guard into free block
-    old->next = new;
-    old->size = chunk_size(old);
-    old->free = 1;
-
-    // new rear guard
-    new->prev = old;
-    new->next = 0;
-    new->size = 0;
-    new->free = 0;
+    heap.end += size;
 
-    // insert
-    insert_free_chunk(old);
+    release_safe_lock(&lock, &flags);
 
-    // merge when possible
-    if(old->prev->free)
+    // a failed range stays reserved, the heap only grows
+    if(vmm_alloc_range(addr, size, VMM_WRITE) < 0)
     {
-        old = old->prev;
-        glue_chunk(old, 0, 1);
+        kp_warn("heap", "failed to expand heap size");
+        return false;
     }
 
-    return old;
+    middle = heap_arena(addr, size);
+
+    acquire_safe_lock(&lock, &flags);
+    heap.size += size;
+    insert_free_chunk(middle);
+    release_safe_lock(&lock, &flags);
+
+    return true;
 }
 
 static chunk_t *find_free_chunk(size_t size)
@@ -195,13 +197,13 @@ static chunk_t *find_free_chunk(size_t size)
         chunk = chunk[1].next;
     }
 
-    // try to allocate more memory
-    return heap_expand(size);
+    return 0;
 }
 
 static size_t kmalloc_int(size_t size)
 {
     chunk_t *chunk;
+    uint32_t flags;
     size_t addr;
 
     // always returns zero
@@ -212,14 +214,27 @@ static size_t kmalloc_int(size_t size)
 
     if(heap.size)
     {
+        // small sizes are served by the slab allocator
+        addr = (size_t)slab_kmalloc(size);
+        if(addr)
+        {
+            return addr;
+        }
+
         // round size to alignment
         size = align_size(size, HEAP_DATA_ALIGN);
 
-        // find a free chunk
-        chunk = find_free_chunk(size);
-        if(!chunk)
+        acquire_safe_lock(&lock, &flags);
+
+        // find a free chunk, memory is added without holding the lock
+        while(chunk = find_free_chunk(size), !chunk)
         {
-            return 0;
+            release_safe_lock(&lock, &flags);
+            if(!heap_expand(size))
+            {
+                return 0;
+            }
+            acquire_safe_lock(&lock, &flags);
         }
         addr = (size_t)(chunk+1);
 
@@ -228,6 +243,8 @@ static size_t kmalloc_int(size_t size)
 
         // remove chunk from free list
         remove_free_chunk(chunk);
+
+        release_safe_lock(&lock, &flags);
     }
     else
     {
@@ -259,6 +276,14 @@ void *kcalloc(size_t count, size_t size)
 void kfree(void *ptr)
 {
     chunk_t *chunk;
+    uint32_t flags;
+
+    // slab objects live in the physical memory map
+    if(slab_owns(ptr))
+    {
+        slab_kfree(ptr);
+        return;
+    }
 
     // invalid
     if(ptr < (void*)heap.start)
@@ -274,11 +299,15 @@ void kfree(void *ptr)
     // pointer to chunk
     chunk = ptr - HEAP_HEADER_SIZE;
 
+    acquire_safe_lock(&lock, &flags);
+
     // insert as free
     insert_free_chunk(chunk);
 
     // glue chunks when possible
     glue_chunk(chunk, 1, 1);
+
+    release_safe_lock(&lock, &flags);
 }
 
 size_t heap_get_size()
@@ -286,10 +315,120 @@ size_t heap_get_size()
     return heap.size;
 }
 
-void heap_init()
+static void heap_fragmentation(size_t *free, size_t *largest)
 {
-    chunk_t *first, *last, *middle;
+    chunk_t *chunk;
+    uint32_t flags;
+
+    *free = 0;
+    *largest = 0;
+
+    acquire_safe_lock(&lock, &flags);
+
+    for(chunk = heap.free; chunk; chunk = chunk[1].next)
+    {
+        *free += chunk->size;
+        if(chunk->size > *largest)
+        {
+            *largest = chunk->size;
+        }
+    }
+
+    release_safe_lock(&lock, &flags);
+}
+
+#define BENCH_SLOTS 64
+
+static atomic_t bench_ops;
+static atomic_t bench_left;
+static uint64_t bench_start;
+
+static void heap_bench_worker(void *arg)
+{
+    void *slot[BENCH_SLOTS] = {0};
+    uint64_t seed, end, ops = 0;
+    size_t free, largest, active, total;
+    size_t size;
+    int n;
+
+    seed = (uint64_t)arg * 2654435761 + 1;
+    end = bench_start + TIME_NS;
+
+    while(system_timestamp() < end)
+    {
+        for(int i = 0; i < 256; i++)
+        {
+            seed = seed * 6364136223846793005 + 1442695040888963407;
+            n = (seed >> 33) % BENCH_SLOTS;
+
+            if(slot[n])
+            {
+                kfree(slot[n]);
+                slot[n] = 0;
+            }
+            else
+            {
+                // mostly small objects, every 8th one from the chunk heap
+                size = 16 + ((seed >> 40) % 1008);
+                if(((seed >> 20) & 7) == 0)
+                {
+                    size += 1024;
+                }
+                slot[n] = kmalloc(size);
+            }
+            ops++;
+        }
+    }
+
+    for(n = 0; n < BENCH_SLOTS; n++)
+    {
+        kfree(slot[n]);
+    }
+
+    atomic_add_fetch(&bench_ops, ops);
+
+    // the last worker reports
+    if(atomic_dec_fetch(&bench_left) == 0)
+    {
+        heap_fragmentation(&free, &largest);
+        slab_usage(&active, &total);
+
+        kp_info("heap", "%d threads: %lu ops/s", smp_core_count(),
+            (atomic_get(&bench_ops) * TIME_NS) / (system_timestamp() - bench_start));
+        kp_info("heap", "chunks: %lu KiB free, largest %lu KiB", free / 1024, largest / 1024);
+        kp_info("heap", "slabs: %lu/%lu KiB in use", active / 1024, total / 1024);
+    }
+
+    thread_exit();
+}
+
+void heap_benchmark()
+{
+    thread_t *thread;
+    int count;
+
+    count = smp_core_count();
+
+    atomic_set(&bench_ops, 0);
+    atomic_set(&bench_left, count);
+    bench_start = system_timestamp();
 
+    // one worker per core, all running for about a second
+    for(int i = 0; i < count; i++)
+    {
+        thread = kthreads_create("heap-bench", heap_bench_worker, (void*)(uint64_t)i, TPR_MID);
+        if(thread == 0)
+        {
+            kp_warn("heap", "failed to start benchmark thread");
+            atomic_dec_fetch(&bench_left);
+            continue;
+        }
+        kthreads_run(thread);
+    }
+}
+
+void heap_init()
+{
     // initialize heap
     heap.first = 0;
     heap.free = 0;
@@ -298,30 +437,9 @@ void heap_init()
     heap.size = 0;
 
     // allocate initial memory
-    heap_sbrk(1);
-
-    // front guard block
-    first = (void*)heap.start;
-    first->prev = 0;
-    first->next = first + 1;
-    first->size = 0;
-    first->free = 0;
+    heap_expand(1);
+    heap.first = (void*)heap.start;
 
-    // rear guard block
-    last = (void*)(heap.end - HEAP_HEADER_SIZE);
-    last->prev = first->next;
-    last->next = 0;
-    last->size = 0;
-    last->free = 0;
-
-    // middle free block
-    middle = first->next;
-    middle->prev = first;
-    middle->next = last;
-    middle->size = chunk_size(middle);
-    middle->free = 1;
-
-    // store
-    insert_free_chunk(middle);
-    heap.first = first;
+    // size classes for small allocations
+    slab_init();
 }
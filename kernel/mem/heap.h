@@ -23,4 +23,5 @@ void *kcalloc(size_t count, size_t size);
 void kfree(void *ptr);
 
 size_t heap_get_size();
+void heap_benchmark();
 void heap_init();
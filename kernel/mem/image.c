@@ -0,0 +1,252 @@
+#include <kernel/mem/image.h>
+#include <kernel/mem/heap.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/mem/vmm.h>
+#include <kernel/vfs/vfs.h>
+#include <string.h>
+
+// Executable images cache the file pages of binaries, keyed by (mountpoint, inode).
+// Their frames are mapped read-only into every process running the binary and are
+// owned by the cache, so they are never freed by the page tables. Unused images stay
+// cached for the next spawn, until the cache is full or the file has changed.
+
+static LIST_INIT(images, image_t, link);
+static spinlock_t lock = 0;
+
+static void image_free(image_t *image)
+{
+    for(size_t i = 0; i < image->pages; i++)
+    {
+        if(image->frames[i])
+        {
+            pmm_free_frame(image->frames[i]);
+        }
+    }
+
+    kfree(image->frames);
+    kfree(image);
+}
+
+// drop the least recently used images while the cache is full
+static void image_evict(image_t **drop, int *count)
+{
+    image_t *item, *prev;
+
+    item = images.tail;
+    while(item && images.length > IMAGE_CACHE_MAX && *count < IMAGE_CACHE_MAX)
+    {
+        prev = item->link.prev;
+
+        if(item->refs == 0)
+        {
+            list_remove(&images, item);
+            drop[(*count)++] = item;
+        }
+
+        item = prev;
+    }
+}
+
+image_t *image_get(dentry_t *file)
+{
+    image_t *drop[IMAGE_CACHE_MAX];
+    image_t *image, *new;
+    inode_t *ip;
+    int count = 0;
+
+    ip = file->inode;
+
+    new = kzalloc(sizeof(image_t));
+    if(!new)
+    {
+        return 0;
+    }
+
+    new->pages = PAGE_ALIGN(ip->size) / PAGE_SIZE;
+    new->frames = kcalloc(new->pages + 1, sizeof(uint64_t));
+    if(!new->frames)
+    {
+        kfree(new);
+        return 0;
+    }
+
+    strscpy(new->name, file->name, sizeof(new->name));
+    new->mp = file->mp;
+    new->ino = ip->ino;
+    new->mtime = ip->mtime;
+    new->size = ip->size;
+
+    acquire_lock(&lock);
+
+    image = images.head;
+    while(image)
+    {
+        if(image->mp == file->mp && image->ino == ip->ino)
+        {
+            if(image->mtime == ip->mtime && image->size == ip->size)
+            {
+                break;
+            }
+
+            // the file has changed, running processes keep the old image
+            if(image->refs == 0 && count < IMAGE_CACHE_MAX)
+            {
+                list_remove(&images, image);
+                drop[count++] = image;
+                image = images.head;
+                continue;
+            }
+        }
+
+        image = image->link.next;
+    }
+
+    if(image)
+    {
+        // most recently used first
+        list_remove(&images, image);
+        list_insert(&images, image);
+    }
+    else
+    {
+        image = new;
+        new = 0;
+        list_insert(&images, image);
+    }
+
+    image->refs++;
+    image_evict(drop, &count);
+
+    release_lock(&lock);
+
+    if(new)
+    {
+        kfree(new->frames);
+        kfree(new);
+    }
+
+    while(count--)
+    {
+        image_free(drop[count]);
+    }
+
+    return image;
+}
+
+void image_dup(image_t *image)
+{
+    acquire_lock(&lock);
+    image->refs++;
+    release_lock(&lock);
+}
+
+void image_put(image_t *image)
+{
+    acquire_lock(&lock);
+    image->refs--;
+    release_lock(&lock);
+}
+
+// Returns the frame holding the file page at offset, reading it when needed
+uint64_t image_frame(image_t *image, dentry_t *file, size_t offset)
+{
+    uint64_t phys;
+    size_t page;
+    int status;
+
+    page = offset / PAGE_SIZE;
+    if(page >= image->pages)
+    {
+        return 0;
+    }
+
+    phys = image->frames[page];
+    if(phys)
+    {
+        return phys;
+    }
+
+    phys = pmm_alloc_frame();
+    if(!phys)
+    {
+        return 0;
+    }
+
+    memset((void*)vmm_phys_to_virt(phys), 0, PAGE_SIZE);
+    status = vfs_pread(file, page * PAGE_SIZE, PAGE_SIZE, (void*)vmm_phys_to_virt(phys));
+    if(status < 0)
+    {
+        pmm_free_frame(phys);
+        return 0;
+    }
+
+    // another process might have been faster
+    acquire_lock(&lock);
+
+    if(image->frames[page])
+    {
+        release_lock(&lock);
+        pmm_free_frame(phys);
+        return image->frames[page];
+    }
+
+    image->frames[page] = phys;
+    image->loaded++;
+
+    release_lock(&lock);
+    return phys;
+}
+
+// Drop all unused images of a mountpoint, e.g. before it is unmounted
+void image_purge(vfs_mp_t *mp)
+{
+    image_t *drop[IMAGE_CACHE_MAX];
+    image_t *item, *next;
+    int count = 0;
+
+    acquire_lock(&lock);
+
+    item = images.head;
+    while(item && count < IMAGE_CACHE_MAX)
+    {
+        next = item->link.next;
+
+        if(item->mp == mp && item->refs == 0)
+        {
+            list_remove(&images, item);
+            drop[count++] = item;
+        }
+
+        item = next;
+    }
+
+    release_lock(&lock);
+
+    while(count--)
+    {
+        image_free(drop[count]);
+    }
+}
+
+void sysinfo_imagelist(sysinfo_t *sys)
+{
+    image_t *image = 0;
+    int n = 0;
+
+    acquire_lock(&lock);
+
+    sysinfo_write(sys, "images=%u", images.length);
+
+    while(image = list_iterate(&images, image), image)
+    {
+        sysinfo_write(sys, "image%d.name=%s", n, image->name);
+        sysinfo_write(sys, "image%d.mount=%s", n, image->mp->name);
+        sysinfo_write(sys, "image%d.ino=%lu", n, image->ino);
+        sysinfo_write(sys, "image%d.pages=%lu", n, image->pages);
+        sysinfo_write(sys, "image%d.loaded=%lu", n, image->loaded);
+        sysinfo_write(sys, "image%d.refs=%lu", n, image->refs);
+        n++;
+    }
+
+    release_lock(&lock);
+}
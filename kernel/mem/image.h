@@ -0,0 +1,28 @@
+#pragma once
+
+#include <kernel/vfs/types.h>
+#include <kernel/sysinfo.h>
+#include <kernel/lists.h>
+
+#define IMAGE_CACHE_MAX 32
+
+typedef struct {
+    char name[32];      // Name of the executable
+    vfs_mp_t *mp;       // Mountpoint of the executable
+    uint64_t ino;       // Inode number of the executable
+    uint64_t mtime;     // Modification time when the image was created
+    uint64_t size;      // File size when the image was created
+    size_t pages;       // Number of file pages
+    size_t loaded;      // Number of loaded file pages
+    uint64_t *frames;   // Frames of file pages, zero when not loaded
+    size_t refs;        // Number of mappings using the image
+    link_t link;        // Link in list of images
+} image_t;
+
+image_t *image_get(dentry_t *file);
+void image_dup(image_t *image);
+void image_put(image_t *image);
+uint64_t image_frame(image_t *image, dentry_t *file, size_t offset);
+void image_purge(vfs_mp_t *mp);
+
+void sysinfo_imagelist(sysinfo_t *sys);
@@ -1,11 +1,14 @@
 #include <kernel/mem/heap.h>
 #include <kernel/mem/map.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/vfs/vfs.h>
 #include <kernel/errno.h>
 #include <kernel/debug.h>
+#include <string.h>
 
 // TODO: for security reasons we should zero out all memory made available to user space
-// this is relevant in several places, such as brk syscall
+// the brk heap and lazy regions are zeroed on first touch, other regions are not yet
 
 static mm_region_t *find_free_region(list_t *map, size_t length)
 {
@@ -58,6 +61,60 @@ static mm_region_t *find_region(list_t *map, size_t addr)
     return 0;
 }
 
+static mm_region_t *find_mapping(list_t *map, size_t addr, size_t length)
+{
+    mm_region_t *r;
+
+    r = find_region(map, addr);
+    if(r == 0)
+    {
+        return 0;
+    }
+
+    if(r->flags & MAP_FREE)
+    {
+        return 0;
+    }
+
+    // only whole mappings are supported
+    if(r->addr != addr || r->length != PAGE_ALIGN(length))
+    {
+        return 0;
+    }
+
+    return r;
+}
+
+static void merge_region(list_t *map, mm_region_t *r)
+{
+    mm_region_t *next, *prev;
+
+    next = r->link.next;
+    if(next && (next->flags & MAP_FREE) && (r->addr + r->length == next->addr))
+    {
+        r->length += next->length;
+        list_remove(map, next);
+        kfree(next);
+    }
+
+    prev = r->link.prev;
+    if(prev && (prev->flags & MAP_FREE) && (prev->addr + prev->length == r->addr))
+    {
+        prev->length += r->length;
+        list_remove(map, r);
+        kfree(r);
+    }
+}
+
+static void set_page_mode(mm_region_t *r, size_t addr)
+{
+    int w, x;
+
+    x = (r->flags & MAP_EXEC) ? 1 : 0;
+    w = (r->flags & MAP_READONLY) ? 0 : 1;
+    vmm_set_mode(addr, w, x);
+}
+
 static int split_region(list_t *map, mm_region_t *r, size_t length)
 {
     mm_region_t *new;
@@ -85,41 +142,38 @@ static int split_region(list_t *map, mm_region_t *r, size_t length)
     return 0;
 }
 
-static int map_region(mm_region_t *r)
+static int region_flags(mm_region_t *r)
 {
-    size_t offset = 0;
-    size_t addr;
-    int w, x;
+    int flags = 0;
 
-    while(offset < r->length)
+    if((r->flags & MAP_READONLY) == 0)
     {
-        addr = r->addr + offset;
-
-        if(vmm_map_page(addr, r->phys + offset) < 0)
-        {
-            break;
-        }
-
-        if(r->flags & MAP_UC)
-        {
-            vmm_set_caching(addr, PAT_UC);
-        }
-        else if(r->flags & MAP_WC)
-        {
-            vmm_set_caching(addr, PAT_WC);
-        }
+        flags |= VMM_WRITE;
+    }
 
-        x = (r->flags & MAP_EXEC) ? 1 : 0;
-        w = (r->flags & MAP_READONLY) ? 0 : 1;
-        vmm_set_mode(addr, w, x);
+    if(r->flags & MAP_EXEC)
+    {
+        flags |= VMM_EXEC;
+    }
 
-        offset += PAGE_SIZE;
+    if(r->flags & MAP_UC)
+    {
+        flags |= VMM_UC;
+    }
+    else if(r->flags & MAP_WC)
+    {
+        flags |= VMM_WC;
     }
 
-    if(offset < r->length)
+    return flags;
+}
+
+static int map_region(mm_region_t *r)
+{
+    if(vmm_map_range(r->addr, r->phys, r->length, region_flags(r)) < 0)
     {
         kp_error("mmap", "failed to map region: %lx", r->addr);
-        return -1; // failed, need rollback
+        return -1;
     }
 
     return 0;
@@ -151,69 +205,70 @@ static int remap_region(mm_region_t *r)
 
 static int allocate_region(mm_region_t *r)
 {
-    size_t offset = 0;
-    size_t addr;
-    int w, x;
+    int flags = region_flags(r);
 
-    while(offset < r->length)
+    // caching attributes are only applied to small pages
+    if((r->flags & (MAP_UC | MAP_WC)) == 0)
     {
-        addr = r->addr + offset;
-
-        if(vmm_alloc_page(addr) < 0)
-        {
-            break;
-        }
-
-        if(r->flags & MAP_UC)
-        {
-            vmm_set_caching(addr, PAT_UC);
-        }
-        else if(r->flags & MAP_WC)
-        {
-            vmm_set_caching(addr, PAT_WC);
-        }
-
-        x = (r->flags & MAP_EXEC) ? 1 : 0;
-        w = (r->flags & MAP_READONLY) ? 0 : 1;
-        vmm_set_mode(addr, w, x);
+        flags |= VMM_LARGE;
+    }
 
-        offset += PAGE_SIZE;
+    // stacks are handed to user space
+    if(r->flags & MAP_STACK)
+    {
+        flags |= VMM_ZERO;
     }
 
-    if(offset < r->length)
+    if(vmm_alloc_range(r->addr, r->length, flags) < 0)
     {
         kp_error("mmap", "failed to allocate region: %lx", r->addr);
-        return -1; // failed, need rollback
+        return -1;
     }
 
     return 0;
 }
 
+// lazy regions have pages that were never touched, those are skipped
 static int unmap_region(mm_region_t *r)
 {
-    size_t offset = 0;
-    size_t addr;
+    return vmm_unmap_range(r->addr, r->length);
+}
 
-    while(offset < r->length)
+int mm_map(list_t *map, size_t length, int flags, size_t *virt)
+{
+    mm_region_t *r;
+    int status;
+
+    length = PAGE_ALIGN(length);
+
+    r = find_free_region(map, length);
+    if(r == 0)
     {
-        addr = r->addr + offset;
-        if(vmm_free_page(addr) < 0)
-        {
-            break;
-        }
-        offset += PAGE_SIZE;
+        return -ENOMEM;
     }
 
-    if(offset < r->length)
+    status = split_region(map, r, length);
+    if(status < 0)
+    {
+        return status;
+    }
+
+    r->flags = flags;
+
+    if((flags & MAP_LAZY) == 0)
     {
-        kp_error("mmap", "failed to unmap region: %lx", r->addr);
-        return -1; // this should never happen, but we keep the error in case of bugs
+        status = allocate_region(r);
+        if(status < 0)
+        {
+            return status; // region should be merged again
+        }
     }
 
+    *virt = r->addr;
     return 0;
 }
 
-int mm_map(list_t *map, size_t length, int flags, size_t *virt)
+int mm_map_file(list_t *map, dentry_t *file, size_t offset, size_t length, int flags, size_t *virt)
 {
     mm_region_t *r;
     int status;
@@ -232,24 +287,85 @@ int mm_map(list_t *map, size_t length, int flags, size_t *virt)
         return status;
     }
 
-    status = allocate_region(r);
-    if(status < 0)
+    r->flags = flags | MAP_FILE | MAP_LAZY;
+    r->file = file;
+    r->offset = offset;
+    r->filesz = length;
+
+    *virt = r->addr;
+    return 0;
+}
+
+// Add a lazy region at a fixed address, which must not overlap any other region
+// Without a file the region is zero-filled
+int mm_map_fixed(list_t *map, size_t virt, size_t length, int flags, dentry_t *file, size_t offset, size_t filesz)
+{
+    mm_region_t *item = 0;
+    mm_region_t *r;
+
+    if(virt & ALIGN_TEST)
     {
-        return status; // region should be merged again
+        return -EINVAL;
     }
 
-    r->flags = flags;
-    *virt = r->addr;
+    length = PAGE_ALIGN(length);
+
+    // regions are sorted by address
+    while(item = list_iterate(map, item), item)
+    {
+        if(item->addr < virt + length && virt < item->addr + item->length)
+        {
+            return -EEXIST;
+        }
+
+        if(item->addr >= virt + length)
+        {
+            break;
+        }
+    }
+
+    r = kzalloc(sizeof(mm_region_t));
+    if(r == 0)
+    {
+        return -ENOMEM;
+    }
+
+    r->flags = flags | MAP_LAZY | (file ? MAP_FILE : 0);
+    r->addr = virt;
+    r->length = length;
+    r->file = file;
+    r->offset = offset;
+    r->filesz = (file ? filesz : 0);
+
+    if(file && (flags & MAP_IMAGE))
+    {
+        r->image = image_get(file);
+    }
+
+    // without an image the pages are private
+    if(r->image == 0)
+    {
+        r->flags &= ~MAP_IMAGE;
+    }
+
+    if(item)
+    {
+        list_insert_before(map, item, r);
+    }
+    else
+    {
+        list_append(map, r);
+    }
 
     return 0;
 }
 
-int mm_unmap(list_t *map, size_t virt)
+int mm_unmap(list_t *map, size_t virt, size_t length)
 {
     mm_region_t *r;
     int status;
 
-    r = find_region(map, virt);
+    r = find_mapping(map, virt, length);
     if(r == 0)
     {
         return -EINVAL;
@@ -261,8 +377,186 @@ int mm_unmap(list_t *map, size_t virt)
         return status;
     }
 
-    // here we should merge regions instead
+    if(r->flags & MAP_IMAGE)
+    {
+        image_put(r->image);
+    }
+
+    if(r->flags & MAP_FILE)
+    {
+        vfs_unpin(r->file);
+    }
+
     r->flags = MAP_FREE;
+    r->image = 0;
+    r->file = 0;
+    r->offset = 0;
+    r->filesz = 0;
+    merge_region(map, r);
+
+    return 0;
+}
+
+int mm_protect(list_t *map, size_t virt, size_t length, int flags)
+{
+    mm_region_t *r;
+
+    r = find_mapping(map, virt, length);
+    if(r == 0)
+    {
+        return -EINVAL;
+    }
+
+    // only lazy regions belong to user space alone
+    if((r->flags & MAP_LAZY) == 0)
+    {
+        return -EPERM;
+    }
+
+    r->flags &= ~(MAP_READONLY | MAP_EXEC);
+    r->flags |= (flags & (MAP_READONLY | MAP_EXEC));
+
+    // pages that are not present yet get their mode on first access
+    for(size_t offset = 0; offset < r->length; offset += PAGE_SIZE)
+    {
+        set_page_mode(r, r->addr + offset);
+    }
+    vmm_flush_range(r->addr, r->length);
+
+    return 0;
+}
+
+static int map_image_page(mm_region_t *r, size_t addr, int write)
+{
+    uint64_t frame, phys;
+    int status;
+
+    frame = image_frame(r->image, r->file, r->offset + (addr - r->addr));
+    if(frame == 0)
+    {
+        return -ENOMEM;
+    }
+
+    // a write gets a private copy right away
+    if(write)
+    {
+        phys = pmm_alloc_frame();
+        if(phys == 0)
+        {
+            return -ENOMEM;
+        }
+
+        memcpy((void*)vmm_phys_to_virt(phys), (void*)vmm_phys_to_virt(frame), PAGE_SIZE);
+
+        status = vmm_insert_page(addr, phys, region_flags(r));
+        if(status < 0)
+        {
+            pmm_free_frame(phys);
+            return (status == -EEXIST) ? 0 : status;
+        }
+
+        return 0;
+    }
+
+    // shared frames are always read-only, writes are copied on demand
+    status = vmm_map_page(addr, frame, region_flags(r) & ~VMM_WRITE);
+    if(status < 0)
+    {
+        return (status == -EEXIST) ? 0 : status;
+    }
+
+    return 0;
+}
+
+// returns zero when the page was made present
+// the caller holds the address space lock, which keeps r alive across blocking reads
+int mm_fault(list_t *map, size_t addr, size_t error)
+{
+    mm_region_t *r;
+    size_t offset, size, span;
+    uint64_t phys;
+    int status;
+    void *buf;
+
+    r = find_region(map, addr);
+    if(r == 0)
+    {
+        return -EFAULT;
+    }
+
+    if((r->flags & MAP_LAZY) == 0)
+    {
+        return -EFAULT;
+    }
+
+    if((error & FAULT_WRITE) && (r->flags & MAP_READONLY))
+    {
+        return -EFAULT;
+    }
+
+    addr &= ALIGN_MASK;
+    offset = addr - r->addr;
+
+    // write to a shared image page
+    if(error & FAULT_PRESENT)
+    {
+        if((r->flags & MAP_IMAGE) && (error & FAULT_WRITE))
+        {
+            return vmm_copy_page(addr);
+        }
+        return -EFAULT;
+    }
+
+    // whole file pages come from the image cache
+    if((r->flags & MAP_IMAGE) && offset + PAGE_SIZE <= r->filesz)
+    {
+        return map_image_page(r, addr, (error & FAULT_WRITE));
+    }
+
+    // anonymous memory takes a large page when the whole aligned span is in the region
+    span = (addr & LARGE_ALIGN_MASK);
+    if((r->flags & (MAP_FILE | MAP_IMAGE | MAP_UC | MAP_WC)) == 0 &&
+       span >= r->addr && span + LARGE_PAGE_SIZE <= r->addr + r->length)
+    {
+        if(vmm_alloc_large_page(span, region_flags(r) | VMM_ZERO) == 0)
+        {
+            return MM_FAULT_LARGE;
+        }
+    }
+
+    phys = pmm_alloc_zero_frame();
+    if(phys == 0)
+    {
+        return -ENOMEM;
+    }
+
+    buf = (void*)vmm_phys_to_virt(phys);
+
+    // fill the frame before it becomes visible
+    if((r->flags & MAP_FILE) && offset < r->filesz)
+    {
+        size = r->filesz - offset;
+        if(size > PAGE_SIZE)
+        {
+            size = PAGE_SIZE;
+        }
+
+        status = vfs_pread(r->file, r->offset + offset, size, buf);
+        if(status < 0)
+        {
+            pmm_free_frame(phys);
+            return status;
+        }
+    }
+
+    status = vmm_insert_page(addr, phys, region_flags(r));
+    if(status < 0)
+    {
+        pmm_free_frame(phys);
+
+        // another thread was faster
+        return (status == -EEXIST) ? 0 : status;
+    }
 
     return 0;
 }
@@ -339,3 +633,57 @@ int mm_init(list_t *map, size_t addr, size_t length)
 
     return 0;
 }
+
+// Duplicates the regions of another map, the pages themselves are shared by vmm_clone_user_space
+int mm_clone(list_t *map, list_t *src)
+{
+    mm_region_t *r = 0;
+    mm_region_t *new;
+
+    list_init(map, offsetof(mm_region_t, link));
+
+    while(r = list_iterate(src, r), r)
+    {
+        new = kzalloc(sizeof(mm_region_t));
+        if(new == 0)
+        {
+            return -ENOMEM;
+        }
+
+        *new = *r;
+
+        if(new->flags & MAP_IMAGE)
+        {
+            image_dup(new->image);
+        }
+
+        if(new->flags & MAP_FILE)
+        {
+            vfs_pin_dentry(new->file);
+        }
+
+        list_append(map, new);
+    }
+
+    return 0;
+}
+
+// The page tables are destroyed with the address space, this only releases the regions
+void mm_destroy(list_t *map)
+{
+    mm_region_t *r;
+
+    while(r = list_pop(map), r)
+    {
+        if(r->flags & MAP_IMAGE)
+        {
+            image_put(r->image);
+        }
+
+        if(r->flags & MAP_FILE)
+        {
+            vfs_unpin(r->file);
+        }
+        kfree(r);
+    }
+}
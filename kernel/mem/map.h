@@ -1,5 +1,7 @@
 #pragma once
 
+#include <kernel/mem/image.h>
+#include <kernel/vfs/types.h>
 #include <kernel/lists.h>
 
 enum {
@@ -10,20 +12,35 @@ enum {
     MAP_WC       = (1 << 4), // map as write-combining
     MAP_EXEC     = (1 << 5), // map as executable
     MAP_READONLY = (1 << 6), // map as read-only
+    MAP_LAZY     = (1 << 7), // pages are allocated on first access
+    MAP_FILE     = (1 << 8), // pages are read from a file on first access
+    MAP_IMAGE    = (1 << 9), // file pages are shared through the image cache
 };
 
+#define MM_FAULT_LARGE 1 // fault was resolved with a large page
+
 typedef struct {
     size_t flags;   // general flags
     size_t addr;    // virtual address of the mapping
     size_t phys;    // physical address, only present with direct maps
     size_t length;  // length of region
+    dentry_t *file; // backing file, only present with file maps
+    size_t offset;  // offset in the backing file
+    size_t filesz;  // number of bytes backed by the file, the rest is zero
+    image_t *image; // shared executable image, only present with image maps
     link_t link;    // link in list of mappings
 } mm_region_t;
 
 int mm_map(list_t *map, size_t length, int flags, size_t *virt);
-int mm_unmap(list_t *map, size_t virt);
+int mm_map_file(list_t *map, dentry_t *file, size_t offset, size_t length, int flags, size_t *virt);
+int mm_map_fixed(list_t *map, size_t virt, size_t length, int flags, dentry_t *file, size_t offset, size_t filesz);
+int mm_unmap(list_t *map, size_t virt, size_t length);
+int mm_protect(list_t *map, size_t virt, size_t length, int flags);
+int mm_fault(list_t *map, size_t addr, size_t error);
 
 int mm_remap_direct(list_t *map, size_t virt, size_t phys);
 int mm_map_direct(list_t *map, size_t phys, size_t length, int flags, size_t *virt);
 
 int mm_init(list_t *map, size_t addr, size_t length);
+int mm_clone(list_t *map, list_t *src);
+void mm_destroy(list_t *map);
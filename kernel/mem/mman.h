@@ -0,0 +1,12 @@
+#pragma once
+
+// Memory protection (mmap, mprotect)
+#define PROT_NONE  0x00
+#define PROT_READ  0x01
+#define PROT_WRITE 0x02
+#define PROT_EXEC  0x04
+
+// Mapping flags (mmap)
+#define MAP_SHARED    0x01
+#define MAP_PRIVATE   0x02
+#define MAP_ANONYMOUS 0x20
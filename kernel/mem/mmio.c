@@ -7,7 +7,6 @@ static uint64_t mmio_offset = 0;
 int mmio_alloc_uc_region(uint64_t size, uint32_t align, uint64_t *virt, uint64_t *phys)
 {
     uint64_t va, pa;
-    uint32_t offset;
 
     // Check arguments
     if(virt == 0)
@@ -44,8 +43,19 @@ int mmio_alloc_uc_region(uint64_t size, uint32_t align, uint64_t *virt, uint64_t
     size /= PAGE_SIZE;
     align /= PAGE_SIZE;
 
-    // Allocate physical memory
-    pa = pmm_alloc_frames(size, align);
+    // Allocate zeroed physical memory, single frames come from the zero pool
+    if(size == 1)
+    {
+        pa = pmm_alloc_zero_frame();
+    }
+    else
+    {
+        pa = pmm_alloc_frames(size, align);
+        if(pa)
+        {
+            pmm_zero_frames(pa, size);
+        }
+    }
 
     if(pa == 0)
     {
@@ -54,18 +64,11 @@ int mmio_alloc_uc_region(uint64_t size, uint32_t align, uint64_t *virt, uint64_t
 
     va = HWMAP + mmio_offset;
     mmio_offset += (size * PAGE_SIZE);
-    offset = 0;
 
     // Map virtual memory
-    for(int n = 0; n < size; n++)
+    if(vmm_map_range(va, pa, size * PAGE_SIZE, VMM_WRITE | VMM_UC))
     {
-        if(vmm_map_page(va + offset, pa + offset))
-        {
-            return -EFAIL;
-        }
-
-        vmm_set_caching(va + offset, PAT_UC);
-        offset += PAGE_SIZE;
+        return -EFAIL;
     }
 
     // Store results
@@ -79,7 +82,6 @@ int mmio_alloc_uc_region(uint64_t size, uint32_t align, uint64_t *virt, uint64_t
 int mmio_map_wc_region(uint64_t addr, uint64_t size, uint64_t *virt)
 {
     uint64_t va, pa;
-    uint32_t offset;
 
     // Check arguments
     if(virt == 0)
@@ -118,18 +120,11 @@ int mmio_map_wc_region(uint64_t addr, uint64_t size, uint64_t *virt)
     // Map virtual memory
     va = HWMAP + mmio_offset;
     mmio_offset += (size * PAGE_SIZE);
-    offset = 0;
 
     // Map virtual memory
-    for(int n = 0; n < size; n++)
+    if(vmm_map_range(va, pa, size * PAGE_SIZE, VMM_WRITE | VMM_WC))
     {
-        if(vmm_map_page(va + offset, pa + offset))
-        {
-            return -EFAIL;
-        }
-
-        vmm_set_caching(va + offset, PAT_WC);
-        offset += PAGE_SIZE;
+        return -EFAIL;
     }
 
     *virt = va + (addr - pa);
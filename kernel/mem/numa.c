@@ -0,0 +1,94 @@
+#include <kernel/mem/numa.h>
+#include <kernel/debug.h>
+
+// The node map translates the proximity domains of the SRAT table into dense node
+// numbers. Without an SRAT table (or on a single domain) everything is node zero.
+
+static uint32_t domains[NUMA_MAX_NODES];
+static int node_count = 0;
+
+static numa_range_t ranges[NUMA_MAX_RANGES];
+static int range_count = 0;
+
+static uint8_t apic_nodes[256];
+
+static int get_node(uint32_t domain)
+{
+    for(int n = 0; n < node_count; n++)
+    {
+        if(domains[n] == domain)
+        {
+            return n;
+        }
+    }
+
+    if(node_count == NUMA_MAX_NODES)
+    {
+        kp_warn("numa", "domain %u ignored", domain);
+        return 0;
+    }
+
+    domains[node_count] = domain;
+    return node_count++;
+}
+
+void numa_add_memory(uint32_t domain, uint64_t start, uint64_t length)
+{
+    numa_range_t *range;
+
+    if(range_count == NUMA_MAX_RANGES)
+    {
+        kp_warn("numa", "memory range %#lx ignored", start);
+        return;
+    }
+
+    range = ranges + range_count++;
+    range->start = start;
+    range->end = start + length;
+    range->node = get_node(domain);
+
+    kp_info("numa", "node %d: memory %#016lx - %#016lx", range->node, range->start, range->end);
+}
+
+void numa_add_cpu(uint32_t domain, uint32_t apic_id)
+{
+    int node;
+
+    if(apic_id >= 256)
+    {
+        return;
+    }
+
+    node = get_node(domain);
+    apic_nodes[apic_id] = node;
+
+    kp_info("numa", "node %d: apic_id %u", node, apic_id);
+}
+
+int numa_node_count()
+{
+    return (node_count ? node_count : 1);
+}
+
+int numa_addr_node(uint64_t addr)
+{
+    for(int i = 0; i < range_count; i++)
+    {
+        if(addr >= ranges[i].start && addr < ranges[i].end)
+        {
+            return ranges[i].node;
+        }
+    }
+
+    return 0;
+}
+
+int numa_apic_node(uint32_t apic_id)
+{
+    if(apic_id >= 256)
+    {
+        return 0;
+    }
+
+    return apic_nodes[apic_id];
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include <kernel/types.h>
+
+#define NUMA_MAX_NODES  8
+#define NUMA_MAX_RANGES 32
+
+typedef struct {
+    uint64_t start;   // First address of the range
+    uint64_t end;     // First address after the range
+    uint8_t node;     // Node owning the range
+} numa_range_t;
+
+void numa_add_memory(uint32_t domain, uint64_t start, uint64_t length);
+void numa_add_cpu(uint32_t domain, uint32_t apic_id);
+
+int numa_node_count();
+int numa_addr_node(uint64_t addr);
+int numa_apic_node(uint32_t apic_id);
@@ -3,96 +3,642 @@
 #include <kernel/mem/heap.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/sched/spinlock.h>
+#include <kernel/time/time.h>
+#include <kernel/x86/smp.h>
 #include <kernel/debug.h>
 #include <string.h>
 
-#define INDEX(a)     ((a)/64)
-#define OFFSET(a)    ((a)%64)
-#define ADDRESS(a,b) (((a)*64+b)*PAGE_SIZE)
-#define FRAME(a)     ((a)/PAGE_SIZE)
+// Physical memory is managed by a binary buddy allocator. Free memory is kept as
+// naturally aligned blocks of 2^order frames in one free list per order. The frame
+// table holds the list links and the order of every free block, and the first frame
+// of a free block is the only frame with FRAME_FREE set.
 
-static uint64_t *bitmap;
-static uint64_t bitmap_size;
-static uint32_t max_index;
-static uint32_t cur_index;
+// Single frames are handed out through small per-core caches, which are refilled
+// from and drained to the buddy allocator in batches. The buddy allocator itself is
+// protected by a single lock, and the caches are only touched with interrupts disabled.
+
+// Every NUMA node has its own zone of free lists, and blocks never merge across
+// nodes. Allocations are served from the node of the calling core and fall back to
+// the other nodes in order. Until the SRAT table is parsed, all memory is node zero.
+
+// Idle cores keep a bounded pool of frames that are already zeroed. The pool lock is
+// always taken after the buddy lock, and the pool is emptied back into the free lists
+// as soon as an allocation runs out of memory.
+
+#define FRAME(a)   ((a)/PAGE_SIZE)
+#define ADDRESS(f) ((uint64_t)(f)*PAGE_SIZE)
+#define NONE       0xFFFFFFFF
+
+static page_frame_t *frames;
+static uint32_t max_frame;
+static pmm_zone_t zones[NUMA_MAX_NODES];
+static int zone_count = 1;
+
+static pmm_cache_t *caches;
+static int cache_count;
+static spinlock_t lock;
 
 static uint32_t free_pages;
 static uint32_t num_pages;
 
+static uint64_t zero_frames[PMM_ZERO_POOL];
+static uint32_t zero_count;
+static uint64_t zero_hits;
+static uint64_t zero_misses;
+static spinlock_t zero_lock;
+
+static void insert_block(uint32_t f, int order)
+{
+    page_frame_t *frame = frames + f;
+    pmm_zone_t *zone = zones + frame->node;
+
+    frame->order = order;
+    frame->flags |= FRAME_FREE;
+    frame->prev = NONE;
+    frame->next = zone->area[order].head;
+
+    if(frame->next != NONE)
+    {
+        frames[frame->next].prev = f;
+    }
+
+    zone->area[order].head = f;
+    zone->area[order].count++;
+    zone->free_pages += (1 << order);
+    free_pages += (1 << order);
+}
+
+static void remove_block(uint32_t f, int order)
+{
+    page_frame_t *frame = frames + f;
+    pmm_zone_t *zone = zones + frame->node;
+
+    if(frame->prev != NONE)
+    {
+        frames[frame->prev].next = frame->next;
+    }
+    else
+    {
+        zone->area[order].head = frame->next;
+    }
+
+    if(frame->next != NONE)
+    {
+        frames[frame->next].prev = frame->prev;
+    }
+
+    frame->flags &= ~FRAME_FREE;
+    zone->area[order].count--;
+    zone->free_pages -= (1 << order);
+    free_pages -= (1 << order);
+}
+
+static int is_free_block(uint32_t f, int order)
+{
+    if(f + (1 << order) > max_frame)
+    {
+        return 0;
+    }
+
+    if((frames[f].flags & FRAME_FREE) == 0)
+    {
+        return 0;
+    }
+
+    return (frames[f].order == order);
+}
+
+static uint32_t find_block(uint32_t f, int *order)
+{
+    uint32_t head;
+
+    for(int n = 0; n <= PMM_MAX_ORDER; n++)
+    {
+        head = f & ~((1U << n) - 1);
+        if(is_free_block(head, n))
+        {
+            *order = n;
+            return head;
+        }
+    }
+
+    return NONE;
+}
+
+static void free_block(uint32_t f, int order)
+{
+    uint32_t buddy;
+
+    while(order < PMM_MAX_ORDER)
+    {
+        buddy = f ^ (1U << order);
+        if(!is_free_block(buddy, order))
+        {
+            break;
+        }
+
+        if(frames[buddy].node != frames[f].node)
+        {
+            break;
+        }
+
+        remove_block(buddy, order);
+        f &= buddy;
+        order++;
+    }
+
+    insert_block(f, order);
+}
+
+static void free_range(uint32_t f, uint32_t count)
+{
+    int order;
+
+    while(count)
+    {
+        order = (f ? __builtin_ctz(f) : PMM_MAX_ORDER);
+        if(order > PMM_MAX_ORDER)
+        {
+            order = PMM_MAX_ORDER;
+        }
+
+        while((1U << order) > count)
+        {
+            order--;
+        }
+
+        free_block(f, order);
+        f += (1U << order);
+        count -= (1U << order);
+    }
+}
+
+static uint32_t zone_alloc_block(pmm_zone_t *zone, int order)
+{
+    uint32_t f;
+    int n;
+
+    for(n = order; n <= PMM_MAX_ORDER; n++)
+    {
+        if(zone->area[n].head != NONE)
+        {
+            break;
+        }
+    }
+
+    if(n > PMM_MAX_ORDER)
+    {
+        return NONE;
+    }
+
+    f = zone->area[n].head;
+    remove_block(f, n);
+
+    // split until we reach the requested order
+    while(n > order)
+    {
+        n--;
+        insert_block(f + (1U << n), n);
+    }
+
+    return f;
+}
+
+static void release_frame(uint32_t frame);
+
+// Gives the zeroed frames back to the free lists, called with the buddy lock held
+static bool zero_reclaim()
+{
+    uint32_t count;
+
+    acquire_lock(&zero_lock);
+    count = zero_count;
+
+    while(zero_count)
+    {
+        zero_count--;
+        release_frame(FRAME(zero_frames[zero_count]));
+    }
+
+    release_lock(&zero_lock);
+    return (count != 0);
+}
+
+// Try the given node first, then the others
+static uint32_t alloc_block(int node, int order)
+{
+    uint32_t f;
+
+    for(int n = 0; n < zone_count; n++)
+    {
+        f = zone_alloc_block(zones + (node + n) % zone_count, order);
+        if(f != NONE)
+        {
+            return f;
+        }
+    }
+
+    if(zero_reclaim())
+    {
+        return alloc_block(node, order);
+    }
+
+    return NONE;
+}
+
+static uint32_t zone_alloc_contiguous(pmm_zone_t *zone, uint32_t num, uint32_t align)
+{
+    uint32_t size, head, f, n;
+
+    // Requests larger than the maximum order are served from consecutive free blocks of maximum order
+    size = (1U << PMM_MAX_ORDER);
+    head = zone->area[PMM_MAX_ORDER].head;
+
+    while(head != NONE)
+    {
+        if((head % align) == 0)
+        {
+            for(n = 0; n < num; n += size)
+            {
+                if(!is_free_block(head + n, PMM_MAX_ORDER))
+                {
+                    break;
+                }
+            }
+
+            if(n >= num)
+            {
+                for(f = head; f < head + n; f += size)
+                {
+                    remove_block(f, PMM_MAX_ORDER);
+                }
+                free_range(head + num, n - num);
+                return head;
+            }
+        }
+
+        head = frames[head].next;
+    }
+
+    return NONE;
+}
+
+static uint32_t alloc_contiguous(int node, uint32_t num, uint32_t align)
+{
+    uint32_t f;
+
+    for(int n = 0; n < zone_count; n++)
+    {
+        f = zone_alloc_contiguous(zones + (node + n) % zone_count, num, align);
+        if(f != NONE)
+        {
+            return f;
+        }
+    }
+
+    if(zero_reclaim())
+    {
+        return alloc_contiguous(node, num, align);
+    }
+
+    return NONE;
+}
+
+static int order_of(uint32_t num)
+{
+    int order = 0;
+
+    while((1U << order) < num)
+    {
+        order++;
+    }
+
+    return order;
+}
+
+static void release_frame(uint32_t frame)
+{
+    int order;
+
+    if(find_block(frame, &order) != NONE)
+    {
+        return;
+    }
+
+    free_block(frame, 0);
+}
+
+static void reserve_frame(uint32_t frame)
+{
+    uint32_t head, half;
+    int order;
+
+    head = find_block(frame, &order);
+    if(head == NONE)
+    {
+        return;
+    }
+
+    // split the block and keep everything except the frame itself
+    remove_block(head, order);
+
+    while(order > 0)
+    {
+        order--;
+        half = head + (1U << order);
+
+        if(frame >= half)
+        {
+            insert_block(head, order);
+            head = half;
+        }
+        else
+        {
+            insert_block(half, order);
+        }
+    }
+}
+
+static pmm_cache_t *get_cache()
+{
+    int id;
+
+    if(caches == 0)
+    {
+        return 0;
+    }
+
+    id = smp_core_id();
+    if(id < 0 || id >= cache_count)
+    {
+        return 0;
+    }
+
+    if(caches[id].ready == 0)
+    {
+        return 0;
+    }
+
+    return caches + id;
+}
+
+static int local_node()
+{
+    pmm_cache_t *cache;
+    cache = get_cache();
+    return (cache ? cache->node : 0);
+}
+
+static void cache_refill(pmm_cache_t *cache)
+{
+    uint32_t frame;
+
+    acquire_lock(&lock);
+
+    while(cache->count < PMM_CACHE_BATCH)
+    {
+        frame = alloc_block(cache->node, 0);
+        if(frame == NONE)
+        {
+            break;
+        }
+        frames[frame].flags |= FRAME_CACHED;
+        cache->frames[cache->count++] = ADDRESS(frame);
+    }
+
+    release_lock(&lock);
+}
+
+static void cache_drain(pmm_cache_t *cache)
+{
+    uint32_t frame;
+
+    acquire_lock(&lock);
+
+    while(cache->count > PMM_CACHE_SIZE - PMM_CACHE_BATCH)
+    {
+        cache->count--;
+        frame = FRAME(cache->frames[cache->count]);
+        frames[frame].flags &= ~FRAME_CACHED;
+        release_frame(frame);
+    }
+
+    release_lock(&lock);
+}
+
+void pmm_share_frame(uint64_t address)
+{
+    uint32_t frame = FRAME(address);
+
+    if(frame < max_frame)
+    {
+        __atomic_add_fetch(&frames[frame].refs, 1, __ATOMIC_ACQ_REL);
+    }
+}
+
+bool pmm_frame_shared(uint64_t address)
+{
+    uint32_t frame = FRAME(address);
+
+    if(frame >= max_frame)
+    {
+        return false;
+    }
+
+    return __atomic_load_n(&frames[frame].refs, __ATOMIC_ACQUIRE) != 0;
+}
+
+// Returns true for frames that were already freed, called with the buddy lock held
+static bool frame_released(uint32_t frame)
+{
+    int order;
+
+    if(frames[frame].flags & FRAME_CACHED)
+    {
+        return true;
+    }
+
+    return (find_block(frame, &order) != NONE);
+}
+
+// Drops one owner of a shared frame, returns false if the caller was the last one
+static bool frame_unshare(uint32_t frame)
+{
+    uint32_t refs;
+
+    refs = __atomic_load_n(&frames[frame].refs, __ATOMIC_ACQUIRE);
+    while(refs)
+    {
+        if(__atomic_compare_exchange_n(&frames[frame].refs, &refs, refs - 1, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        {
+            return true;
+        }
+    }
+
+    return false;
+}
+
 void pmm_free_frame(uint64_t address)
 {
-    uint32_t frame, index, offset;
-    uint64_t bit;
+    pmm_cache_t *cache;
+    uint32_t frame, flags;
 
     frame = FRAME(address);
-    index = INDEX(frame);
-    offset = OFFSET(frame);
-    bit = (1UL << offset);
 
-    if(index >= max_index)
+    if(frame >= max_frame)
     {
         return;
     }
 
-    if(cur_index > index)
+    if(frame_unshare(frame))
     {
-        cur_index = index;
+        return;
     }
 
-    if((bitmap[index] & bit) == 0)
+    disable_interrupts(&flags);
+    cache = get_cache();
+
+    // remote frames go straight back to their own node
+    if(cache && frames[frame].node != cache->node)
     {
-        bitmap[index] |= bit;
-        free_pages++;
+        cache = 0;
     }
+
+    acquire_lock(&lock);
+
+    // like release_frame, ignore frames that are already cached or part of a free block
+    if(frame_released(frame))
+    {
+        release_lock(&lock);
+        restore_interrupts(&flags);
+        return;
+    }
+
+    if(cache)
+    {
+        frames[frame].flags |= FRAME_CACHED;
+        release_lock(&lock);
+
+        if(cache->count == PMM_CACHE_SIZE)
+        {
+            cache_drain(cache);
+        }
+        cache->frames[cache->count++] = ADDRESS(frame);
+    }
+    else
+    {
+        release_frame(frame);
+        release_lock(&lock);
+    }
+
+    restore_interrupts(&flags);
 }
 
 void pmm_set_frame(uint64_t address)
 {
-    uint32_t frame, index, offset;
-    uint64_t bit;
+    uint32_t frame, flags;
 
     frame = FRAME(address);
-    index = INDEX(frame);
-    offset = OFFSET(frame);
-    bit = (1UL << offset);
 
-    if(index >= max_index)
+    if(frame >= max_frame)
     {
         return;
     }
 
-    if(bitmap[index] & bit)
-    {
-        bitmap[index] &= ~bit;
-        free_pages--;
-    }
+    acquire_safe_lock(&lock, &flags);
+    reserve_frame(frame);
+    release_safe_lock(&lock, &flags);
 }
 
 uint64_t pmm_alloc_frame()
 {
-    uint64_t i, j;
+    pmm_cache_t *cache;
     uint64_t address;
+    uint32_t flags;
 
-    for(i = cur_index; i < max_index; i++)
+    disable_interrupts(&flags);
+    cache = get_cache();
+
+    if(cache == 0)
     {
-        if(bitmap[i])
-        {
-            j = __builtin_ctzl(bitmap[i]);
-            address = ADDRESS(i,j);
-            pmm_set_frame(address);
-            cur_index = i;
-            return address;
-        }
+        restore_interrupts(&flags);
+        return pmm_alloc_order(0);
+    }
+
+    if(cache->count)
+    {
+        cache->hits++;
+    }
+    else
+    {
+        cache->misses++;
+        cache_refill(cache);
+    }
+
+    address = 0;
+    if(cache->count)
+    {
+        address = cache->frames[--cache->count];
+        frames[FRAME(address)].flags &= ~FRAME_CACHED;
+    }
+
+    restore_interrupts(&flags);
+    return address;
+}
+
+uint64_t pmm_alloc_order(int order)
+{
+    uint32_t frame, flags;
+
+    if(order < 0 || order > PMM_MAX_ORDER)
+    {
+        return 0;
+    }
+
+    acquire_safe_lock(&lock, &flags);
+    frame = alloc_block(local_node(), order);
+    release_safe_lock(&lock, &flags);
+
+    if(frame == NONE)
+    {
+        return 0;
+    }
+
+    return ADDRESS(frame);
+}
+
+void pmm_free_order(uint64_t address, int order)
+{
+    uint32_t frame, flags;
+
+    frame = FRAME(address);
+
+    if(order < 0 || order > PMM_MAX_ORDER)
+    {
+        return;
+    }
+
+    if(frame + (1U << order) > max_frame)
+    {
+        return;
+    }
+
+    acquire_safe_lock(&lock, &flags);
+
+    // a double free leaves the block alone
+    if(!frame_released(frame))
+    {
+        free_block(frame, order);
     }
 
-    return 0;
+    release_safe_lock(&lock, &flags);
 }
 
 uint64_t pmm_alloc_frames(uint32_t num, uint32_t align)
 {
-    uint64_t i, j, bit;
-    uint32_t count = 0;
-    uint64_t start = 0;
+    uint32_t frame, size, flags;
+    int order;
 
     if(num == 0)
     {
@@ -103,53 +649,136 @@ uint64_t pmm_alloc_frames(uint32_t num, uint32_t align)
     {
         return 0;
     }
+
+    // Blocks of order n are aligned to 2^n frames, so the alignment is rounded up to a power of two
+    order = order_of(num > align ? num : align);
+    acquire_safe_lock(&lock, &flags);
+
+    if(order > PMM_MAX_ORDER)
+    {
+        frame = alloc_contiguous(local_node(), num, 1U << order_of(align));
+    }
     else
     {
-        align *= PAGE_SIZE;
+        frame = alloc_block(local_node(), order);
+        size = (1U << order);
+
+        // return the unused tail of the block
+        if(frame != NONE && size > num)
+        {
+            free_range(frame + num, size - num);
+        }
     }
 
-    for(i = cur_index; i < max_index; i++)
+    release_safe_lock(&lock, &flags);
+
+    if(frame == NONE)
     {
-        for(j = 0; j < 64; j++)
+        return 0;
+    }
+
+    return ADDRESS(frame);
+}
+
+// Non-temporal stores bypass the caches, so zeroing does not evict the working set
+void pmm_zero_frames(uint64_t address, uint32_t count)
+{
+    uint64_t *ptr, *end;
+
+    ptr = (uint64_t*)vmm_phys_to_virt(address);
+    end = ptr + (count * PAGE_SIZE) / sizeof(uint64_t);
+
+    for(; ptr < end; ptr += 4)
+    {
+        asm volatile("movnti %1, 0(%0)\n"
+                     "movnti %1, 8(%0)\n"
+                     "movnti %1, 16(%0)\n"
+                     "movnti %1, 24(%0)\n"
+                     :: "r"(ptr), "r"(0UL) : "memory");
+    }
+
+    // the stores are weakly ordered
+    asm volatile("sfence" ::: "memory");
+}
+
+uint64_t pmm_alloc_zero_frame()
+{
+    uint64_t address = 0;
+    uint32_t flags;
+
+    acquire_safe_lock(&zero_lock, &flags);
+
+    if(zero_count)
+    {
+        address = zero_frames[--zero_count];
+        zero_hits++;
+    }
+    else
+    {
+        zero_misses++;
+    }
+
+    release_safe_lock(&zero_lock, &flags);
+
+    if(address == 0)
+    {
+        address = pmm_alloc_frame();
+        if(address)
         {
-            bit = (1UL << j);
+            memset((void*)vmm_phys_to_virt(address), 0, PAGE_SIZE);
+        }
+    }
 
-            if(bitmap[i] & bit)
-            {
-                if(count == 0)
-                {
-                    start = ADDRESS(i,j);
-                }
+    return address;
+}
 
-                if(start % align)
-                {
-                    count = 0;
-                }
-                else
-                {
-                    count++;
-                }
-            }
-            else
-            {
-                count = 0;
-            }
+// Zeroes a batch of frames for the pool, as long as memory is not running low
+void pmm_zero_idle()
+{
+    uint64_t batch[PMM_ZERO_BATCH];
+    uint32_t flags;
+    int n;
 
-            if(count == num)
-            {
-                pmm_set_reserved(start, count * PAGE_SIZE);
-                return start;
-            }
+    if(__atomic_load_n(&zero_count, __ATOMIC_RELAXED) >= PMM_ZERO_POOL)
+    {
+        return;
+    }
+
+    if(free_pages < num_pages / PMM_ZERO_RESERVE)
+    {
+        return;
+    }
+
+    for(n = 0; n < PMM_ZERO_BATCH; n++)
+    {
+        batch[n] = pmm_alloc_frame();
+        if(batch[n] == 0)
+        {
+            break;
         }
+        pmm_zero_frames(batch[n], 1);
     }
 
-    return 0;
+    acquire_safe_lock(&zero_lock, &flags);
+
+    while(n && zero_count < PMM_ZERO_POOL)
+    {
+        zero_frames[zero_count++] = batch[--n];
+    }
+
+    release_safe_lock(&zero_lock, &flags);
+
+    while(n)
+    {
+        pmm_free_frame(batch[--n]);
+    }
 }
 
 void pmm_set_available(uint64_t start, uint64_t size)
 {
     uint64_t end = start + size;
     uint64_t addr = start;
+    uint32_t flags;
 
     // Ignore small chunks
     if(size < 0x100000)
@@ -167,11 +796,24 @@ void pmm_set_available(uint64_t start, uint64_t size)
         addr += PAGE_SIZE;
     }
 
+    // Clamp to the frame table
+    if(FRAME(end) > max_frame)
+    {
+        end = ADDRESS(max_frame);
+    }
+
     // Mark as available
-    while(addr < end)
+    if(addr < end)
     {
-        pmm_free_frame(addr);
-        addr += PAGE_SIZE;
+        acquire_safe_lock(&lock, &flags);
+
+        for(uint32_t f = FRAME(addr); f < FRAME(end); f++)
+        {
+            frames[f].flags |= FRAME_USABLE;
+        }
+
+        free_range(FRAME(addr), FRAME(end - addr));
+        release_safe_lock(&lock, &flags);
     }
 }
 
@@ -179,6 +821,7 @@ void pmm_set_reserved(uint64_t start, uint64_t size)
 {
     uint64_t end = start + size;
     uint64_t addr = start;
+    uint32_t flags;
 
     // Align start address
     addr &= ALIGN_MASK;
@@ -190,17 +833,34 @@ void pmm_set_reserved(uint64_t start, uint64_t size)
         end += PAGE_SIZE;
     }
 
+    // Clamp to the frame table
+    if(FRAME(end) > max_frame)
+    {
+        end = ADDRESS(max_frame);
+    }
+
     // Mark as reserved
+    acquire_safe_lock(&lock, &flags);
+
     while(addr < end)
     {
-        pmm_set_frame(addr);
+        reserve_frame(FRAME(addr));
         addr += PAGE_SIZE;
     }
+
+    release_safe_lock(&lock, &flags);
 }
 
 size_t pmm_free_pages()
 {
-    return free_pages;
+    size_t count = free_pages + zero_count;
+
+    for(int i = 0; i < cache_count; i++)
+    {
+        count += caches[i].count;
+    }
+
+    return count;
 }
 
 size_t pmm_usable_pages()
@@ -208,26 +868,179 @@ size_t pmm_usable_pages()
     return num_pages;
 }
 
+void pmm_benchmark()
+{
+    uint64_t addr[32];
+    uint64_t start, elapsed, count;
+    int n, m;
+
+    for(int order = 0; order <= 9; order++)
+    {
+        count = 0;
+        start = system_timestamp();
+
+        for(int round = 0; round < 1000; round++)
+        {
+            for(n = 0; n < 32; n++)
+            {
+                addr[n] = pmm_alloc_order(order);
+                if(addr[n] == 0)
+                {
+                    break;
+                }
+            }
+
+            for(m = 0; m < n; m++)
+            {
+                pmm_free_order(addr[m], order);
+            }
+
+            count += n;
+        }
+
+        elapsed = system_timestamp() - start;
+        if(elapsed == 0)
+        {
+            elapsed = 1;
+        }
+
+        kp_info("pmm", "order %d: %lu allocations/s", order, (count * TIME_NS) / elapsed);
+    }
+}
+
+void sysinfo_pmminfo(sysinfo_t *sys)
+{
+    pmm_cache_t *cache;
+    pmm_zone_t *zone;
+
+    sysinfo_write(sys, "nodes=%d", zone_count);
+
+    for(int i = 0; i < zone_count; i++)
+    {
+        zone = zones + i;
+        sysinfo_write(sys, "node%d.total=%lu", i, (size_t)zone->num_pages * PAGE_SIZE);
+        sysinfo_write(sys, "node%d.free=%lu", i, (size_t)zone->free_pages * PAGE_SIZE);
+        sysinfo_write(sys, "node%d.used=%lu", i, (size_t)(zone->num_pages - zone->free_pages) * PAGE_SIZE);
+    }
+
+    sysinfo_write(sys, "zero.pool=%u", zero_count);
+    sysinfo_write(sys, "zero.hits=%lu", zero_hits);
+    sysinfo_write(sys, "zero.misses=%lu", zero_misses);
+    sysinfo_write(sys, "cores=%d", cache_count);
+
+    for(int i = 0; i < cache_count; i++)
+    {
+        cache = caches + i;
+        sysinfo_write(sys, "core%d.cached=%u", i, cache->count);
+        sysinfo_write(sys, "core%d.hits=%lu", i, cache->hits);
+        sysinfo_write(sys, "core%d.misses=%lu", i, cache->misses);
+    }
+}
+
+void pmm_init_core(int count, int id)
+{
+    size_t addr;
+
+    if(caches == 0)
+    {
+        // keep each cache on its own cache lines
+        addr = (size_t)kzalloc(count * sizeof(pmm_cache_t) + 64);
+        addr = (addr + 63) & -64UL;
+        caches = (pmm_cache_t*)addr;
+        cache_count = count;
+    }
+
+    caches[id].node = numa_apic_node(smp_core_apic_id(id));
+    caches[id].ready = 1;
+}
+
+// Moves all free memory into the zone of its node, once the node map is known
+void pmm_init_nodes()
+{
+    uint32_t f, flags;
+    int order;
+
+    if(numa_node_count() < 2)
+    {
+        return;
+    }
+
+    acquire_safe_lock(&lock, &flags);
+
+    // take every free block out of zone zero
+    for(f = 0; f < max_frame; f += (1U << order))
+    {
+        order = 0;
+        if(frames[f].flags & FRAME_FREE)
+        {
+            order = frames[f].order;
+            remove_block(f, order);
+            frames[f].flags |= FRAME_MOVE;
+        }
+    }
+
+    zone_count = numa_node_count();
+    zones[0].num_pages = 0;
+
+    for(f = 0; f < max_frame; f++)
+    {
+        frames[f].node = numa_addr_node(ADDRESS(f));
+        if(frames[f].flags & FRAME_USABLE)
+        {
+            zones[frames[f].node].num_pages++;
+        }
+    }
+
+    // free them again, now they merge within their node only
+    for(f = 0; f < max_frame; f += (1U << order))
+    {
+        order = 0;
+        if(frames[f].flags & FRAME_MOVE)
+        {
+            order = frames[f].order;
+            frames[f].flags &= ~FRAME_MOVE;
+            free_range(f, 1U << order);
+        }
+    }
+
+    release_safe_lock(&lock, &flags);
+
+    for(int n = 0; n < zone_count; n++)
+    {
+        kp_info("pmm", "node %d: %u of %u pages free", n, zones[n].free_pages, zones[n].num_pages);
+    }
+}
+
 void pmm_init()
 {
-    // Size of bitmap
-    bitmap_size = e820_report_end(1);
-    bitmap_size &= ALIGN_MASK;
-    bitmap_size /= PAGE_SIZE;
-    max_index = INDEX(bitmap_size);
-    bitmap_size /= sizeof(uint64_t);
+    uint64_t size;
+
+    // Size of frame table
+    max_frame = FRAME(e820_report_end(1) & ALIGN_MASK);
+    size = max_frame * sizeof(page_frame_t);
 
-    // Allocate bitmap
-    bitmap = kzalloc(bitmap_size);
+    // Allocate frame table
+    frames = kzalloc(size);
 
     // Find available memory
-    cur_index = 0;
+    for(int z = 0; z < NUMA_MAX_NODES; z++)
+    {
+        for(int n = 0; n <= PMM_MAX_ORDER; n++)
+        {
+            zones[z].area[n].head = NONE;
+            zones[z].area[n].count = 0;
+        }
+        zones[z].free_pages = 0;
+        zones[z].num_pages = 0;
+    }
+
     free_pages = 0;
     e820_report_available();
     num_pages = free_pages;
+    zones[0].num_pages = num_pages;
     slmm_report_reserved(1);
 
     // Log info
-    kp_info("pmm", "created %d kb bitmap, controlling %d pages", bitmap_size/1024, bitmap_size*8);
+    kp_info("pmm", "created %d kb frame table, controlling %d pages", size/1024, max_frame);
     kp_info("pmm", "free memory: %d pages (%d kb)", free_pages, free_pages*(PAGE_SIZE/1024));
 }
@@ -1,16 +1,74 @@
 #pragma once
 
+#include <kernel/mem/numa.h>
+#include <kernel/sysinfo.h>
 #include <kernel/types.h>
 
+#define PMM_MAX_ORDER    10
+#define PMM_CACHE_SIZE   64
+#define PMM_CACHE_BATCH  32
+#define PMM_ZERO_POOL    512 // zeroed frames kept for allocations
+#define PMM_ZERO_BATCH   16  // frames zeroed per idle round
+#define PMM_ZERO_RESERVE 16  // no zeroing below 1/16 of memory free
+
+enum {
+    FRAME_FREE   = (1 << 0), // first frame of a free block
+    FRAME_USABLE = (1 << 1), // frame is part of usable memory
+    FRAME_MOVE   = (1 << 2), // free block while the zones are rebuilt
+    FRAME_CACHED = (1 << 3), // frame is held by a per-core cache
+};
+
+typedef struct {
+    uint32_t next;  // Next free block of the same order
+    uint32_t prev;  // Previous free block of the same order
+    uint32_t refs;  // Additional owners of a shared frame (wide enough for every possible mapping)
+    uint8_t order;  // Order of the block (only valid when free)
+    uint8_t flags;  // Frame flags
+    uint8_t node;   // NUMA node of the frame
+} page_frame_t;
+
+typedef struct {
+    uint32_t head;  // First free block
+    uint32_t count; // Number of free blocks
+} free_area_t;
+
+typedef struct {
+    free_area_t area[PMM_MAX_ORDER+1]; // Free blocks per order
+    uint32_t free_pages;               // Number of free pages
+    uint32_t num_pages;                // Number of usable pages
+} pmm_zone_t;
+
+typedef struct {
+    uint32_t ready;                   // Cache is in use
+    uint32_t count;                   // Number of cached frames
+    uint32_t node;                    // NUMA node of the core
+    uint64_t hits;                    // Allocations served from the cache
+    uint64_t misses;                  // Allocations that required a refill
+    uint64_t frames[PMM_CACHE_SIZE];  // Addresses of cached frames
+} __attribute__((aligned(64))) pmm_cache_t;
+
 void pmm_free_frame(uint64_t);
+void pmm_share_frame(uint64_t);
+bool pmm_frame_shared(uint64_t);
 void pmm_set_frame(uint64_t);
 
 uint64_t pmm_alloc_frame();
 uint64_t pmm_alloc_frames(uint32_t, uint32_t);
+uint64_t pmm_alloc_zero_frame();
+void pmm_zero_frames(uint64_t, uint32_t);
+void pmm_zero_idle();
+
+uint64_t pmm_alloc_order(int);
+void pmm_free_order(uint64_t, int);
 
 void pmm_set_available(uint64_t, uint64_t);
 void pmm_set_reserved(uint64_t, uint64_t);
 
 size_t pmm_usable_pages();
 size_t pmm_free_pages();
+void pmm_benchmark();
+void pmm_init_core(int, int);
+void pmm_init_nodes();
 void pmm_init();
+
+void sysinfo_pmminfo(sysinfo_t *sys);
@@ -0,0 +1,370 @@
+#include <kernel/mem/heap.h>
+#include <kernel/mem/slab.h>
+#include <kernel/mem/pmm.h>
+#include <kernel/mem/vmm.h>
+#include <string.h>
+#include <stdio.h>
+
+// Every slab is a single page taken from the physical memory map. The slab header
+// sits at the start of the page, so the slab of an object is found by masking its
+// address, and free objects are chained through their first word.
+
+// Each cache has a small per-core stack of objects in front of the slabs. It is only
+// touched with interrupts disabled on its own core, and it is refilled and flushed in
+// batches under the cache lock.
+
+#define SLAB_HEADER_SIZE ((sizeof(slab_t) + 15) & -16UL)
+#define SLAB_CLASSES     7
+
+static LIST_INIT(caches, kmem_cache_t, link);
+static kmem_cache_t kmalloc_caches[SLAB_CLASSES];
+static bool cpu_ready[SMP_MAX_CORES];
+static int ready = 0;
+
+static void cache_init(kmem_cache_t *cache, const char *name, size_t size)
+{
+    size = (size + 15) & -16UL;
+
+    strscpy(cache->name, name, sizeof(cache->name));
+    cache->size = size;
+    cache->count = (PAGE_SIZE - SLAB_HEADER_SIZE) / size;
+    cache->active = 0;
+    cache->slabs = 0;
+    cache->lock = 0;
+
+    list_init(&cache->partial, offsetof(slab_t, link));
+    list_init(&cache->full, offsetof(slab_t, link));
+    list_append(&caches, cache);
+}
+
+static slab_t *slab_create(kmem_cache_t *cache)
+{
+    uint64_t phys;
+    slab_t *slab;
+    void *obj;
+
+    phys = pmm_alloc_frame();
+    if(phys == 0)
+    {
+        return 0;
+    }
+
+    slab = (slab_t*)vmm_phys_to_virt(phys);
+    slab->magic = SLAB_MAGIC;
+    slab->cache = cache;
+    slab->free = 0;
+    slab->inuse = 0;
+
+    // chain all objects, lowest address first
+    obj = (void*)slab + SLAB_HEADER_SIZE + (cache->count * cache->size);
+    for(int n = 0; n < cache->count; n++)
+    {
+        obj -= cache->size;
+        *(void**)obj = slab->free;
+        slab->free = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+static void slab_destroy(kmem_cache_t *cache, slab_t *slab)
+{
+    cache->slabs--;
+    slab->magic = 0;
+    pmm_free_frame(vmm_virt_to_phys((uint64_t)slab));
+}
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size)
+{
+    kmem_cache_t *cache;
+
+    if(size > SLAB_MAX_SIZE)
+    {
+        return 0;
+    }
+
+    if(size < SLAB_MIN_SIZE)
+    {
+        size = SLAB_MIN_SIZE;
+    }
+
+    // the heap only aligns to 16 bytes, the per-core stacks need their own cache lines
+    cache = kzalloc(sizeof(kmem_cache_t) + 63);
+    if(cache == 0)
+    {
+        return 0;
+    }
+    cache = (kmem_cache_t*)(((uint64_t)cache + 63) & -64UL);
+
+    cache_init(cache, name, size);
+    return cache;
+}
+
+static kmem_cpu_t *get_cpu(kmem_cache_t *cache)
+{
+    int id;
+
+    id = smp_core_id();
+    if(id < 0 || id >= SMP_MAX_CORES)
+    {
+        return 0;
+    }
+
+    if(!cpu_ready[id])
+    {
+        return 0;
+    }
+
+    return cache->cpu + id;
+}
+
+static size_t get_cached(kmem_cache_t *cache)
+{
+    size_t count = 0;
+
+    for(int i = 0; i < SMP_MAX_CORES; i++)
+    {
+        count += cache->cpu[i].count;
+    }
+
+    return count;
+}
+
+static void *slab_alloc(kmem_cache_t *cache)
+{
+    slab_t *slab;
+    void *obj;
+
+    slab = list_head(&cache->partial);
+    if(slab == 0)
+    {
+        slab = slab_create(cache);
+        if(slab == 0)
+        {
+            return 0;
+        }
+        list_insert(&cache->partial, slab);
+    }
+
+    obj = slab->free;
+    slab->free = *(void**)obj;
+    slab->inuse++;
+    cache->active++;
+
+    if(slab->free == 0)
+    {
+        list_remove(&cache->partial, slab);
+        list_insert(&cache->full, slab);
+    }
+
+    return obj;
+}
+
+static void slab_free(kmem_cache_t *cache, void *ptr)
+{
+    slab_t *slab;
+
+    slab = (slab_t*)((uint64_t)ptr & ALIGN_MASK);
+
+    if(slab->free == 0)
+    {
+        list_remove(&cache->full, slab);
+        list_insert(&cache->partial, slab);
+    }
+
+    *(void**)ptr = slab->free;
+    slab->free = ptr;
+    slab->inuse--;
+    cache->active--;
+
+    // keep one partial slab around, return the rest to the PMM when they become empty
+    if(slab->inuse == 0 && cache->partial.length > 1)
+    {
+        list_remove(&cache->partial, slab);
+        slab_destroy(cache, slab);
+    }
+}
+
+void *kmem_cache_alloc(kmem_cache_t *cache)
+{
+    kmem_cpu_t *cpu;
+    uint32_t flags;
+    void *obj;
+
+    disable_interrupts(&flags);
+    cpu = get_cpu(cache);
+
+    if(cpu && cpu->count)
+    {
+        obj = cpu->objs[--cpu->count];
+        restore_interrupts(&flags);
+        return obj;
+    }
+
+    acquire_lock(&cache->lock);
+
+    if(cpu)
+    {
+        while(cpu->count < SLAB_CPU_BATCH)
+        {
+            obj = slab_alloc(cache);
+            if(obj == 0)
+            {
+                break;
+            }
+            cpu->objs[cpu->count++] = obj;
+        }
+
+        obj = (cpu->count ? cpu->objs[--cpu->count] : 0);
+    }
+    else
+    {
+        obj = slab_alloc(cache);
+    }
+
+    release_lock(&cache->lock);
+    restore_interrupts(&flags);
+
+    return obj;
+}
+
+void kmem_cache_free(kmem_cache_t *cache, void *ptr)
+{
+    kmem_cpu_t *cpu;
+    uint32_t flags;
+
+    if(ptr == 0)
+    {
+        return;
+    }
+
+    disable_interrupts(&flags);
+    cpu = get_cpu(cache);
+
+    if(cpu && cpu->count < SLAB_CPU_SIZE)
+    {
+        cpu->objs[cpu->count++] = ptr;
+        restore_interrupts(&flags);
+        return;
+    }
+
+    acquire_lock(&cache->lock);
+
+    if(cpu)
+    {
+        while(cpu->count > SLAB_CPU_SIZE - SLAB_CPU_BATCH)
+        {
+            slab_free(cache, cpu->objs[--cpu->count]);
+        }
+        cpu->objs[cpu->count++] = ptr;
+    }
+    else
+    {
+        slab_free(cache, ptr);
+    }
+
+    release_lock(&cache->lock);
+    restore_interrupts(&flags);
+}
+
+void *slab_kmalloc(size_t size)
+{
+    int index = 0;
+
+    if(!ready)
+    {
+        return 0;
+    }
+
+    if(size > SLAB_MAX_SIZE)
+    {
+        return 0;
+    }
+
+    while((SLAB_MIN_SIZE << index) < size)
+    {
+        index++;
+    }
+
+    return kmem_cache_alloc(kmalloc_caches + index);
+}
+
+void slab_kfree(void *ptr)
+{
+    slab_t *slab;
+    slab = (slab_t*)((uint64_t)ptr & ALIGN_MASK);
+    kmem_cache_free(slab->cache, ptr);
+}
+
+// Other pages of the physical memory map are told apart by the slab header
+bool slab_owns(void *ptr)
+{
+    uint64_t addr = (uint64_t)ptr;
+    slab_t *slab;
+
+    if(addr < IDMAP || addr >= IDMAP + IDMAP_SIZE)
+    {
+        return false;
+    }
+
+    // objects never overlap the header
+    if((addr & ALIGN_TEST) < SLAB_HEADER_SIZE)
+    {
+        return false;
+    }
+
+    slab = (slab_t*)(addr & ALIGN_MASK);
+    return (slab->magic == SLAB_MAGIC);
+}
+
+void sysinfo_slabinfo(sysinfo_t *sys)
+{
+    kmem_cache_t *cache = 0;
+    int n = 0;
+
+    sysinfo_write(sys, "caches=%u", caches.length);
+
+    while(cache = list_iterate(&caches, cache), cache)
+    {
+        sysinfo_write(sys, "cache%d.name=%s", n, cache->name);
+        sysinfo_write(sys, "cache%d.size=%lu", n, cache->size);
+        sysinfo_write(sys, "cache%d.active=%lu", n, cache->active - get_cached(cache));
+        sysinfo_write(sys, "cache%d.total=%lu", n, cache->slabs * cache->count);
+        n++;
+    }
+}
+
+void slab_usage(size_t *active, size_t *total)
+{
+    kmem_cache_t *cache = 0;
+
+    *active = 0;
+    *total = 0;
+
+    while(cache = list_iterate(&caches, cache), cache)
+    {
+        *active += cache->size * (cache->active - get_cached(cache));
+        *total += cache->size * cache->slabs * cache->count;
+    }
+}
+
+void slab_init_core(int id)
+{
+    cpu_ready[id] = true;
+}
+
+void slab_init()
+{
+    char name[24];
+    size_t size;
+
+    for(int n = 0; n < SLAB_CLASSES; n++)
+    {
+        size = (SLAB_MIN_SIZE << n);
+        sprintf(name, "kmalloc-%lu", size);
+        cache_init(kmalloc_caches + n, name, size);
+    }
+
+    ready = 1;
+}
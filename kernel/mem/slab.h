@@ -0,0 +1,50 @@
+#pragma once
+
+#include <kernel/x86/smp.h>
+#include <kernel/sysinfo.h>
+#include <kernel/lists.h>
+
+#define SLAB_MIN_SIZE  16
+#define SLAB_MAX_SIZE  1024
+#define SLAB_CPU_SIZE  16
+#define SLAB_CPU_BATCH 8
+#define SLAB_MAGIC     0x51AB51AB
+
+typedef struct {
+    uint32_t count;               // Number of cached objects
+    void *objs[SLAB_CPU_SIZE];    // Cached objects
+} __attribute__((aligned(64))) kmem_cpu_t;
+
+typedef struct {
+    char name[24];     // Name of the cache
+    size_t size;       // Object size
+    size_t count;      // Number of objects per slab
+    size_t active;     // Number of allocated objects
+    size_t slabs;      // Number of slabs
+    list_t partial;    // Slabs with free objects
+    list_t full;       // Slabs without free objects
+    spinlock_t lock;   // Lock for this struct
+    link_t link;       // Link in list of caches
+    kmem_cpu_t cpu[SMP_MAX_CORES]; // Per-core object caches
+} kmem_cache_t;
+
+typedef struct {
+    uint64_t magic;      // SLAB_MAGIC while the page is a slab
+    kmem_cache_t *cache; // Cache owning the slab
+    void *free;          // First free object
+    size_t inuse;        // Number of allocated objects
+    link_t link;         // Link in partial or full list
+} slab_t;
+
+kmem_cache_t *kmem_cache_create(const char *name, size_t size);
+void *kmem_cache_alloc(kmem_cache_t *cache);
+void kmem_cache_free(kmem_cache_t *cache, void *ptr);
+
+void *slab_kmalloc(size_t size);
+void slab_kfree(void *ptr);
+bool slab_owns(void *ptr);
+void slab_usage(size_t *active, size_t *total);
+
+void sysinfo_slabinfo(sysinfo_t *sys);
+void slab_init_core(int id);
+void slab_init();
@@ -2,6 +2,11 @@
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/e820.h>
 #include <kernel/mem/slmm.h>
+#include <kernel/sched/spinlock.h>
+#include <kernel/x86/cpuid.h>
+#include <kernel/x86/lapic.h>
+#include <kernel/x86/smp.h>
+#include <kernel/time/time.h>
 #include <kernel/debug.h>
 #include <kernel/errno.h>
 #include <string.h>
@@ -10,6 +15,22 @@ static int paging = 0;
 static uint64_t pml4_phys;
 static uint64_t pml4_virt;
 
+// Address space loaded on each core, used to target TLB shootdowns
+static volatile uint64_t active_pml4[SMP_MAX_CORES];
+
+// With PCIDs every core tags the TLB entries of a few recently used address spaces.
+// Slot n holds the address space using PCID n+1, the kernel address space always uses
+// PCID 0. Clearing a slot forces a flush the next time that address space is loaded.
+static volatile uint64_t pcid_slots[SMP_MAX_CORES][VMM_PCID_SLOTS];
+static uint8_t pcid_next[SMP_MAX_CORES];
+static int pcid = 0;
+
+// Shootdown tickets per core. A sender takes the next request ticket of the target,
+// the target publishes the last ticket it saw before flushing, so every sender
+// waits for a flush that started after its own page table changes.
+static volatile uint64_t tlb_requests[SMP_MAX_CORES];
+static volatile uint64_t tlb_done[SMP_MAX_CORES];
+
 #define shift(a) ((uint64_t)(a) >> 12)
 #define virt2phys(a) ((uint64_t)(a) - 0xFFFFFFFF80000000)
 
@@ -108,6 +129,12 @@ static void link_pte(pte_t *pte, int ix, uint64_t phys)
     pte[ix].phys_addr = shift(phys);
 }
 
+// Allocated and copy-on-write pages own a reference to their frame
+static bool owns_frame(pte_t *pte)
+{
+    return (pte->avl == AVL_ALLOCATED || pte->avl == AVL_COW);
+}
+
 static void free_pde_recurse(uint64_t virt, int level)
 {
     uint64_t child;
@@ -124,7 +151,7 @@ static void free_pde_recurse(uint64_t virt, int level)
     {
         if(level == 1)
         {
-            if(pte->avl == AVL_ALLOCATED)
+            if(owns_frame(pte))
             {
                 pmm_free_frame(pte->phys_addr << 12);
             }
@@ -132,7 +159,14 @@ static void free_pde_recurse(uint64_t virt, int level)
         }
         else
         {
-            if(pde->present)
+            if(pde->present && pde->ps)
+            {
+                if(((pte_large_t*)pde)->avl == AVL_ALLOCATED)
+                {
+                    pmm_free_order(pde->next_base << 12, LARGE_PAGE_ORDER);
+                }
+            }
+            else if(pde->present)
             {
                 child = (virt | (ix << 12));
                 free_pde_recurse(child, level-1);
@@ -226,7 +260,6 @@ static pte_t *get_page(uint64_t addr, int make)
     }
 
     // Return the page
-    asm volatile("invlpg %0" :: "m"(addr));
     return &pl1[ix1];
 }
 
@@ -290,10 +323,188 @@ static pte_large_t *get_large_page(uint64_t addr, int make)
     }
 
     // Return the page
-    asm volatile("invlpg %0" :: "m"(addr));
     return (pte_large_t*)&pl2[ix2];
 }
 
+// Returns the page directory entry of addr, which may hold a table or a large page
+static pde_t *get_pde(uint64_t addr, int make)
+{
+    uint64_t ix4, ix3, ix2;
+    pde_t *pl4, *pl3, *pl2;
+
+    ix4 = ((addr >> 39) & 0x1FF);
+    ix3 = ((addr >> 30) & 0x1FF);
+    ix2 = ((addr >> 21) & 0x1FF);
+
+    pl4 = (pde_t*)(PL4_BASE);
+    pl3 = (pde_t*)(PL3_BASE | ix4 << 12);
+    pl2 = (pde_t*)(PL2_BASE | ix3 << 12 | ix4 << 21);
+
+    // Check PML4 entry
+    if(pl4[ix4].present == 0)
+    {
+        if(!make || alloc_pde(pl4, ix4) < 0)
+        {
+            return 0;
+        }
+        init_pde(pl3, 512, pl4[ix4].mode, 0);
+    }
+
+    // Check PDP entry
+    if(pl3[ix3].present == 0)
+    {
+        if(!make || alloc_pde(pl3, ix3) < 0)
+        {
+            return 0;
+        }
+        init_pde(pl2, 512, pl4[ix4].mode, 0);
+    }
+
+    return &pl2[ix2];
+}
+
+// Replaces a large page by a page table over the same frames, the caller flushes the TLB
+// Frames of a buddy block can be freed one by one, so the small pages own their frame.
+static int split_large_page(pde_t *pde)
+{
+    pte_large_t large;
+    uint64_t phys, base;
+    pte_t *pte;
+
+    large = *(pte_large_t*)pde;
+
+    phys = alloc_frame();
+    if(phys == 0)
+    {
+        return -ENOMEM;
+    }
+
+    base = (large.phys_addr << 21);
+    pte = (pte_t*)vmm_phys_to_virt(phys);
+    init_pte(pte, 512, large.mode);
+
+    for(int ix = 0; ix < 512; ix++)
+    {
+        pte[ix].present = 1;
+        pte[ix].write = large.write;
+        pte[ix].pwt = large.pwt;
+        pte[ix].pcd = large.pcd;
+        pte[ix].pat = large.pat;
+        pte[ix].avl = large.avl;
+        pte[ix].phys_addr = shift(base + ix * PAGE_SIZE);
+        pte[ix].nx = large.nx;
+    }
+
+    init_pde(pde, 1, large.mode, 0);
+    link_pde(pde, 0, (void*)phys);
+
+    return 0;
+}
+
+static inline void invlpg(uint64_t virt)
+{
+    asm volatile("invlpg (%0)" :: "r"(virt) : "memory");
+}
+
+// Returns the PTE of virt, the page table of the previous PTE is reused within a 2 MB range
+static pte_t *next_page(pte_t *prev, uint64_t virt, int make)
+{
+    if(prev && (virt & LARGE_ALIGN_TEST))
+    {
+        return prev + 1;
+    }
+
+    return get_page(virt, make);
+}
+
+static void set_page_flags(pte_t *pte, int flags)
+{
+    pte->write = ((flags & VMM_WRITE) ? 1 : 0);
+    pte->nx = ((flags & VMM_EXEC) ? 0 : 1);
+
+    if(flags & VMM_UC)
+    {
+        pte->pwt = ((PAT_UC & 1) > 0);
+        pte->pcd = ((PAT_UC & 2) > 0);
+        pte->pat = ((PAT_UC & 4) > 0);
+    }
+    else if(flags & VMM_WC)
+    {
+        pte->pwt = ((PAT_WC & 1) > 0);
+        pte->pcd = ((PAT_WC & 2) > 0);
+        pte->pat = ((PAT_WC & 4) > 0);
+    }
+}
+
+static inline void write_cr3(uint64_t value)
+{
+    asm volatile("movq %0, %%cr3" :: "r"(value) : "memory");
+}
+
+// Flushes the non-global entries of the current address space
+static void reload_cr3()
+{
+    uint64_t value;
+    asm volatile("movq %%cr3, %0" : "=r"(value));
+    write_cr3(value);
+}
+
+// Toggling PGE flushes every entry, including global ones and those of other PCIDs
+static void flush_global()
+{
+    uint64_t cr4;
+    asm volatile("movq %%cr4, %0" : "=r"(cr4));
+    asm volatile("movq %0, %%cr4" :: "r"(cr4 ^ (1UL << 7)) : "memory");
+    asm volatile("movq %0, %%cr4" :: "r"(cr4) : "memory");
+}
+
+// Drops an address space from the PCID slots of all cores, except the given one
+static void pcid_drop(uint64_t pml4, int except)
+{
+    uint64_t expected;
+
+    if(!pcid)
+    {
+        return;
+    }
+
+    for(int id = 0; id < SMP_MAX_CORES; id++)
+    {
+        if(id == except)
+        {
+            continue;
+        }
+
+        for(int n = 0; n < VMM_PCID_SLOTS; n++)
+        {
+            expected = pml4;
+            __atomic_compare_exchange_n(&pcid_slots[id][n], &expected, 0, false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+        }
+    }
+}
+
+// Flushes everything for the shootdowns requested from this core so far
+static void tlb_serve(int id)
+{
+    uint64_t seen;
+
+    seen = __atomic_load_n(&tlb_requests[id], __ATOMIC_ACQUIRE);
+    if(seen == __atomic_load_n(&tlb_done[id], __ATOMIC_ACQUIRE))
+    {
+        return;
+    }
+
+    flush_global();
+    __atomic_store_n(&tlb_done[id], seen, __ATOMIC_RELEASE);
+}
+
+// Called by isr_tlbflush with interrupts disabled
+void vmm_tlb_interrupt()
+{
+    tlb_serve(smp_core_id());
+    lapic_write(APIC_EOI, 0);
+}
+
 static int map_large_page(uint64_t virt, uint64_t phys)
 {
     pte_large_t *pde;
@@ -312,6 +523,7 @@ static int map_large_page(uint64_t virt, uint64_t phys)
     pde->present = 1;
     pde->avl = AVL_MAPPED;
     pde->phys_addr = (phys >> 21);
+    pde->global = 1;
     pde->nx = 1;
 
     return 0;
@@ -336,17 +548,31 @@ int vmm_set_caching(uint64_t virt, uint8_t mode)
     pte->pcd = ((mode & 2) > 0);
     pte->pat = ((mode & 4) > 0);
 
+    invlpg(virt);
     return 0;
 }
 
 int vmm_set_mode(uint64_t virt, int w, int x)
 {
+    pde_t *pde;
     pte_t *pte;
     pte = get_page(virt, 0);
 
+    // the mode may only apply to part of a large page
     if(pte == 0)
     {
-        return -1;
+        pde = get_pde(virt, 0);
+        if(pde == 0 || pde->present == 0 || pde->ps == 0)
+        {
+            return -1;
+        }
+
+        if(split_large_page(pde) < 0)
+        {
+            return -1;
+        }
+
+        pte = get_page(virt, 0);
     }
 
     if(pte->present == 0)
@@ -354,9 +580,12 @@ int vmm_set_mode(uint64_t virt, int w, int x)
         return -1;
     }
 
-    pte->write = (w ? 1 : 0);
+    // only private frames become writable, copy-on-write and image cache
+    // frames stay read-only until the next write fault copies them
+    pte->write = ((w && pte->avl == AVL_ALLOCATED) ? 1 : 0);
     pte->nx = (x ? 0 : 1);
 
+    invlpg(virt);
     return 0;
 }
 
@@ -390,11 +619,12 @@ int vmm_alloc_page(uint64_t virt)
     return 0;
 }
 
-int vmm_map_page(uint64_t virt, uint64_t phys)
+int vmm_alloc_zero_page(uint64_t virt)
 {
+    uint64_t phys;
     pte_t *pte;
-    pte = get_page(virt, 1);
 
+    pte = get_page(virt, 1);
     if(pte == 0)
     {
         return -1;
@@ -402,12 +632,197 @@ int vmm_map_page(uint64_t virt, uint64_t phys)
 
     if(pte->present)
     {
-        return -1;
+        return -EEXIST;
+    }
+
+    phys = pmm_alloc_zero_frame();
+    if(phys == 0)
+    {
+        return -ENOMEM;
     }
 
     pte->present = 1;
-    pte->avl = AVL_MAPPED;
+    pte->avl = AVL_ALLOCATED;
+    pte->phys_addr = shift(phys);
+
+    return 0;
+}
+
+// Backs an aligned 2 MB span with a large page, fails if anything in the span is mapped
+int vmm_alloc_large_page(uint64_t virt, int flags)
+{
+    pte_large_t large;
+    uint64_t phys;
+    pde_t *pde;
+
+    pde = get_pde(virt, 1);
+    if(pde == 0)
+    {
+        return -ENOMEM;
+    }
+
+    if(pde->present)
+    {
+        return -EEXIST;
+    }
+
+    phys = pmm_alloc_order(LARGE_PAGE_ORDER);
+    if(phys == 0)
+    {
+        return -ENOMEM;
+    }
+
+    if(flags & VMM_ZERO)
+    {
+        memset((void*)vmm_phys_to_virt(phys), 0, LARGE_PAGE_SIZE);
+    }
+
+    large = *(pte_large_t*)pde;
+    large.present = 1;
+    large.write = ((flags & VMM_WRITE) ? 1 : 0);
+    large.ps = 1;
+    large.avl = AVL_ALLOCATED;
+    large.phys_addr = (phys >> 21);
+    large.nx = ((flags & VMM_EXEC) ? 0 : 1);
+    *(pte_large_t*)pde = large;
+
+    return 0;
+}
+
+int vmm_insert_page(uint64_t virt, uint64_t phys, int flags)
+{
+    pte_t *pte, entry;
+    pte = get_page(virt, 1);
+
+    if(pte == 0)
+    {
+        return -ENOMEM;
+    }
+
+    if(pte->present)
+    {
+        return -EEXIST;
+    }
+
+    // the entry is published with its final mode in a single store
+    entry = *pte;
+    set_page_flags(&entry, flags);
+    entry.avl = AVL_ALLOCATED;
+    entry.phys_addr = shift(phys);
+    entry.present = 1;
+    *(volatile pte_t*)pte = entry;
+
+    return 0;
+}
+
+// Give a read-only page a private writable frame, called with the address space locked
+static int break_page(pte_t *pte, uint64_t virt)
+{
+    uint64_t phys, old;
+    bool cow;
+
+    old = (pte->phys_addr << 12);
+    cow = (pte->avl == AVL_COW);
+
+    // the last owner of a copy-on-write frame can simply keep it
+    if(cow && !pmm_frame_shared(old))
+    {
+        pte->avl = AVL_ALLOCATED;
+        pte->write = 1;
+        invlpg(virt);
+        return 0;
+    }
+
+    phys = alloc_frame();
+    if(phys == 0)
+    {
+        return -ENOMEM;
+    }
+
+    memcpy((void*)vmm_phys_to_virt(phys), (void*)vmm_phys_to_virt(old), PAGE_SIZE);
+
     pte->phys_addr = shift(phys);
+    pte->avl = AVL_ALLOCATED;
+    pte->write = 1;
+
+    // sibling threads on other cores may still read through the old entry
+    vmm_flush_range(virt, PAGE_SIZE);
+
+    // drop our reference, other frames belong to whoever shared them
+    if(cow)
+    {
+        pmm_free_frame(old);
+    }
+
+    return 0;
+}
+
+// Replace the frame of a read-only page with a private writable copy
+int vmm_copy_page(uint64_t virt)
+{
+    pte_t *pte;
+
+    pte = get_page(virt, 0);
+    if(pte == 0 || pte->present == 0)
+    {
+        return -EFAULT;
+    }
+
+    // another thread was faster
+    if(pte->write)
+    {
+        return 0;
+    }
+
+    return break_page(pte, virt);
+}
+
+// Resolve a write fault on a page shared by fork, fails if the page is not copy-on-write
+int vmm_cow_page(uint64_t virt)
+{
+    pte_t *pte;
+
+    pte = get_page(virt, 0);
+    if(pte == 0 || pte->present == 0)
+    {
+        return -EFAULT;
+    }
+
+    if(pte->write)
+    {
+        return 0;
+    }
+
+    if(pte->avl != AVL_COW)
+    {
+        return -EFAULT;
+    }
+
+    return break_page(pte, virt);
+}
+
+int vmm_map_page(uint64_t virt, uint64_t phys, int flags)
+{
+    pte_t *pte, entry;
+    pte = get_page(virt, 1);
+
+    if(pte == 0)
+    {
+        return -ENOMEM;
+    }
+
+    if(pte->present)
+    {
+        return -EEXIST;
+    }
+
+    // the entry is published with its final mode in a single store
+    entry = *pte;
+    set_page_flags(&entry, flags);
+    entry.avl = AVL_MAPPED;
+    entry.phys_addr = shift(phys);
+    entry.present = 1;
+    *(volatile pte_t*)pte = entry;
 
     return 0;
 }
@@ -433,6 +848,8 @@ int vmm_remap_page(uint64_t virt, uint64_t phys)
     }
 
     pte->phys_addr = shift(phys);
+
+    invlpg(virt);
     return 0;
 }
 
@@ -451,35 +868,326 @@ int vmm_free_page(uint64_t virt)
         return -1;
     }
 
-    if(pte->avl == AVL_ALLOCATED)
+    if(owns_frame(pte))
     {
         pmm_free_frame(pte->phys_addr << 12);
     }
 
     init_pte(pte, 1, pte->mode);
+
+    invlpg(virt);
     return 0;
 }
 
-void vmm_load_pml4(uint64_t addr)
+// Flushes a range on this core, and on every other core that may have it cached
+// Kernel addresses are shared by all address spaces, user addresses only by the cores
+// running the current one. The remote flush drops the whole TLB, so it is sent once per core.
+void vmm_flush_range(uint64_t virt, size_t length)
 {
-    asm volatile("movq %0, %%cr3" :: "r"(addr));
-}
+    uint64_t tickets[SMP_MAX_CORES];
+    uint64_t pml4;
+    int self;
 
-void vmm_load_kernel_pml4()
-{
-    vmm_load_pml4(pml4_phys);
-}
+    if(length <= VMM_FLUSH_PAGES * PAGE_SIZE)
+    {
+        for(size_t offset = 0; offset < length; offset += PAGE_SIZE)
+        {
+            invlpg(virt + offset);
+        }
+    }
+    else if(virt < USER_END)
+    {
+        reload_cr3();
+    }
+    else
+    {
+        flush_global();
+    }
 
-uint64_t vmm_get_kernel_pml4()
-{
-    return pml4_phys;
+    pml4 = vmm_get_current_pml4();
+    self = smp_core_id();
+
+    // cores that ran the address space before must not reuse their TLB entries
+    if(virt < USER_END)
+    {
+        pcid_drop(pml4, self);
+    }
+
+    if(smp_core_count() < 2)
+    {
+        return;
+    }
+
+    for(int id = 0; id < smp_core_count(); id++)
+    {
+        tickets[id] = 0;
+
+        if(id == self)
+        {
+            continue;
+        }
+
+        if(virt < USER_END && __atomic_load_n(&active_pml4[id], __ATOMIC_SEQ_CST) != pml4)
+        {
+            continue;
+        }
+
+        tickets[id] = __atomic_add_fetch(&tlb_requests[id], 1, __ATOMIC_SEQ_CST);
+        lapic_ipi(smp_core_apic_id(id), 0, VMM_TLB_VECTOR);
+    }
+
+    // callers free the frames afterwards, so always wait for every target. With
+    // interrupts disabled two cores could wait for each other, so requests to this
+    // core are served while waiting.
+    for(int id = 0; id < smp_core_count(); id++)
+    {
+        while(__atomic_load_n(&tlb_done[id], __ATOMIC_ACQUIRE) < tickets[id])
+        {
+            tlb_serve(self);
+            asm volatile("pause");
+        }
+    }
+}
+
+int vmm_map_range(uint64_t virt, uint64_t phys, size_t length, int flags)
+{
+    pte_t *pte = 0;
+    size_t offset;
+
+    for(offset = 0; offset < length; offset += PAGE_SIZE)
+    {
+        pte = next_page(pte, virt + offset, 1);
+        if(pte == 0 || pte->present)
+        {
+            break;
+        }
+
+        pte->present = 1;
+        pte->avl = AVL_MAPPED;
+        pte->phys_addr = shift(phys + offset);
+        pte->global = (virt >= IDMAP);
+        set_page_flags(pte, flags);
+    }
+
+    if(offset < length)
+    {
+        vmm_unmap_range(virt, offset);
+        return (pte == 0) ? -ENOMEM : -EEXIST;
+    }
+
+    return 0;
+}
+
+int vmm_alloc_range(uint64_t virt, size_t length, int flags)
+{
+    pte_t *pte = 0;
+    uint64_t phys = 0;
+    size_t offset;
+
+    for(offset = 0; offset < length; offset += PAGE_SIZE)
+    {
+        // whole aligned spans try a large page first
+        if((flags & VMM_LARGE) && ((virt + offset) & LARGE_ALIGN_TEST) == 0 &&
+           length - offset >= LARGE_PAGE_SIZE)
+        {
+            if(vmm_alloc_large_page(virt + offset, flags) == 0)
+            {
+                offset += LARGE_PAGE_SIZE - PAGE_SIZE;
+                pte = 0;
+                continue;
+            }
+        }
+
+        pte = next_page(pte, virt + offset, 1);
+        if(pte == 0 || pte->present)
+        {
+            break;
+        }
+
+        phys = ((flags & VMM_ZERO) ? pmm_alloc_zero_frame() : alloc_frame());
+        if(phys == 0)
+        {
+            break;
+        }
+
+        pte->present = 1;
+        pte->avl = AVL_ALLOCATED;
+        pte->phys_addr = shift(phys);
+        pte->global = (virt >= IDMAP);
+        set_page_flags(pte, flags);
+    }
+
+    if(offset < length)
+    {
+        vmm_unmap_range(virt, offset);
+        return (pte && pte->present) ? -EEXIST : -ENOMEM;
+    }
+
+    return 0;
+}
+
+static void release_frames(uint64_t *frames, int count)
+{
+    while(count)
+    {
+        pmm_free_frame(frames[--count]);
+    }
+}
+
+// Pages that are not present are skipped, owned frames are released after the flush
+// Large pages are released whole when the range covers them, and split otherwise.
+int vmm_unmap_range(uint64_t virt, size_t length)
+{
+    uint64_t frames[VMM_FLUSH_BATCH];
+    uint64_t start, end, addr, phys;
+    pte_large_t *large;
+    pde_t *pde;
+    pte_t *pte = 0;
+    bool owned;
+    int status = 0;
+    int cleared = 0;
+    int count = 0;
+
+    start = virt;
+    end = virt + length;
+    addr = virt;
+
+    while(addr < end)
+    {
+        pte = next_page(pte, addr, 0);
+        if(pte == 0)
+        {
+            pde = get_pde(addr, 0);
+            if(pde == 0 || pde->present == 0)
+            {
+                // no page table, skip to the next one
+                addr = (addr + LARGE_PAGE_SIZE) & LARGE_ALIGN_MASK;
+                continue;
+            }
+
+            if((addr & LARGE_ALIGN_TEST) || end - addr < LARGE_PAGE_SIZE)
+            {
+                // the old translation is dropped by the flush of the range
+                status = split_large_page(pde);
+                if(status < 0)
+                {
+                    break;
+                }
+                continue;
+            }
+
+            large = (pte_large_t*)pde;
+            phys = (large->phys_addr << 21);
+            owned = (large->avl == AVL_ALLOCATED);
+
+            init_pde(pde, 1, large->mode, 0);
+            addr += LARGE_PAGE_SIZE;
+
+            // the block is released right away, together with the pending frames
+            vmm_flush_range(start, addr - start);
+            release_frames(frames, count);
+            if(owned)
+            {
+                pmm_free_order(phys, LARGE_PAGE_ORDER);
+            }
+            start = addr;
+            cleared = 0;
+            count = 0;
+            continue;
+        }
+
+        if(pte->present)
+        {
+            if(owns_frame(pte))
+            {
+                frames[count++] = (pte->phys_addr << 12);
+            }
+            init_pte(pte, 1, pte->mode);
+            cleared++;
+        }
+
+        addr += PAGE_SIZE;
+
+        // the frames are only released once no TLB references them
+        if(count == VMM_FLUSH_BATCH)
+        {
+            vmm_flush_range(start, addr - start);
+            release_frames(frames, count);
+            start = addr;
+            cleared = 0;
+            count = 0;
+        }
+    }
+
+    if(cleared)
+    {
+        vmm_flush_range(start, end - start);
+        release_frames(frames, count);
+    }
+
+    return status;
+}
+
+void vmm_load_pml4(uint64_t addr)
+{
+    volatile uint64_t *slots;
+    int id, n;
+
+    id = smp_core_id();
+    if(id < 0 || id >= SMP_MAX_CORES)
+    {
+        write_cr3(addr);
+        return;
+    }
+
+    __atomic_store_n(&active_pml4[id], addr, __ATOMIC_SEQ_CST);
+
+    if(!pcid)
+    {
+        write_cr3(addr);
+        return;
+    }
+
+    // kernel mappings are global, nothing else is ever cached for PCID 0
+    if(addr == pml4_phys)
+    {
+        write_cr3(addr | CR3_NOFLUSH);
+        return;
+    }
+
+    slots = pcid_slots[id];
+    for(n = 0; n < VMM_PCID_SLOTS; n++)
+    {
+        if(__atomic_load_n(&slots[n], __ATOMIC_SEQ_CST) == addr)
+        {
+            write_cr3(addr | (n + 1) | CR3_NOFLUSH);
+            return;
+        }
+    }
+
+    // take the next slot, its old entries are flushed by the load
+    n = pcid_next[id];
+    pcid_next[id] = (n + 1) % VMM_PCID_SLOTS;
+
+    __atomic_store_n(&slots[n], addr, __ATOMIC_SEQ_CST);
+    write_cr3(addr | (n + 1));
+}
+
+void vmm_load_kernel_pml4()
+{
+    vmm_load_pml4(pml4_phys);
+}
+
+uint64_t vmm_get_kernel_pml4()
+{
+    return pml4_phys;
 }
 
 uint64_t vmm_get_current_pml4()
 {
     uint64_t phys;
     asm volatile("mov %%cr3, %0" : "=r"(phys));
-    return phys;
+    return (phys & ALIGN_MASK);
 }
 
 uint64_t vmm_phys_to_virt(uint64_t phys)
@@ -492,6 +1200,62 @@ uint64_t vmm_virt_to_phys(uint64_t virt)
     return (virt - IDMAP);
 }
 
+// Returns the frame address behind virt, or zero when it is not present
+uint64_t vmm_get_phys(uint64_t virt)
+{
+    pte_large_t *large;
+    pde_t *pde;
+    pte_t *pte;
+
+    pde = get_pde(virt, 0);
+    if(pde == 0 || pde->present == 0)
+    {
+        return 0;
+    }
+
+    if(pde->ps)
+    {
+        large = (pte_large_t*)pde;
+        return (large->phys_addr << 21) | (virt & LARGE_ALIGN_TEST);
+    }
+
+    pte = get_page(virt, 0);
+    if(pte == 0 || pte->present == 0)
+    {
+        return 0;
+    }
+
+    return (pte->phys_addr << 12) | (virt & ALIGN_TEST);
+}
+
+// Returns true when virt is present, and also writable if write is set
+bool vmm_accessible(uint64_t virt, bool write)
+{
+    pte_large_t *large;
+    pde_t *pde;
+    pte_t *pte;
+
+    pde = get_pde(virt, 0);
+    if(pde == 0 || pde->present == 0)
+    {
+        return false;
+    }
+
+    if(pde->ps)
+    {
+        large = (pte_large_t*)pde;
+        return (!write || large->write);
+    }
+
+    pte = get_page(virt, 0);
+    if(pte == 0 || pte->present == 0)
+    {
+        return false;
+    }
+
+    return (!write || pte->write);
+}
+
 uint64_t vmm_create_user_space()
 {
     uint64_t phys, virt;
@@ -513,15 +1277,235 @@ uint64_t vmm_create_user_space()
     return phys;
 }
 
+static void free_table_recurse(pde_t *pde, int level)
+{
+    pte_t *pte = (pte_t*)pde;
+    int max = ((level == 4) ? 256 : 512);
+
+    for(int ix = 0; ix < max; ix++)
+    {
+        if(level == 1)
+        {
+            if(pte[ix].present && owns_frame(&pte[ix]))
+            {
+                pmm_free_frame(pte[ix].phys_addr << 12);
+            }
+        }
+        else if(pde[ix].present && pde[ix].ps)
+        {
+            if(((pte_large_t*)&pde[ix])->avl == AVL_ALLOCATED)
+            {
+                pmm_free_order(pde[ix].next_base << 12, LARGE_PAGE_ORDER);
+            }
+        }
+        else if(pde[ix].present)
+        {
+            free_table_recurse((pde_t*)vmm_phys_to_virt(pde[ix].next_base << 12), level-1);
+            pmm_free_frame(pde[ix].next_base << 12);
+        }
+    }
+}
+
+// Copies the user half of the tables, every private frame becomes shared copy-on-write
+static int clone_table_recurse(pde_t *src, pde_t *dst, int level)
+{
+    pte_t *spte = (pte_t*)src;
+    pte_t *dpte = (pte_t*)dst;
+    int max = ((level == 4) ? 256 : 512);
+    uint64_t phys;
+    int status;
+
+    for(int ix = 0; ix < max; ix++)
+    {
+        if(level == 1)
+        {
+            if(spte[ix].present == 0)
+            {
+                continue;
+            }
+
+            // read-only frames are marked too, a later mprotect must not make them writable
+            if(owns_frame(&spte[ix]))
+            {
+                spte[ix].write = 0;
+                spte[ix].avl = AVL_COW;
+                pmm_share_frame(spte[ix].phys_addr << 12);
+            }
+
+            dpte[ix] = spte[ix];
+        }
+        else if(src[ix].present)
+        {
+            // large pages are shared as small pages, so a write fault only copies 4 KB
+            if(src[ix].ps && split_large_page(&src[ix]) < 0)
+            {
+                return -ENOMEM;
+            }
+
+            phys = alloc_frame();
+            if(phys == 0)
+            {
+                return -ENOMEM;
+            }
+
+            if(level == 2)
+            {
+                init_pte((pte_t*)vmm_phys_to_virt(phys), 512, src[ix].mode);
+            }
+            else
+            {
+                init_pde((pde_t*)vmm_phys_to_virt(phys), 512, src[ix].mode, 0);
+            }
+
+            dst[ix] = src[ix];
+            dst[ix].next_base = shift(phys);
+
+            status = clone_table_recurse((pde_t*)vmm_phys_to_virt(src[ix].next_base << 12),
+                                         (pde_t*)vmm_phys_to_virt(phys), level-1);
+            if(status < 0)
+            {
+                return status;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// The caller has to flush the TLB of the current address space afterwards
+uint64_t vmm_clone_user_space()
+{
+    uint64_t phys;
+    pde_t *src, *dst;
+
+    phys = vmm_create_user_space();
+    if(phys == 0)
+    {
+        return 0;
+    }
+
+    src = (pde_t*)vmm_phys_to_virt(vmm_get_current_pml4());
+    dst = (pde_t*)vmm_phys_to_virt(phys);
+
+    if(clone_table_recurse(src, dst, 4) < 0)
+    {
+        // everything copied so far holds a reference
+        vmm_free_user_space(phys);
+        return 0;
+    }
+
+    return phys;
+}
+
+// Releases an address space that is not loaded
+void vmm_free_user_space(uint64_t pml4)
+{
+    free_table_recurse((pde_t*)vmm_phys_to_virt(pml4), 4);
+    pcid_drop(pml4, -1);
+    pmm_free_frame(pml4);
+}
+
 void vmm_destroy_user_space()
 {
     uint64_t phys;
     phys = vmm_get_current_pml4();
     free_pde_recurse(PL4_BASE, 4);
     vmm_load_kernel_pml4();
+
+    // the frame may become another address space
+    pcid_drop(phys, -1);
     pmm_free_frame(phys);
 }
 
+// Touches pages in two address spaces after every switch, with and without PCIDs
+void vmm_benchmark()
+{
+    uint64_t space[2], start, elapsed[2][2];
+    uint64_t current;
+    uint32_t flags;
+    int rounds = 10000;
+    int pages = 64;
+
+    current = vmm_get_current_pml4();
+    disable_interrupts(&flags);
+
+    for(int n = 0; n < 2; n++)
+    {
+        space[n] = vmm_create_user_space();
+        vmm_load_pml4(space[n]);
+        vmm_alloc_range(VMM_BENCH_ADDR, pages * PAGE_SIZE, VMM_WRITE | VMM_ZERO);
+    }
+
+    // mode 0 flushes on every switch like a plain CR3 write, mode 1 keeps tagged entries
+    for(int mode = 0; mode < 2; mode++)
+    {
+        elapsed[mode][0] = 0;
+        elapsed[mode][1] = 0;
+
+        // PCID 0 must not keep entries of other address spaces
+        write_cr3(pml4_phys);
+
+        for(int round = 0; round < rounds; round++)
+        {
+            start = system_timestamp();
+            if(mode == 0 || !pcid)
+            {
+                write_cr3(space[round & 1]);
+            }
+            else
+            {
+                vmm_load_pml4(space[round & 1]);
+            }
+            elapsed[mode][0] += system_timestamp() - start;
+
+            start = system_timestamp();
+            for(int page = 0; page < pages; page++)
+            {
+                (*(volatile uint64_t*)(VMM_BENCH_ADDR + page * PAGE_SIZE))++;
+            }
+            elapsed[mode][1] += system_timestamp() - start;
+        }
+    }
+
+    write_cr3(pml4_phys);
+
+    for(int n = 0; n < 2; n++)
+    {
+        vmm_load_pml4(space[n]);
+        vmm_destroy_user_space();
+    }
+
+    vmm_load_pml4(current);
+    restore_interrupts(&flags);
+
+    kp_info("vmm", "switch with flush: %lu ns, touching %d pages: %lu ns",
+        elapsed[0][0] / rounds, pages, elapsed[0][1] / rounds);
+    kp_info("vmm", "switch with pcid:  %lu ns, touching %d pages: %lu ns%s",
+        elapsed[1][0] / rounds, pages, elapsed[1][1] / rounds, pcid ? "" : " (not supported)");
+}
+
+// Enables global pages and PCIDs on the calling core
+void vmm_init_core()
+{
+    uint64_t cr4;
+
+    asm volatile("movq %%cr4, %0" : "=r"(cr4));
+
+    if(cpuid_feature(CPU_FEATURE_PGE))
+    {
+        cr4 |= (1UL << 7);  // Set PGE bit (global pages)
+    }
+
+    // CR3 must hold PCID 0 when this is enabled
+    if(cpuid_feature(CPU_FEATURE_PCID))
+    {
+        cr4 |= (1UL << 17); // Set PCIDE bit (process-context identifiers)
+        pcid = 1;
+    }
+
+    asm volatile("movq %0, %%cr4" :: "r"(cr4));
+}
+
 void vmm_init()
 {
     uint64_t cs, rs, ws;
@@ -606,4 +1590,5 @@ void vmm_init()
 
     // Paging is enabled
     paging = 1;
+    vmm_init_core();
 }
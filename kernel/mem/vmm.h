@@ -9,6 +9,7 @@
 #define LARGE_ALIGN_TEST 0x1FFFFF
 #define LARGE_ALIGN_MASK 0xFFFFFFFFFFE00000
 #define LARGE_PAGE_SIZE  0x200000
+#define LARGE_PAGE_ORDER 9
 
 #define PAGE_ALIGN(a) \
     ((a + PAGE_SIZE - 1) & ALIGN_MASK)
@@ -35,7 +36,29 @@
 
 #define AVL_ALLOCATED 1
 #define AVL_MAPPED    2
+#define AVL_COW       3
 
+#define VMM_WRITE 0x01 // writable
+#define VMM_EXEC  0x02 // executable
+#define VMM_ZERO  0x04 // zero the allocated frames
+#define VMM_UC    0x08 // uncacheable
+#define VMM_WC    0x10 // write-combining
+#define VMM_LARGE 0x20 // use large pages for aligned 2 MB spans
+
+#define VMM_FLUSH_PAGES 32  // larger ranges reload CR3 instead
+#define VMM_FLUSH_BATCH 64  // frames released per flush when unmapping
+#define VMM_TLB_VECTOR  254 // interrupt vector of TLB shootdowns
+#define VMM_PCID_SLOTS  6   // address spaces tagged per core
+#define VMM_BENCH_ADDR  0x400000UL
+
+#define CR3_NOFLUSH (1UL << 63)
+
+#define FAULT_PRESENT 0x01
+#define FAULT_WRITE   0x02
+#define FAULT_USER    0x04
+#define FAULT_FETCH   0x10
+
+#define USER_END       0x800000000000 // 128 TiB
 #define USER_MMAP      0x200000000000 // 32 TiB
 #define USER_MMAP_SIZE 0x600000000000 // 96 TiB
 
@@ -96,21 +119,38 @@ int vmm_set_caching(uint64_t virt, uint8_t mode);
 int vmm_set_mode(uint64_t virt, int w, int x);
 
 int vmm_alloc_page(uint64_t virt);
-int vmm_map_page(uint64_t virt, uint64_t phys);
+int vmm_alloc_zero_page(uint64_t virt);
+int vmm_alloc_large_page(uint64_t virt, int flags);
+int vmm_insert_page(uint64_t virt, uint64_t phys, int flags);
+int vmm_copy_page(uint64_t virt);
+int vmm_cow_page(uint64_t virt);
+int vmm_map_page(uint64_t virt, uint64_t phys, int flags);
 int vmm_remap_page(uint64_t virt, uint64_t phys);
 int vmm_free_page(uint64_t virt);
 
+int vmm_map_range(uint64_t virt, uint64_t phys, size_t length, int flags);
+int vmm_alloc_range(uint64_t virt, size_t length, int flags);
+int vmm_unmap_range(uint64_t virt, size_t length);
+void vmm_flush_range(uint64_t virt, size_t length);
+void vmm_tlb_interrupt();
+
 void vmm_load_pml4(uint64_t addr);
 void vmm_load_kernel_pml4();
 uint64_t vmm_get_kernel_pml4();
 uint64_t vmm_get_current_pml4();
 
 uint64_t vmm_create_user_space();
+uint64_t vmm_clone_user_space();
+void vmm_free_user_space(uint64_t pml4);
 void vmm_destroy_user_space();
 
 uint64_t vmm_phys_to_virt(uint64_t phys);
 uint64_t vmm_virt_to_phys(uint64_t virt);
+uint64_t vmm_get_phys(uint64_t virt);
+bool vmm_accessible(uint64_t virt, bool write);
 
+void vmm_benchmark();
+void vmm_init_core();
 void vmm_init();
 void pat_init();
 void pat_load();
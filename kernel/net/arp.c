@@ -1,41 +1,74 @@
 #include <kernel/net/ethernet.h>
 #include <kernel/net/ipv4.h>
 #include <kernel/net/arp.h>
+#include <kernel/sched/rcu.h>
 #include <kernel/mem/heap.h>
 #include <kernel/time/time.h>
 
+#include <kernel/errno.h>
 #include <kernel/debug.h>
 
+// Lookups walk the table without a lock and copy the entry before leaving the read
+// section. Insertions are serialized by the rwlock so that an address is only added
+// once, it is also taken on the receive path and therefore disables interrupts.
+
 static LIST_INIT(table, arp_t, link);
+static rwlock_t table_lock = 0;
 
-arp_t *arp_lookup(uint32_t tpa)
+// Called inside a read section or with the table locked
+static arp_t *arp_find(uint32_t tpa)
 {
     arp_t *item = 0;
-    while(item = list_iterate(&table, item), item)
+
+    while(item = list_iterate_rcu(&table, item), item)
     {
         if(item->ip == tpa)
         {
             break;
         }
     }
+
     return item;
 }
 
-arp_t *arp_insert(netdev_t *dev, uint32_t tpa, uint8_t *tha)
+int arp_lookup(uint32_t tpa, arp_t *entry)
 {
+    uint32_t flags;
     arp_t *item;
 
-    item = arp_lookup(tpa);
+    rcu_read_lock(&flags);
+    item = arp_find(tpa);
+    if(item)
+    {
+        *entry = *item;
+    }
+    rcu_read_unlock(&flags);
+
+    return item ? 0 : -ENOENT;
+}
+
+int arp_insert(netdev_t *dev, uint32_t tpa, uint8_t *tha)
+{
+    uint32_t flags;
+    arp_t *item;
+
+    rcu_read_lock(&flags);
+    item = arp_find(tpa);
     if(item)
     {
         item->ts = system_timestamp();
-        return item;
+    }
+    rcu_read_unlock(&flags);
+
+    if(item)
+    {
+        return 0;
     }
 
     item = kzalloc(sizeof(*item));
     if(!item)
     {
-        return 0;
+        return -ENOMEM;
     }
 
     item->dev = dev;
@@ -49,13 +82,25 @@ arp_t *arp_insert(netdev_t *dev, uint32_t tpa, uint8_t *tha)
     item->mac.addr[4] = tha[4];
     item->mac.addr[5] = tha[5];
 
+    write_lock_safe(&table_lock, &flags);
+
+    // another thread may have added the address in the meantime
+    if(arp_find(tpa))
+    {
+        write_unlock_safe(&table_lock, &flags);
+        kfree(item);
+        return 0;
+    }
+
+    list_insert_rcu(&table, item);
+    write_unlock_safe(&table_lock, &flags);
+
     kp_info("arp", "ip = %d.%d.%d.%d mac = %02x:%02x:%02x:%02x:%02x:%02x",
             (tpa>>24)&0xFF,(tpa>>16)&0xFF,(tpa>>8)&0xFF,(tpa>>0)&0xFF,
             tha[0],tha[1],tha[2],tha[3],tha[4],tha[5]
         );
 
-    list_insert(&table, item);
-    return item;
+    return 0;
 }
 
 static void arp_send_reply(netdev_t *dev, frame_t *frame)
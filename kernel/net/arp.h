@@ -33,8 +33,8 @@ typedef struct {
     link_t link;
 } arp_t;
 
-arp_t *arp_lookup(uint32_t tpa);
-arp_t *arp_insert(netdev_t *dev, uint32_t tpa, uint8_t *tha);
+int arp_lookup(uint32_t tpa, arp_t *entry);
+int arp_insert(netdev_t *dev, uint32_t tpa, uint8_t *tha);
 
 void arp_send_request(netdev_t *dev, uint32_t spa, uint32_t tpa);
 void arp_recv(netdev_t *dev, frame_t *frame);
@@ -3,6 +3,7 @@
 #include <kernel/net/socket.h>
 #include <kernel/net/ipv4.h>
 #include <kernel/net/arp.h>
+#include <kernel/sched/rcu.h>
 #include <kernel/mem/heap.h>
 #include <kernel/time/time.h>
 #include <kernel/errno.h>
@@ -134,16 +135,20 @@ int ipv4_addr_del(netdev_t *dev, ipv4_addr_t *ip)
 int ipv4_add_route(ipv4_route_t *route)
 {
     // check for conflicts
-	list_append(&routes, route);
+	list_append_rcu(&routes, route);
 	return 0;
 }
 
+// Routes are looked up for every packet sent, readers do not take a lock. Routes are
+// never freed, so the result stays valid after the read section.
 ipv4_route_t *ipv4_find_route(uint32_t address)
 {
 	ipv4_route_t *item = 0;
     ipv4_route_t *route = 0;
+    uint32_t flags;
 
-    while(item = list_iterate(&routes, item), item)
+    rcu_read_lock(&flags);
+    while(item = list_iterate_rcu(&routes, item), item)
     {
         if(!item->prefix) // default route
         {
@@ -167,20 +172,21 @@ ipv4_route_t *ipv4_find_route(uint32_t address)
             }
         }
     }
+    rcu_read_unlock(&flags);
 
 	return route;
 }
 
-arp_t *ipv4_find_nexthop(uint32_t address)
+int ipv4_find_nexthop(uint32_t address, arp_t *arp)
 {
     ipv4_route_t *rt;
     ipv4_addr_t *ip;
-    arp_t *arp;
+    int status;
 
     rt = ipv4_find_route(address);
     if(!rt)
     {
-        return 0;
+        return -ENOENT;
     }
 
     if(rt->nexthop)
@@ -188,16 +194,16 @@ arp_t *ipv4_find_nexthop(uint32_t address)
         address = rt->nexthop;
     }
 
-    arp = arp_lookup(address);
-    if(!arp)
+    status = arp_lookup(address, arp);
+    if(status < 0)
     {
         ip = rt->dev->ipv4.head;
         arp_send_request(rt->dev, ip->address, address);
         timer_sleep(50); // need something better than this!
-        arp = arp_lookup(address);
+        status = arp_lookup(address, arp);
     }
 
-    return arp;
+    return status;
 
 }
 
@@ -235,14 +241,13 @@ void ipv4_send(void *payload, int size, ipv4_sdp_t *sdp)
 {
     ipv4_header_t *h;
     frame_t *f;
-    arp_t *arp;
+    arp_t arp;
     int length;
     int offset;
     int mtu;
     int s;
 
-    arp = ipv4_find_nexthop(sdp->daddr);
-    if(!arp)
+    if(ipv4_find_nexthop(sdp->daddr, &arp) < 0)
     {
         kp_error("ipv4", "arp lookup failed");
         return;
@@ -267,7 +272,7 @@ void ipv4_send(void *payload, int size, ipv4_sdp_t *sdp)
     h->daddr    = swap32(sdp->daddr);
 
     // effective MTU
-    mtu = arp->dev->mtu - s;
+    mtu = arp.dev->mtu - s;
     mtu = mtu & -8u; // offset is in units of 8 bytes
     offset = 0;
 
@@ -285,7 +290,7 @@ void ipv4_send(void *payload, int size, ipv4_sdp_t *sdp)
         h->checksum = ipv4_checksum(h, s);
 
         memcpy(h+1, payload + offset, length);
-        ethernet_send(arp->dev, arp->mac.addr, 0x0800, f);
+        ethernet_send(arp.dev, arp.mac.addr, 0x0800, f);
 
         offset = offset + length;
     }
@@ -76,7 +76,7 @@ typedef struct {
 
 int ipv4_add_route(ipv4_route_t *route);
 ipv4_route_t *ipv4_find_route(uint32_t address);
-arp_t *ipv4_find_nexthop(uint32_t address);
+int ipv4_find_nexthop(uint32_t address, arp_t *arp);
 
 int ipv4_addr_add(netdev_t *dev, ipv4_addr_t *ip);
 int ipv4_addr_del(netdev_t *dev, ipv4_addr_t *ip);
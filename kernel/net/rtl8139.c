@@ -113,7 +113,6 @@ static void rtl8139_init_device(pci_dev_t *pcidev, uint32_t ioaddr)
     {
         return;
     }
-    memset((void*)virt, 0, 5*4096);
 
     // Set receive buffer
     outportl(ioaddr + RxBufStart, phys);
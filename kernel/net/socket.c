@@ -1,5 +1,6 @@
 #include <kernel/net/socket.h>
 #include <kernel/mem/heap.h>
+#include <kernel/vfs/vfs.h>
 #include <kernel/vfs/fd.h>
 #include <kernel/errno.h>
 #include <kernel/debug.h>
@@ -138,31 +139,34 @@ void socket_inet4_recv(int type, int proto, void *data, int size, ipv4_sdp_t *sd
 int socket_read(int id, void *data, size_t size, int flags, socket_addr_t *addr)
 {
     socket_data_t *chunk;
+    file_t *file;
     socket_t *sk;
-    fd_t *fd;
     int status;
 
-    fd = fd_find(id);
-    if(!fd)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
 
-    if((fd->file->flags & I_SOCKET) == 0)
+    if((file->flags & I_SOCKET) == 0)
     {
+        vfs_release(file);
         return -EBADF;
     }
 
     // flags decide blocking vs non-blocking
 
-    sk = fd->file->data;
+    sk = file->data;
     chunk = list_head(&sk->list);
 
     if(!chunk)
     {
+        // the reference keeps the socket open while this thread sleeps
         status = wq_wait(&sk->wait);
         if(status < 0)
         {
+            vfs_release(file);
             return status;
         }
         chunk = list_head(&sk->list);
@@ -186,26 +190,28 @@ int socket_read(int id, void *data, size_t size, int flags, socket_addr_t *addr)
     memcpy(data, chunk->data, size);
     kfree(chunk);
 
+    vfs_release(file);
     return size;
 }
 
 int socket_write(int id, void *data, size_t size, int flags, socket_addr_t *addr)
 {
+    file_t *file;
     socket_t *sk;
-    fd_t *fd;
 
-    fd = fd_find(id);
-    if(!fd)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
 
-    if((fd->file->flags & I_SOCKET) == 0)
+    if((file->flags & I_SOCKET) == 0)
     {
+        vfs_release(file);
         return -EBADF;
     }
 
-    sk = fd->file->data;
+    sk = file->data;
 
     // we assume raw socket for now
     // we assume inet4 socket for now
@@ -218,5 +224,6 @@ int socket_write(int id, void *data, size_t size, int flags, socket_addr_t *addr
 
     ipv4_send(data, size, &sdp); // should return an error
 
+    vfs_release(file);
     return size;
 }
@@ -14,6 +14,15 @@
 // TODO: There are so many places in this code where
 // something will crash if we run out of memory
 
+// PT_LOAD segments are not copied, they are mapped as lazy regions backed by the
+// executable, so only pages that are touched are read from the filesystem.
+
+typedef struct {
+    dentry_t *file;     // Pinned executable
+    elf64_ehdr ehdr;    // ELF header
+    elf64_phdr phdr[];  // Program headers
+} exec_t;
+
 static size_t copy_argv(char **argv, uint64_t addr)
 {
     int argc, memsz, offset;
@@ -39,13 +48,12 @@ static size_t copy_argv(char **argv, uint64_t addr)
 
     if(addr)
     {
-        memsz = (memsz + PAGE_SIZE - 1) / PAGE_SIZE;
-        end = addr;
+        memsz = PAGE_ALIGN(memsz);
+        end = addr + memsz;
 
-        while(memsz--)
+        if(vmm_alloc_range(addr, memsz, VMM_WRITE) < 0)
         {
-            vmm_alloc_page(end);
-            end += PAGE_SIZE;
+            return addr;
         }
     }
     else
@@ -69,46 +77,44 @@ static size_t copy_argv(char **argv, uint64_t addr)
     return end;
 }
 
-static int execve_load(void *base, char **argv, char **envp)
+static int execve_load(exec_t *exec, char **argv, char **envp)
 {
     size_t brk, stack;
     size_t varg, venv;
-    elf64_ehdr *ehdr;
     elf64_phdr *phdr;
     process_t *pr;
     uintptr_t rip;
+    int status;
 
-    ehdr = (elf64_ehdr*)base;
-    phdr = (elf64_phdr*)(base + ehdr->e_phoff);
-    rip = ehdr->e_entry;
+    pr = process_handle();
+    rip = exec->ehdr.e_entry;
     brk = 0;
 
-    for(int i = 0; i < ehdr->e_phnum; i++)
+    // Create memory map
+    mm_init(&pr->mmap, USER_MMAP, USER_MMAP_SIZE);
+
+    for(int i = 0; i < exec->ehdr.e_phnum; i++)
     {
+        phdr = exec->phdr + i;
+
         if(phdr->p_type == PT_LOAD)
         {
             size_t va, vb, msz;
-            size_t fsz, x, w;
-            int status;
-            void *fp;
-
-            // File
-            fsz = phdr->p_filesz;
-            fp = base + phdr->p_offset;
+            int flags;
 
             // Memory size
-            msz = phdr->p_memsz;
-            if(msz & ALIGN_TEST)
-            {
-                msz &= ALIGN_MASK;
-                msz += PAGE_SIZE;
-            }
+            msz = PAGE_ALIGN(phdr->p_memsz);
 
             // Memory address
             va = phdr->p_vaddr;
             vb = phdr->p_vaddr + msz;
 
-            if(va & ALIGN_TEST)
+            if(va & ALIGN_TEST || phdr->p_offset & ALIGN_TEST)
+            {
+                return -ENOEXEC;
+            }
+
+            if(phdr->p_filesz > phdr->p_memsz || vb > USER_MMAP)
             {
                 return -ENOEXEC;
             }
@@ -118,35 +124,28 @@ static int execve_load(void *base, char **argv, char **envp)
                 brk = vb;
             }
 
-            // Allocate pages
-            for(size_t v = va; v < vb; v += PAGE_SIZE)
+            // Permissions, whole file pages are shared with other processes
+            flags = MAP_IMAGE;
+
+            if((phdr->p_flags & PF_WRITE) == 0)
             {
-                status = vmm_alloc_page(v);
-                if(status < 0)
-                {
-                    return status;
-                }
+                flags |= MAP_READONLY;
             }
 
-            // Copy data
-            memset((void*)va, 0, msz);
-            memcpy((void*)va, fp, fsz);
-
-            // Permissions
-            w = (phdr->p_flags & PF_WRITE);
-            x = (phdr->p_flags & PF_EXEC);
+            if(phdr->p_flags & PF_EXEC)
+            {
+                flags |= MAP_EXEC;
+            }
 
-            for(size_t v = va; v < vb; v += PAGE_SIZE)
+            // Map file contents, the rest of the segment is zero-filled
+            vfs_pin_dentry(exec->file);
+            status = mm_map_fixed(&pr->mmap, va, msz, flags, exec->file, phdr->p_offset, phdr->p_filesz);
+            if(status < 0)
             {
-                status = vmm_set_mode(v, w, x);
-                if(status < 0)
-                {
-                    return status;
-                }
+                vfs_unpin(exec->file);
+                return status;
             }
         }
-
-        phdr++;
     }
 
     // Copy arguments
@@ -155,91 +154,141 @@ static int execve_load(void *base, char **argv, char **envp)
     brk  = copy_argv(envp, venv);
 
     // Data segment
-    pr = process_handle();
     pr->brk.start = brk;
     pr->brk.end = brk;
     pr->brk.max = USER_MMAP;
 
     // Create user space stack
-    mm_init(&pr->mmap, USER_MMAP, USER_MMAP_SIZE);
     mm_map(&pr->mmap, PAGE_SIZE, MAP_STACK, &stack);
 
     // Free kernel variables
     kfree(argv);
     kfree(envp);
-    kfree(base);
+    vfs_unpin(exec->file);
+    kfree(exec);
 
     // Execute
     switch_to_user_mode(rip, stack + PAGE_SIZE - 8, varg, venv); // TODO: The -8 fixes stack alignment!! Need to understand what GCC is doing here.
     return 0;
 }
 
-static void execve_stub(void *base, char **argv, char **envp)
+static void execve_stub(exec_t *exec, char **argv, char **envp)
 {
     int status;
-    status = execve_load(base, argv, envp);
+
+    status = execve_load(exec, argv, envp);
+
+    kfree(argv);
+    kfree(envp);
+    vfs_unpin(exec->file);
+    kfree(exec);
+
     process_exit(status);
 }
 
+// Read the ELF and program headers of an executable
+static int execve_read(int fd, exec_t **out)
+{
+    elf64_ehdr ehdr;
+    dentry_t *file;
+    exec_t *exec;
+    size_t size;
+    int status;
+
+    const char magic[] = {
+        0x7f, 'E', 'L', 'F', ELFCLASS64, ELFDATA2LSB, EV_CURRENT
+    };
+
+    status = vfs_pin(fd, &file);
+    if(status < 0)
+    {
+        return status;
+    }
+
+    status = vfs_pread(file, 0, sizeof(elf64_ehdr), &ehdr);
+    if(status != sizeof(elf64_ehdr))
+    {
+        vfs_unpin(file);
+        return (status < 0) ? status : -ENOEXEC;
+    }
+
+    if(memcmp(ehdr.e_ident, magic, sizeof(magic)) != 0)
+    {
+        vfs_unpin(file);
+        return -ENOEXEC;
+    }
+
+    if(ehdr.e_phentsize != sizeof(elf64_phdr))
+    {
+        vfs_unpin(file);
+        return -ENOEXEC;
+    }
+
+    size = ehdr.e_phnum * sizeof(elf64_phdr);
+    exec = kzalloc(sizeof(exec_t) + size);
+    if(!exec)
+    {
+        vfs_unpin(file);
+        return -ENOMEM;
+    }
+
+    status = vfs_pread(file, ehdr.e_phoff, size, exec->phdr);
+    if(status != size)
+    {
+        vfs_unpin(file);
+        kfree(exec);
+        return (status < 0) ? status : -ENOEXEC;
+    }
+
+    exec->file = file;
+    exec->ehdr = ehdr;
+    *out = exec;
+
+    return 0;
+}
+
 pid_t execve(const char *filename, char **argv, char **envp, int stdin, int stdout)
 {
     process_t *process;
     thread_t *thread;
-    fd_t *ifd, *ofd;
+    file_t *in, *out;
     const char *name;
-    elf64_ehdr *ehdr;
     int fd, status;
-    stat_t stat;
+    exec_t *exec;
 
     // File descriptors
-    ifd = fd_find(stdin);
-    if(!ifd)
+    in = fd_get(stdin);
+    if(!in)
     {
         return -EBADF;
     }
 
-    ofd = fd_find(stdout);
-    if(!ofd)
+    out = fd_get(stdout);
+    if(!out)
     {
+        vfs_release(in);
         return -EBADF;
     }
 
-    // Open file
+    // Open file, only the headers are read here
     fd = vfs_open(filename, O_READ);
     if(fd < 0)
     {
+        vfs_release(out);
+        vfs_release(in);
         return fd;
     }
-    vfs_fstat(fd, &stat);
-
-    // Allocate memory
-    ehdr = kzalloc(stat.size);
-    if(!ehdr)
-    {
-        vfs_close(fd);
-        return -ENOMEM;
-    }
 
-    // Read file
-    status = vfs_read(fd, stat.size, ehdr);
+    status = execve_read(fd, &exec);
     vfs_close(fd);
 
     if(status < 0)
     {
-        kfree(ehdr);
+        vfs_release(out);
+        vfs_release(in);
         return status;
     }
 
-    // Check ELF format
-    const char magic[] = {
-        0x7f, 'E', 'L', 'F', ELFCLASS64, ELFDATA2LSB, EV_CURRENT
-    };
-
-    if(memcmp(ehdr->e_ident, magic, sizeof(magic)) != 0)
-    {
-        return -ENOEXEC;
-    }
-
     // Copy arguments
     argv = (void*)copy_argv(argv, 0);
     envp = (void*)copy_argv(envp, 0);
@@ -256,14 +305,16 @@ pid_t execve(const char *filename, char **argv, char **envp, int stdin, int stdo
     }
 
     // Create child
-    thread = thread_create(name, execve_stub, ehdr, argv, envp);
+    thread = thread_create(name, execve_stub, exec, argv, envp);
     thread_priority(thread, TPR_MID);
     process = process_create(name, 0, process_handle());
     process_append_thread(process, thread);
 
     // Clone file descriptors
-    fd_clone(ifd, process);
-    fd_clone(ofd, process);
+    fd_clone(in, process);
+    fd_clone(out, process);
+    vfs_release(out);
+    vfs_release(in);
 
     // Run child
     scheduler_append(thread);
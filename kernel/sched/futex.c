@@ -0,0 +1,169 @@
+#include <kernel/sched/threads.h>
+#include <kernel/sched/futex.h>
+#include <kernel/sched/wq.h>
+#include <kernel/time/timer.h>
+#include <kernel/time/time.h>
+#include <kernel/mem/heap.h>
+#include <kernel/mem/vmm.h>
+#include <kernel/errno.h>
+
+// A futex is a 32 bit word in user memory that threads block on. It is identified by
+// the frame it lives in, so the same word is found through any mapping. Every word
+// with blocked threads has a futex_t with its own wait queue, kept in a hashed bucket
+// until the last waiter leaves. The bucket lock is held while the word is compared and
+// the wait queue is locked, so a wakeup after the word changed cannot be missed.
+
+typedef struct {
+    spinlock_t lock;
+    list_t list;
+} futex_bucket_t;
+
+static futex_bucket_t buckets[FUTEX_BUCKETS];
+
+// A write access resolves lazy and copy-on-write pages, so the key is the final frame
+static uint64_t futex_key(uint32_t *addr)
+{
+    __atomic_fetch_add(addr, 0, __ATOMIC_SEQ_CST);
+    return vmm_get_phys((uint64_t)addr);
+}
+
+static futex_bucket_t *futex_bucket(uint64_t key)
+{
+    return buckets + (((key >> 2) * 2654435761U) % FUTEX_BUCKETS);
+}
+
+static futex_t *futex_find(futex_bucket_t *bucket, uint64_t key)
+{
+    futex_t *futex = 0;
+
+    while(futex = list_iterate(&bucket->list, futex), futex)
+    {
+        if(futex->key == key)
+        {
+            break;
+        }
+    }
+
+    return futex;
+}
+
+static void futex_timeout(timer_t *tm)
+{
+    wq_interrupt(tm->data);
+}
+
+int futex_wait(uint32_t *addr, uint32_t expected, uint64_t timeout)
+{
+    futex_bucket_t *bucket;
+    uint64_t key, deadline;
+    futex_t *futex;
+    thread_t *self;
+    timer_t *tm;
+    int status;
+
+    key = futex_key(addr);
+    if(key == 0)
+    {
+        return -EFAULT;
+    }
+
+    self = thread_handle();
+    deadline = system_timestamp() + timeout;
+    bucket = futex_bucket(key);
+
+    acquire_lock(&bucket->lock);
+
+    // read through the kernel mapping of the frame, a fault must not sleep under the lock
+    if(__atomic_load_n((uint32_t*)vmm_phys_to_virt(key), __ATOMIC_SEQ_CST) != expected)
+    {
+        release_lock(&bucket->lock);
+        return -EAGAIN;
+    }
+
+    futex = futex_find(bucket, key);
+    if(futex == 0)
+    {
+        futex = kzalloc(sizeof(futex_t));
+        if(futex == 0)
+        {
+            release_lock(&bucket->lock);
+            return -ENOMEM;
+        }
+
+        futex->key = key;
+        wq_init(&futex->queue);
+        list_insert(&bucket->list, futex);
+    }
+
+    futex->waiters++;
+
+    // wakers take the queue lock, which is only released once this thread sleeps
+    wq_lock(&futex->queue);
+    release_lock(&bucket->lock);
+
+    if(timeout)
+    {
+        tm = &self->timer;
+        tm->callback = futex_timeout;
+        tm->period = timeout;
+        tm->data = self;
+        timer_start(tm);
+    }
+
+    status = wq_wait(&futex->queue);
+
+    if(timeout)
+    {
+        timer_cancel(&self->timer);
+        if(status == -EINTR && system_timestamp() >= deadline)
+        {
+            status = -ETMOUT;
+        }
+    }
+
+    acquire_lock(&bucket->lock);
+
+    if(--futex->waiters == 0)
+    {
+        list_remove(&bucket->list, futex);
+        kfree(futex);
+    }
+
+    release_lock(&bucket->lock);
+    return status;
+}
+
+int futex_wake(uint32_t *addr, int count)
+{
+    futex_bucket_t *bucket;
+    futex_t *futex;
+    uint64_t key;
+    int woken = 0;
+
+    key = futex_key(addr);
+    if(key == 0)
+    {
+        return -EFAULT;
+    }
+
+    bucket = futex_bucket(key);
+    acquire_lock(&bucket->lock);
+
+    futex = futex_find(bucket, key);
+    while(futex && woken < count && wq_wake_one(&futex->queue))
+    {
+        woken++;
+    }
+
+    release_lock(&bucket->lock);
+    return woken;
+}
+
+void futex_init()
+{
+    for(int i = 0; i < FUTEX_BUCKETS; i++)
+    {
+        buckets[i].lock = 0;
+        list_init(&buckets[i].list, offsetof(futex_t, link));
+    }
+}
@@ -0,0 +1,18 @@
+#pragma once
+
+#include <kernel/sched/types.h>
+#include <kernel/lists.h>
+
+#define FUTEX_BUCKETS 256
+#define FUTEX_ALL     0x7FFFFFFF // count that wakes every waiter
+
+typedef struct {
+    uint64_t key;      // Physical address of the futex word
+    uint32_t waiters;  // Threads blocked or about to block on it
+    wq_t queue;        // Blocked threads
+    link_t link;       // Link in the bucket
+} futex_t;
+
+int futex_wait(uint32_t *addr, uint32_t expected, uint64_t timeout);
+int futex_wake(uint32_t *addr, int count);
+void futex_init();
@@ -1,6 +1,8 @@
 #include <kernel/sched/scheduler.h>
 #include <kernel/sched/kthreads.h>
 #include <kernel/sched/process.h>
+#include <kernel/sched/rcu.h>
+#include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
 
 static process_t *kernel;
@@ -11,7 +13,13 @@ static void kthreads_idle()
     {
         thread_idle_cleaning();
         process_idle_cleaning();
-        asm volatile("hlt");
+        pmm_zero_idle();
+        rcu_idle_cleaning();
+
+        // no interrupt may slip in between arming the timer and halting
+        asm volatile("cli");
+        scheduler_idle();
+        asm volatile("sti; hlt");
     }
 }
 
@@ -0,0 +1,331 @@
+#include <kernel/sched/spinlock.h>
+#include <kernel/x86/percpu.h>
+#include <kernel/x86/strace.h>
+#include <kernel/time/time.h>
+
+// Contended spinlocks are handed over in queue order. A core that waits with interrupts
+// disabled appends its per-core node to the lock and spins on that node only, until the
+// core in front of it gets the lock. Only the first core in the queue watches the lock
+// word itself. Releasing a lock just clears its low byte.
+
+// Threads that wait with interrupts enabled disable them while queued, so they are
+// neither preempted nor moved to another core while their node is in use. A core only
+// waits for one lock at a time, which makes one node per core enough. Before the
+// per-core areas exist, waiters spin until the lock and its queue are empty.
+
+typedef struct {
+    spinlock_t *volatile lock;  // Address of the lock
+    uint64_t site;              // Caller of the first acquisition
+    uint64_t acquired;          // Number of acquisitions
+    uint64_t contended;         // Acquisitions that had to wait
+    uint64_t since;             // Time of the last acquisition
+    uint64_t hold;              // Longest time the lock was held
+} lockstat_t;
+
+volatile int lock_stats = 0;
+static lockstat_t stats[LOCK_STATS];
+
+static bool lock_try(spinlock_t *lock)
+{
+    uint32_t free = 0;
+    return __atomic_compare_exchange_n(lock, &free, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void lock_spin(spinlock_t *lock)
+{
+    while(!lock_try(lock))
+    {
+        while(*lock)
+        {
+            asm volatile("pause");
+        }
+    }
+}
+
+static void lock_queue(spinlock_t *lock)
+{
+    qnode_t *node, *prev, *next;
+    uint32_t val, tail;
+    int id;
+
+    id = percpu_read(id);
+    node = &percpu_area(id)->qnode;
+    node->next = 0;
+    node->locked = 0;
+    tail = (uint32_t)(id + 1) << 16;
+
+    // become the tail, the holder keeps its byte
+    val = *lock;
+    while(!__atomic_compare_exchange_n(lock, &val, (val & ~LOCK_TAIL) | tail, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+    {
+        asm volatile("pause");
+    }
+
+    if(val & LOCK_TAIL)
+    {
+        prev = &percpu_area((val >> 16) - 1)->qnode;
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+
+        while(!__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+        {
+            asm volatile("pause");
+        }
+    }
+
+    // first in the queue, wait for the holder
+    while(1)
+    {
+        val = __atomic_load_n(lock, __ATOMIC_ACQUIRE);
+        if(val & LOCK_LOCKED)
+        {
+            asm volatile("pause");
+            continue;
+        }
+
+        // the last queued core clears the tail as well
+        if((val & LOCK_TAIL) == tail)
+        {
+            if(__atomic_compare_exchange_n(lock, &val, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                return;
+            }
+            continue;
+        }
+
+        if(__atomic_compare_exchange_n(lock, &val, val | 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            break;
+        }
+    }
+
+    // the next core has already started to link itself in
+    while(next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE), next == 0)
+    {
+        asm volatile("pause");
+    }
+
+    __atomic_store_n(&next->locked, 1, __ATOMIC_RELEASE);
+}
+
+// Readers share the lock word while no writer holds or waits for it. A writer first
+// claims the writer bit, which keeps new readers out, and then waits for the readers
+// that are still inside to leave. Readers must not nest, a waiting writer would block
+// the inner one.
+
+void read_lock(rwlock_t *lock)
+{
+    uint32_t val;
+
+    while(1)
+    {
+        val = __atomic_load_n(lock, __ATOMIC_RELAXED);
+        if((val & RWLOCK_WRITER) == 0 && __atomic_compare_exchange_n(lock, &val, val + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return;
+        }
+        asm volatile("pause");
+    }
+}
+
+void read_unlock(rwlock_t *lock)
+{
+    __atomic_sub_fetch(lock, 1, __ATOMIC_RELEASE);
+}
+
+void write_lock(rwlock_t *lock)
+{
+    while(__atomic_fetch_or(lock, RWLOCK_WRITER, __ATOMIC_ACQUIRE) & RWLOCK_WRITER)
+    {
+        while(__atomic_load_n(lock, __ATOMIC_RELAXED) & RWLOCK_WRITER)
+        {
+            asm volatile("pause");
+        }
+    }
+
+    while(__atomic_load_n(lock, __ATOMIC_ACQUIRE) != RWLOCK_WRITER)
+    {
+        asm volatile("pause");
+    }
+}
+
+void write_unlock(rwlock_t *lock)
+{
+    __atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+// For writers that can be reached from interrupt handlers
+void write_lock_safe(rwlock_t *lock, uint32_t *flags)
+{
+    disable_interrupts(flags);
+    write_lock(lock);
+}
+
+void write_unlock_safe(rwlock_t *lock, uint32_t *flags)
+{
+    write_unlock(lock);
+    restore_interrupts(flags);
+}
+
+// Finds the statistics of a lock, new locks are only added on acquisition
+static lockstat_t *lock_stat(spinlock_t *lock, uint64_t site, bool add)
+{
+    spinlock_t *empty;
+    lockstat_t *stat;
+    uint32_t index;
+
+    index = ((uint64_t)lock >> 2) * 2654435761U;
+    for(int i = 0; i < LOCK_STATS; i++)
+    {
+        stat = stats + ((index + i) % LOCK_STATS);
+        if(stat->lock == lock)
+        {
+            return stat;
+        }
+
+        if(stat->lock == 0 && !add)
+        {
+            return 0;
+        }
+
+        empty = 0;
+        if(stat->lock == 0 && __atomic_compare_exchange_n(&stat->lock, &empty, lock, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        {
+            stat->site = site;
+            return stat;
+        }
+
+        if(stat->lock == lock)
+        {
+            return stat;
+        }
+    }
+
+    return 0;
+}
+
+static void lock_acquired(spinlock_t *lock, uint64_t site, bool contended)
+{
+    lockstat_t *stat;
+
+    stat = lock_stat(lock, site, true);
+    if(stat)
+    {
+        __atomic_add_fetch(&stat->acquired, 1, __ATOMIC_RELAXED);
+        if(contended)
+        {
+            __atomic_add_fetch(&stat->contended, 1, __ATOMIC_RELAXED);
+        }
+        stat->since = system_timestamp();
+    }
+}
+
+// Called by acquire_lock when the lock is taken or statistics are enabled
+void lock_acquire_slow(spinlock_t *lock)
+{
+    bool contended;
+    uint32_t flags;
+
+    contended = !lock_try(lock);
+    if(contended)
+    {
+        if(percpu_read(id) < 0)
+        {
+            lock_spin(lock);
+        }
+        else
+        {
+            disable_interrupts(&flags);
+            lock_queue(lock);
+            restore_interrupts(&flags);
+        }
+    }
+
+    if(lock_stats)
+    {
+        lock_acquired(lock, (uint64_t)__builtin_return_address(0), contended);
+    }
+}
+
+int lock_try_slow(spinlock_t *lock)
+{
+    if(!lock_try(lock))
+    {
+        return 0;
+    }
+
+    lock_acquired(lock, (uint64_t)__builtin_return_address(0), false);
+    return 1;
+}
+
+void lock_release_slow(spinlock_t *lock)
+{
+    lockstat_t *stat;
+    uint64_t hold;
+
+    stat = lock_stat(lock, 0, false);
+    if(stat && stat->since)
+    {
+        hold = system_timestamp() - stat->since;
+        if(hold > stat->hold)
+        {
+            stat->hold = hold;
+        }
+    }
+
+    __atomic_store_n((volatile uint8_t*)lock, 0, __ATOMIC_RELEASE);
+}
+
+void lock_stats_enable()
+{
+    lock_stats = 1;
+}
+
+// Reports the most contended locks
+void sysinfo_lockstat(sysinfo_t *sys)
+{
+    lockstat_t *top[16];
+    lockstat_t *stat;
+    const char *name;
+    int count = 0;
+    int i;
+
+    sysinfo_write(sys, "enabled=%d", lock_stats);
+
+    for(int n = 0; n < LOCK_STATS; n++)
+    {
+        stat = stats + n;
+        if(stat->lock == 0 || stat->contended == 0)
+        {
+            continue;
+        }
+
+        // insertion into the sorted top list
+        for(i = count; i > 0 && top[i - 1]->contended < stat->contended; i--)
+        {
+            if(i < 16)
+            {
+                top[i] = top[i - 1];
+            }
+        }
+
+        if(i < 16)
+        {
+            top[i] = stat;
+            count += (count < 16);
+        }
+    }
+
+    sysinfo_write(sys, "locks=%d", count);
+
+    for(int n = 0; n < count; n++)
+    {
+        stat = top[n];
+        name = strace_symbol(stat->site);
+
+        sysinfo_write(sys, "lock%d.addr=%#lx", n, (uint64_t)stat->lock);
+        sysinfo_write(sys, "lock%d.site=%s", n, name ? name : "?");
+        sysinfo_write(sys, "lock%d.acquired=%lu", n, stat->acquired);
+        sysinfo_write(sys, "lock%d.contended=%lu", n, stat->contended);
+        sysinfo_write(sys, "lock%d.hold=%lu", n, stat->hold);
+    }
+}
@@ -1,9 +1,28 @@
+#include <kernel/sched/kthreads.h>
 #include <kernel/sched/threads.h>
 #include <kernel/sched/mutex.h>
 #include <kernel/sched/wq.h>
+#include <kernel/x86/smp.h>
 #include <kernel/mem/heap.h>
 #include <kernel/errno.h>
 #include <kernel/lists.h>
+#include <kernel/debug.h>
+
+// A waiter spins as long as the owner runs on another core, since it will most likely
+// release the mutex before a sleep and wakeup would complete. It blocks when the owner
+// is not running, or after spinning for MUTEX_SPIN. Sleeping waiters get the mutex
+// handed over in order, spinners only take it when nobody sleeps.
+
+static bool adaptive = true;
+
+static mutex_t *bench_mutex;
+static volatile int bench_stop;
+static volatile uint32_t bench_done;
+static volatile uint64_t bench_count;
+static volatile uint64_t bench_handoffs;
+static volatile uint64_t bench_latency;
+static volatile uint64_t bench_released;
+static thread_t *volatile bench_last;
 
 mutex_t *create_mutex()
 {
@@ -18,6 +37,7 @@ mutex_t *create_mutex()
     wq_init(&mutex->queue);
     mutex->lock = 0;
     mutex->free = true;
+    mutex->owner = 0;
 
     return mutex;
 }
@@ -32,57 +52,187 @@ int free_mutex(mutex_t *mutex)
     return 0;
 }
 
+// Spins while the owner keeps running on another core, returns false when it is time to block
+static bool mutex_spin(mutex_t *mutex, thread_t *owner, thread_t *self)
+{
+    uint64_t end;
+
+    if(!adaptive || owner == 0)
+    {
+        return false;
+    }
+
+    // threads holding a mutex do not exit, so the owner can be looked at
+    end = system_timestamp() + MUTEX_SPIN;
+
+    while(!mutex->free && mutex->owner == owner)
+    {
+        if(owner->state != RUNNING || owner->core == self->core)
+        {
+            return false;
+        }
+
+        if(system_timestamp() > end)
+        {
+            return false;
+        }
+
+        asm volatile("pause");
+    }
+
+    return true;
+}
+
 int acquire_mutex(mutex_t *mutex, bool nonblock)
 {
-    thread_t *thread;
-    int status;
+    thread_t *thread, *owner;
 
     thread = thread_handle();
-    status = 0;
 
+    while(1)
+    {
+        wq_lock(&mutex->queue);
+
+        if(mutex->free)
+        {
+            mutex->free = false;
+            mutex->owner = thread;
+            wq_unlock(&mutex->queue);
+            return 0;
+        }
+
+        if(nonblock)
+        {
+            wq_unlock(&mutex->queue);
+            return -EBUSY;
+        }
+
+        owner = mutex->owner;
+        wq_unlock(&mutex->queue);
+
+        if(!mutex_spin(mutex, owner, thread))
+        {
+            break;
+        }
+    }
+
+    // the mutex is handed over on wakeup, unless it was released in the meantime
     wq_lock(&mutex->queue);
 
     if(mutex->free)
     {
         mutex->free = false;
-        thread->yield = 0;
+        mutex->owner = thread;
+        wq_unlock(&mutex->queue);
+        return 0;
     }
-    else
+
+    // on success release_mutex already made this thread the owner
+    return wq_wait(&mutex->queue);
+}
+
+void release_mutex(mutex_t *mutex)
+{
+    thread_t *next;
+
+    wq_lock(&mutex->queue);
+
+    // the woken thread owns the mutex from here on, spinners never see the old owner
+    next = wq_wake_one(&mutex->queue);
+    mutex->owner = next;
+    if(!next)
     {
-        if(nonblock)
+        mutex->free = true;
+    }
+
+    wq_unlock(&mutex->queue);
+}
+
+static void bench_entry()
+{
+    thread_t *self;
+    uint64_t now;
+
+    self = thread_handle();
+
+    while(!bench_stop)
+    {
+        acquire_mutex(bench_mutex, false);
+
+        if(bench_last != self && bench_released)
         {
-            status = -EBUSY;
-            thread->yield = 0;
+            now = system_timestamp();
+            bench_latency += now - bench_released;
+            bench_handoffs++;
         }
-        else
+
+        // short critical section
+        for(int i = 0; i < 100; i++)
         {
-            thread->yield = 1;
+            asm volatile("pause");
         }
+
+        bench_count++;
+        bench_last = self;
+        bench_released = system_timestamp();
+        release_mutex(bench_mutex);
     }
 
-    if(thread->yield)
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+    thread_exit();
+}
+
+static void bench_run(int threads)
+{
+    uint64_t start, elapsed;
+
+    bench_stop = 0;
+    bench_done = 0;
+    bench_count = 0;
+    bench_handoffs = 0;
+    bench_latency = 0;
+    bench_released = 0;
+    bench_last = 0;
+
+    start = system_timestamp();
+    for(int i = 0; i < threads; i++)
     {
-        status = wq_wait(&mutex->queue);
+        kthreads_run(kthreads_create("bench-mutex", bench_entry, 0, TPR_MID));
     }
-    else
+
+    thread_sleep(NANOSECONDS(200, TIME_MS));
+    bench_stop = 1;
+    elapsed = system_timestamp() - start;
+
+    while(__atomic_load_n(&bench_done, __ATOMIC_ACQUIRE) < (uint32_t)threads)
     {
-        wq_unlock(&mutex->queue);
+        thread_sleep(NANOSECONDS(1, TIME_MS));
     }
 
-    return status;
+    kp_info("mutex", "%s, %d threads: %lu sections/s, %lu handoffs, %lu ns per handoff",
+        adaptive ? "adaptive" : "blocking", threads, (bench_count * TIME_NS) / elapsed,
+        bench_handoffs, bench_handoffs ? bench_latency / bench_handoffs : 0);
 }
 
-void release_mutex(mutex_t *mutex)
+// Threads on 2 to N cores take turns on one mutex, once blocking only and once adaptive
+void mutex_benchmark()
 {
-    int status;
+    int cores;
 
-    wq_lock(&mutex->queue);
+    bench_mutex = create_mutex();
+    if(bench_mutex == 0)
+    {
+        return;
+    }
 
-    status = wq_wake_one(&mutex->queue);
-    if(!status)
+    cores = smp_core_count();
+    for(int threads = 2; threads <= cores || threads == 2; threads++)
     {
-        mutex->free = true;
+        adaptive = false;
+        bench_run(threads);
+        adaptive = true;
+        bench_run(threads);
     }
 
-    wq_unlock(&mutex->queue);
+    free_mutex(bench_mutex);
 }
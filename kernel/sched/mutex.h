@@ -1,14 +1,12 @@
 #pragma once
 
 #include <kernel/sched/types.h>
+#include <kernel/time/time.h>
 
-typedef struct {
-    spinlock_t lock;
-    wq_t queue;
-    bool free;
-} mutex_t;
+#define MUTEX_SPIN NANOSECONDS(50, TIME_US) // longest spin before a waiter blocks
 
 int free_mutex(mutex_t *mutex);
 mutex_t *create_mutex();
 int acquire_mutex(mutex_t *mutex, bool nonblock);
 void release_mutex(mutex_t *mutex);
+void mutex_benchmark();
@@ -1,9 +1,12 @@
 #include <kernel/sched/scheduler.h>
 #include <kernel/sched/process.h>
 #include <kernel/sched/threads.h>
+#include <kernel/sched/mutex.h>
 #include <kernel/sched/wq.h>
+#include <kernel/x86/fpu.h>
 #include <kernel/mem/heap.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/mem/map.h>
 #include <kernel/vfs/vfs.h>
 #include <kernel/vfs/fd.h>
 #include <kernel/sysinfo.h>
@@ -146,6 +149,7 @@ void process_exit(int status)
 
     // destroy address space
     vmm_destroy_user_space();
+    mm_destroy(&self->mmap);
 
     // parent adopts children
     while(child = list_pop(&self->children), child)
@@ -209,12 +213,21 @@ process_t *process_create(const char *name, uint64_t pml4, process_t *parent)
         return 0;
     }
 
+    // Threads of the process share the address space
+    process->mm_lock = create_mutex();
+    if(process->mm_lock == 0)
+    {
+        kfree(process);
+        return 0;
+    }
+
     // Create new address space, if needed
     if(pml4 == 0)
     {
         pml4 = vmm_create_user_space();
         if(pml4 == 0)
         {
+            free_mutex(process->mm_lock);
             kfree(process);
             return 0;
         }
@@ -230,6 +243,7 @@ process_t *process_create(const char *name, uint64_t pml4, process_t *parent)
     process->cwd = 0;
     process->pml4 = pml4;
     process->fd.next = 0;
+    process->fd.lock = 0;
 
     list_init(&process->children, offsetof(process_t, clink));
     list_init(&process->threads, offsetof(thread_t, plink));
@@ -260,6 +274,178 @@ process_t *process_create(const char *name, uint64_t pml4, process_t *parent)
     return process;
 }
 
+// The child shares all pages copy-on-write and returns to user space with the registers of the caller
+pid_t process_fork(syscall_frame_t *frame)
+{
+    process_t *self, *child;
+    thread_t *curr, *thread;
+    stack_t *stack;
+    uint64_t pml4;
+    list_t mmap;
+    fd_t *fd, *new;
+
+    self = process_handle();
+    curr = thread_handle();
+
+    thread = thread_create(curr->name, 0, 0, 0, 0);
+    if(!thread)
+    {
+        return -ENOMEM;
+    }
+
+    // the child continues with the FPU and vector registers of the caller
+    fpu_copy(thread, curr);
+
+    // sibling threads must not fault or change mappings while the address space is copied
+    acquire_mutex(self->mm_lock, false);
+
+    pml4 = vmm_clone_user_space();
+    if(pml4 == 0)
+    {
+        release_mutex(self->mm_lock);
+        kfree(thread);
+        return -ENOMEM;
+    }
+
+    // pages of the parent are write-protected now
+    vmm_flush_range(0, USER_END);
+
+    if(mm_clone(&mmap, &self->mmap) < 0)
+    {
+        release_mutex(self->mm_lock);
+        mm_destroy(&mmap);
+        vmm_free_user_space(pml4);
+        kfree(thread);
+        return -ENOMEM;
+    }
+
+    child = process_create(self->name, pml4, self);
+    if(!child)
+    {
+        release_mutex(self->mm_lock);
+        mm_destroy(&mmap);
+        vmm_free_user_space(pml4);
+        kfree(thread);
+        return -ENOMEM;
+    }
+
+    child->mmap = mmap;
+    child->brk.start = self->brk.start;
+    child->brk.end = self->brk.end;
+    child->brk.max = self->brk.max;
+    release_mutex(self->mm_lock);
+
+    // file descriptors keep their numbers
+    fd = 0;
+    read_lock(&self->fd.lock);
+    while(fd = list_iterate_reverse(&self->fd.list, fd), fd)
+    {
+        new = fd_clone(fd->file, child);
+        if(new)
+        {
+            new->id = fd->id;
+        }
+    }
+    child->fd.next = self->fd.next;
+    read_unlock(&self->fd.lock);
+
+    // the thread starts directly in user space, fork returns zero there
+    stack = thread->stack;
+    stack->ss     = 0x1B;
+    stack->rsp    = frame->rsp;
+    stack->rflags = (frame->r11 | 0x200);
+    stack->cs     = 0x23;
+    stack->rip    = frame->rcx;
+    stack->rax    = 0;
+    stack->rbx    = frame->rbx;
+    stack->rcx    = frame->rcx;
+    stack->rdx    = frame->rdx;
+    stack->rdi    = frame->rdi;
+    stack->rsi    = frame->rsi;
+    stack->rbp    = frame->rbp;
+    stack->r8     = frame->r8;
+    stack->r9     = frame->r9;
+    stack->r10    = frame->r10;
+    stack->r11    = frame->r11;
+    stack->r12    = frame->r12;
+    stack->r13    = frame->r13;
+    stack->r14    = frame->r14;
+    stack->r15    = frame->r15;
+
+    thread_priority(thread, curr->priority);
+    process_append_thread(child, thread);
+    scheduler_append(thread);
+
+    return child->pid;
+}
+
+// The new thread shares the address space and starts at entry(arg) on the given user stack
+pid_t process_create_thread(uint64_t entry, uint64_t rsp, uint64_t arg)
+{
+    thread_t *curr, *thread;
+    process_t *self;
+    stack_t *stack;
+
+    self = process_handle();
+    curr = thread_handle();
+
+    thread = thread_create(curr->name, 0, 0, 0, 0);
+    if(!thread)
+    {
+        return -ENOMEM;
+    }
+
+    stack = thread->stack;
+    stack->ss     = 0x1B;
+    stack->rsp    = rsp;
+    stack->rflags = 0x0202;
+    stack->cs     = 0x23;
+    stack->rip    = entry;
+    stack->rdi    = arg;
+
+    thread_priority(thread, curr->priority);
+    process_append_thread(self, thread);
+    scheduler_append(thread);
+
+    return thread->tid;
+}
+
+// Ends the calling thread, the last one ends the process
+void process_exit_thread()
+{
+    thread_t *curr, *item;
+    process_t *self;
+    uint32_t flags;
+    bool last;
+
+    self = process_handle();
+    curr = thread_handle();
+    item = 0;
+    last = true;
+
+    // the state changes with the lock held, so only one of two exiting threads is last
+    acquire_safe_lock(&self->lock, &flags);
+
+    while(item = list_iterate(&self->threads, item), item)
+    {
+        if(item != curr && item->state != TERMINATED)
+        {
+            last = false;
+        }
+    }
+
+    if(last)
+    {
+        release_safe_lock(&self->lock, &flags);
+        process_exit(0);
+    }
+
+    curr->state = TERMINATED;
+    release_lock(&self->lock);
+
+    thread_exit();
+}
+
 void process_idle_cleaning()
 {
     static lock_t lock = 0;
@@ -278,13 +464,83 @@ void process_idle_cleaning()
         }
 
         list_pop(&reaped);
-        // TODO: mm_destroy ?
+        free_mutex(item->mm_lock);
         kfree(item);
     }
 
     atomic_unlock(&lock);
 }
 
+// returns zero when the fault was resolved
+int process_page_fault(size_t addr, size_t error)
+{
+    process_t *pr;
+    size_t span;
+    int status;
+
+    pr = process_handle();
+
+    // file backed faults may block, so the lock is a mutex
+    acquire_mutex(pr->mm_lock, false);
+
+    // another thread of the process resolved the fault in the meantime,
+    // other protection faults on present pages remain errors
+    if((!(error & FAULT_PRESENT) || (error & FAULT_WRITE)) && vmm_accessible(addr, (error & FAULT_WRITE) != 0))
+    {
+        release_mutex(pr->mm_lock);
+        return 0;
+    }
+
+    // write to a page shared with a forked process
+    if((error & FAULT_PRESENT) && (error & FAULT_WRITE) && vmm_cow_page(addr & ALIGN_MASK) == 0)
+    {
+        status = 0;
+    }
+    else if(addr >= pr->brk.start && addr < pr->brk.end)
+    {
+        if(error & FAULT_PRESENT)
+        {
+            release_mutex(pr->mm_lock);
+            return -EFAULT;
+        }
+
+        // the heap takes a large page when the whole aligned span is below the break
+        span = (addr & LARGE_ALIGN_MASK);
+        if(span >= pr->brk.start && span + LARGE_PAGE_SIZE <= pr->brk.end &&
+           vmm_alloc_large_page(span, VMM_WRITE | VMM_ZERO) == 0)
+        {
+            status = MM_FAULT_LARGE;
+        }
+        else
+        {
+            status = vmm_alloc_zero_page(addr & ALIGN_MASK);
+        }
+    }
+    else
+    {
+        status = mm_fault(&pr->mmap, addr, error);
+    }
+
+    if(status < 0)
+    {
+        release_mutex(pr->mm_lock);
+        return status;
+    }
+
+    if(status == MM_FAULT_LARGE)
+    {
+        pr->pages.large++;
+    }
+    else
+    {
+        pr->pages.small++;
+    }
+
+    pr->minflt++;
+    release_mutex(pr->mm_lock);
+    return 0;
+}
+
 void sysinfo_proclist(sysinfo_t *sys)
 {
     process_t *item = 0;
@@ -319,6 +575,9 @@ void sysinfo_procinfo(sysinfo_t *sys, size_t pid)
     sysinfo_write(sys, "uid=%u", item->state);
     sysinfo_write(sys, "gid=%u", item->state);
     sysinfo_write(sys, "memsz=%u", item->brk.end - item->brk.start); // TODO: this is only brk memory, we also have mmap and the size of the program itself
+    sysinfo_write(sys, "minflt=%lu", item->minflt);
+    sysinfo_write(sys, "smallpages=%lu", item->pages.small);
+    sysinfo_write(sys, "largepages=%lu", item->pages.large);
     sysinfo_write(sys, "threads=%u", item->threads.length);
 
     while(th = list_iterate_reverse(&item->threads, th), th)
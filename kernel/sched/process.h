@@ -11,9 +11,13 @@ void process_append_thread(process_t *parent, thread_t *thread);
 void process_remove_thread(thread_t *thread);
 
 process_t *process_create(const char *name, uint64_t pml4, process_t *parent);
+pid_t process_fork(syscall_frame_t *frame);
+pid_t process_create_thread(uint64_t entry, uint64_t rsp, uint64_t arg);
+void process_exit_thread();
 process_t *process_handle();
 
 void process_idle_cleaning();
+int process_page_fault(size_t addr, size_t error);
 
 void sysinfo_proclist(sysinfo_t *sys);
 void sysinfo_procinfo(sysinfo_t *sys, size_t pid);
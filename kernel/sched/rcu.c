@@ -0,0 +1,267 @@
+#include <kernel/sched/scheduler.h>
+#include <kernel/sched/kthreads.h>
+#include <kernel/sched/threads.h>
+#include <kernel/sched/rcu.h>
+#include <kernel/x86/percpu.h>
+#include <kernel/x86/smp.h>
+#include <kernel/mem/heap.h>
+#include <kernel/time/time.h>
+#include <kernel/atomic.h>
+#include <kernel/debug.h>
+
+// Readers keep interrupts disabled, so they are neither preempted nor switched out in
+// the middle of a list. Every pass of a core through its scheduler, and every round of
+// its idle loop, is therefore a quiescent point. Once all cores have passed one after an
+// item was unlinked, no reader can still hold it. Freed items are collected in batches,
+// each batch waits for one such grace period and is released by the idle threads.
+// Cores that take too long, usually because they halt, get a scheduler interrupt.
+
+#define RCU_KICK       NANOSECONDS(10, TIME_MS) // wait before stale cores are interrupted
+#define RCU_BENCH_KEYS 64
+
+typedef struct {
+    uint32_t key;
+    link_t link;
+} bench_item_t;
+
+static LIST_INIT(pending, rcu_t, link);
+static LIST_INIT(waiting, rcu_t, link);
+static uint64_t snapshot[SMP_MAX_CORES];
+static uint64_t started;
+
+static LIST_INIT(bench_list, bench_item_t, link);
+static spinlock_t bench_lock;
+static rwlock_t bench_rwlock;
+static volatile int bench_stop;
+static volatile uint32_t bench_done;
+static volatile uint64_t bench_count;
+static int bench_mode;
+
+void rcu_read_lock(uint32_t *flags)
+{
+    disable_interrupts(flags);
+}
+
+void rcu_read_unlock(uint32_t *flags)
+{
+    restore_interrupts(flags);
+}
+
+// Called by the scheduler of every core
+void rcu_quiescent()
+{
+    percpu_inc(quiescent);
+}
+
+// The item has to be unlinked already, ptr is released with kfree
+void rcu_free(rcu_t *rcu, void *ptr)
+{
+    rcu->ptr = ptr;
+    list_append(&pending, rcu);
+}
+
+// Checks if every running core passed a quiescent point since the snapshot
+static bool rcu_passed(bool kick)
+{
+    percpu_t *area;
+    bool passed;
+    int count;
+
+    passed = true;
+    count = smp_core_count();
+
+    for(int i = 0; i < count; i++)
+    {
+        area = percpu_area(i);
+        if(area->scheduler == 0 || __atomic_load_n(&area->quiescent, __ATOMIC_ACQUIRE) != snapshot[i])
+        {
+            continue;
+        }
+
+        passed = false;
+        if(kick)
+        {
+            scheduler_resched(i);
+        }
+    }
+
+    return passed;
+}
+
+void rcu_idle_cleaning()
+{
+    static lock_t lock = 0;
+    list_t done;
+    rcu_t *rcu;
+    int count;
+
+    // the idle loop never runs inside a reader
+    rcu_quiescent();
+
+    if(pending.length == 0 && waiting.length == 0)
+    {
+        return;
+    }
+
+    if(atomic_lock(&lock))
+    {
+        return;
+    }
+
+    list_init(&done, offsetof(rcu_t, link));
+
+    if(waiting.length)
+    {
+        if(!rcu_passed(system_timestamp() - started > RCU_KICK))
+        {
+            atomic_unlock(&lock);
+            return;
+        }
+
+        while(rcu = list_pop(&waiting), rcu)
+        {
+            list_append(&done, rcu);
+        }
+    }
+
+    // the next batch starts its grace period
+    if(pending.length)
+    {
+        while(rcu = list_pop(&pending), rcu)
+        {
+            list_append(&waiting, rcu);
+        }
+
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+        count = smp_core_count();
+        for(int i = 0; i < count; i++)
+        {
+            snapshot[i] = __atomic_load_n(&percpu_area(i)->quiescent, __ATOMIC_RELAXED);
+        }
+
+        // this core is in its idle loop right now
+        snapshot[smp_core_id()] = ~0UL;
+        started = system_timestamp();
+    }
+
+    atomic_unlock(&lock);
+
+    while(rcu = list_pop(&done), rcu)
+    {
+        kfree(rcu->ptr);
+    }
+}
+
+static bench_item_t *bench_walk(uint32_t key)
+{
+    bench_item_t *item = 0;
+
+    while(item = list_iterate_rcu(&bench_list, item), item)
+    {
+        if(item->key == key)
+        {
+            break;
+        }
+    }
+
+    return item;
+}
+
+static void bench_entry()
+{
+    bench_item_t *item;
+    uint64_t count = 0;
+    uint32_t flags;
+    uint32_t key = 0;
+
+    while(!bench_stop)
+    {
+        key = (key + 17) % RCU_BENCH_KEYS;
+
+        if(bench_mode == 0)
+        {
+            acquire_lock(&bench_lock);
+            item = bench_walk(key);
+            release_lock(&bench_lock);
+        }
+        else if(bench_mode == 1)
+        {
+            read_lock(&bench_rwlock);
+            item = bench_walk(key);
+            read_unlock(&bench_rwlock);
+        }
+        else
+        {
+            rcu_read_lock(&flags);
+            item = bench_walk(key);
+            rcu_read_unlock(&flags);
+        }
+
+        asm volatile("" :: "r" (item));
+        count++;
+    }
+
+    __atomic_add_fetch(&bench_count, count, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+    thread_exit();
+}
+
+static void bench_run(int mode, int threads)
+{
+    static const char *names[] = { "spinlock", "rwlock", "rcu" };
+    uint64_t start, elapsed;
+
+    bench_mode = mode;
+    bench_stop = 0;
+    bench_done = 0;
+    bench_count = 0;
+
+    start = system_timestamp();
+    for(int i = 0; i < threads; i++)
+    {
+        kthreads_run(kthreads_create("bench-rcu", bench_entry, 0, TPR_MID));
+    }
+
+    thread_sleep(NANOSECONDS(200, TIME_MS));
+    bench_stop = 1;
+    elapsed = system_timestamp() - start;
+
+    while(__atomic_load_n(&bench_done, __ATOMIC_ACQUIRE) < (uint32_t)threads)
+    {
+        thread_sleep(NANOSECONDS(1, TIME_MS));
+    }
+
+    kp_info("rcu", "%s, %d threads: %lu lookups/s", names[mode], threads, (bench_count * TIME_NS) / elapsed);
+}
+
+// Readers on all cores look up keys in a short list, under a spinlock, an rwlock and RCU
+void rcu_benchmark()
+{
+    bench_item_t *items;
+    int cores;
+
+    items = kzalloc(RCU_BENCH_KEYS * sizeof(bench_item_t));
+    if(items == 0)
+    {
+        return;
+    }
+
+    for(int i = 0; i < RCU_BENCH_KEYS; i++)
+    {
+        items[i].key = i;
+        list_append_rcu(&bench_list, items + i);
+    }
+
+    cores = smp_core_count();
+    for(int mode = 0; mode < 3; mode++)
+    {
+        bench_run(mode, cores);
+    }
+
+    while(list_pop(&bench_list))
+    {
+    }
+
+    kfree(items);
+}
@@ -0,0 +1,21 @@
+#pragma once
+
+#include <kernel/sched/spinlock.h>
+#include <kernel/lists.h>
+
+// Read-mostly lists are walked without locks between rcu_read_lock and rcu_read_unlock,
+// and changed with the list_*_rcu functions. Items removed from them are handed to
+// rcu_free, which releases them once no reader can still see them.
+
+typedef struct {
+    void *ptr;    // Object to free after the grace period
+    link_t link;  // Link in the list of pending frees
+} rcu_t;
+
+void rcu_read_lock(uint32_t*);
+void rcu_read_unlock(uint32_t*);
+
+void rcu_free(rcu_t*, void*);
+void rcu_quiescent();
+void rcu_idle_cleaning();
+void rcu_benchmark();
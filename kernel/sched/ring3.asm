@@ -17,5 +17,6 @@ switch_to_user_mode:
     push rdi         ; rip
     mov rdi, rdx     ; argv
     mov rsi, rcx     ; envp
+    swapgs           ; user mode runs with its own GS base
     iretq
 .end:
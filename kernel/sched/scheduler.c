@@ -2,44 +2,60 @@
 #include <kernel/sched/scheduler.h>
 #include <kernel/sched/kthreads.h>
 #include <kernel/sched/process.h>
+#include <kernel/sched/rcu.h>
 #include <kernel/x86/ioports.h>
+#include <kernel/time/timer.h>
 #include <kernel/time/time.h>
+#include <kernel/x86/cpuid.h>
+#include <kernel/x86/percpu.h>
 #include <kernel/x86/lapic.h>
+#include <kernel/x86/fpu.h>
 #include <kernel/x86/smp.h>
 #include <kernel/mem/heap.h>
 #include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/time/tsc.h>
 #include <kernel/debug.h>
 #include <string.h>
 
+// Every core owns its run queues. Threads are queued on the core they last ran on,
+// or on the core that woke them when that one is busier. Cores that run out of work
+// take a batch of threads from the busiest sibling, and busy cores wake an idle
+// sibling whenever they queue more work than they run.
+
 static int core_count = 0;
 static scheduler_t *sdata = 0;
+static volatile uint64_t idle_mask = 0;
 
-static void set_scheduler(scheduler_t *scheduler)
-{
-    asm volatile("movq %0, %%dr3" :: "r" (scheduler));
-}
+static volatile int bench_stop;
+static volatile uint32_t bench_done;
+static volatile int bench_closed[SMP_MAX_CORES];
+static uint64_t bench_spins[SMP_MAX_CORES];
+static uint64_t bench_rounds[SMP_MAX_CORES];
+static thread_t *bench_ping[SMP_MAX_CORES];
+static thread_t *bench_pong[SMP_MAX_CORES];
 
 static scheduler_t *get_scheduler()
 {
-    scheduler_t *scheduler;
-    asm volatile("movq %%dr3, %0" : "=r" (scheduler));
-    return scheduler;
+    return percpu_read(scheduler);
 }
 
 static void scheduler_set_thread(scheduler_t *scheduler, thread_t *thread)
 {
-    scheduler->thread_current = thread;
+    if(thread->core >= 0 && thread->core != scheduler->id)
+    {
+        percpu_inc(migrations);
+    }
+
+    thread->core = scheduler->id;
     scheduler->tss->rsp0 = thread->rsp0;
-    scheduler->xstate = thread->xstate;
-    write_msr(MSR_KERNEL_GS_BASE, (uint64_t)&thread->gs);
+    percpu_write(thread, thread);
+    percpu_write(krsp, thread->rsp0);
 }
 
 thread_t *scheduler_get_thread()
 {
-    scheduler_t *scheduler;
-    asm volatile("movq %%dr3, %0" : "=r" (scheduler));
-    return scheduler->thread_current;
+    return percpu_read(thread);
 }
 
 void scheduler_mask()
@@ -71,50 +87,194 @@ static void scheduler_preempt(scheduler_t *scheduler)
     lapic_write(APIC_ICR0, 0x04020);
 }
 
+// Makes another core run its scheduler soon
+void scheduler_resched(int id)
+{
+    scheduler_preempt(sdata + id);
+}
+
+// Keeps the bit of a queue in sync with its length
+static void scheduler_update(scheduler_t *scheduler, list_t *queue, uint32_t bit)
+{
+    if(queue->length)
+    {
+        scheduler->queued |= bit;
+    }
+    else
+    {
+        scheduler->queued &= ~bit;
+    }
+}
+
+static uint64_t all_cores()
+{
+    return (core_count < 64) ? ((1UL << core_count) - 1) : ~0UL;
+}
+
+static void scheduler_enqueue(scheduler_t *scheduler, thread_t *thread)
+{
+    int index;
+
+    index = (scheduler->index + thread->max_count) % 9;
+    list_append(scheduler->std + index, thread);
+    scheduler->queued |= SCHED_QUEUE_STD_SLOT(index);
+    scheduler->count++;
+}
+
+// First non-empty slot of the ring, starting at the current index
+static int scheduler_slot(scheduler_t *scheduler)
+{
+    uint32_t ring;
+
+    ring = (scheduler->queued & SCHED_QUEUE_STD) >> 1;
+    ring = ((ring >> scheduler->index) | (ring << (9 - scheduler->index))) & 0x1FF;
+
+    return (scheduler->index + __builtin_ctz(ring)) % 9;
+}
+
+static uint64_t scheduler_slice(thread_t *thread)
+{
+    // short remainders are not worth a timer interrupt
+    if(thread->slice < SCHED_SLICE_MIN)
+    {
+        thread->slice = SCHED_SLICE;
+    }
+
+    return thread->slice;
+}
+
+// Programs the timer interrupt of this core to fire after the given time
+static void scheduler_arm(scheduler_t *scheduler, uint64_t delta)
+{
+    uint64_t ticks;
+
+    // far deadlines are reached in steps of at most a second
+    if(delta > TIME_NS)
+    {
+        delta = TIME_NS;
+    }
+
+    if(scheduler->deadline)
+    {
+        lapic_timer_deadline(rdtsc() + tsc_cycles(delta));
+        return;
+    }
+
+    ticks = (delta * scheduler->frequency) / TIME_NS;
+    lapic_timer_init(ticks ? ticks : 1, false);
+}
+
+// Takes up to half of the queued threads of the busiest sibling, the lock of this core is held
+static void scheduler_steal(scheduler_t *scheduler)
+{
+    thread_t *batch[SCHED_STEAL_BATCH];
+    scheduler_t *victim = 0;
+    thread_t *thread;
+    list_t *queue;
+    int most = 0;
+    int count, n;
+
+    for(int i = 0; i < core_count; i++)
+    {
+        count = __atomic_load_n(&sdata[i].count, __ATOMIC_RELAXED);
+        if(i != scheduler->id && count > most)
+        {
+            victim = sdata + i;
+            most = count;
+        }
+    }
+
+    // two cores stealing from each other must not deadlock
+    if(victim == 0 || !try_acquire_lock(&victim->lock))
+    {
+        return;
+    }
+
+    count = (victim->count + 1) / 2;
+    if(count > SCHED_STEAL_BATCH)
+    {
+        count = SCHED_STEAL_BATCH;
+    }
+
+    // the threads queued furthest in the future are the coldest
+    n = 0;
+    for(int i = 8; i >= 0 && n < count; i--)
+    {
+        queue = victim->std + (victim->index + i) % 9;
+        while(queue->length && n < count)
+        {
+            thread = list_iterate_reverse(queue, 0);
+            list_remove(queue, thread);
+            victim->count--;
+            batch[n++] = thread;
+        }
+        scheduler_update(victim, queue, SCHED_QUEUE_STD_SLOT((victim->index + i) % 9));
+    }
+
+    release_lock(&victim->lock);
+
+    percpu_area(scheduler->id)->steals += n;
+    while(n)
+    {
+        scheduler_enqueue(scheduler, batch[--n]);
+    }
+}
+
 static uint64_t scheduler_next(scheduler_t *scheduler)
 {
     thread_t *thread;
     list_t *queue;
-    uint64_t ticks;
+    uint64_t slice;
 
     acquire_lock(&scheduler->lock);
-    ticks = scheduler->frequency;
 
-    if(scheduler->srt.length)
+    if((scheduler->queued & (SCHED_QUEUE_SRT | SCHED_QUEUE_STD)) == 0)
+    {
+        scheduler_steal(scheduler);
+    }
+
+    if(scheduler->queued & SCHED_QUEUE_SRT)
     {
         thread = list_pop(&scheduler->srt);
-        ticks = 0;
+        scheduler_update(scheduler, &scheduler->srt, SCHED_QUEUE_SRT);
+        slice = 0;
     }
-    else if(scheduler->count)
+    else if(scheduler->queued & SCHED_QUEUE_STD)
     {
-        while(1)
-        {
-            queue = scheduler->std + scheduler->index;
-            if(queue->length)
-            {
-                thread = list_pop(queue);
-                scheduler->count--;
-                break;
-            }
-            scheduler->index = (scheduler->index + 1) % 9;
-        }
-        ticks /= 100;
+        scheduler->index = scheduler_slot(scheduler);
+        queue = scheduler->std + scheduler->index;
+        thread = list_pop(queue);
+        scheduler_update(scheduler, queue, SCHED_QUEUE_STD_SLOT(scheduler->index));
+        scheduler->count--;
+        slice = scheduler_slice(thread);
     }
-    else if(scheduler->idle.length)
+    else if(scheduler->queued & SCHED_QUEUE_IDLE)
     {
         thread = list_pop(&scheduler->idle);
-        ticks /= 100;
+        scheduler_update(scheduler, &scheduler->idle, SCHED_QUEUE_IDLE);
+        slice = scheduler_slice(thread);
     }
     else
     {
         thread = scheduler->thread_idle;
-        ticks = 0;
+        slice = 0;
+    }
+
+    // idle cores are woken up when a sibling has work to spare
+    if(thread == scheduler->thread_idle)
+    {
+        __atomic_or_fetch(&idle_mask, 1UL << scheduler->id, __ATOMIC_SEQ_CST);
+    }
+    else if(__atomic_fetch_and(&idle_mask, ~(1UL << scheduler->id), __ATOMIC_SEQ_CST) == all_cores())
+    {
+        // the first busy core brings back the periodic tick
+        time_tick_start();
     }
 
     scheduler_set_thread(scheduler, thread);
     release_lock(&scheduler->lock);
 
-    return ticks;
+    return slice;
 }
 
 static uint64_t scheduler_elapsed_time(scheduler_t *scheduler)
@@ -152,58 +312,68 @@ static void scheduler_update_load(scheduler_t *scheduler)
     }
 }
 
+// Threads return to their last core for its caches, unless it is busier than this one
 static scheduler_t *scheduler_select(thread_t *thread)
 {
-    scheduler_t *s;
-    thread_t *ct;
-    uint32_t core = 0;
-    uint32_t min = ~0;
+    scheduler_t *local, *last;
 
-    for(int i = 0; i < core_count; i++)
+    local = get_scheduler();
+    if(thread->core < 0 || thread->core == local->id)
     {
-        s = sdata + i;
-        ct = s->thread_current;
+        return local;
+    }
 
-        if(ct == 0)
-        {
-            continue; // Only happens when initializing the scheduler
-        }
-        else if((ct == thread) && (s->count == 0))
-        {
-            core = i;
-            break;
-        }
-        else if(ct->priority == TPR_IDLE)
-        {
-            core = i;
-            break;
-        }
-        else if(s->count < min)
-        {
-            core = i;
-            min = s->count;
-        }
+    last = sdata + thread->core;
+    if(percpu_area(last->id)->thread == last->thread_idle)
+    {
+        return last;
+    }
+
+    if(__atomic_load_n(&last->count, __ATOMIC_RELAXED) <= __atomic_load_n(&local->count, __ATOMIC_RELAXED))
+    {
+        return last;
     }
 
-    return sdata + core;
+    return local;
+}
+
+// Wakes an idle core other than the given one, so that it steals the spare work
+static void scheduler_kick(scheduler_t *scheduler)
+{
+    uint64_t mask, bit;
+
+    mask = __atomic_load_n(&idle_mask, __ATOMIC_SEQ_CST) & ~(1UL << scheduler->id);
+    if(mask == 0)
+    {
+        return;
+    }
+
+    bit = (mask & -mask);
+    if(__atomic_fetch_and(&idle_mask, ~bit, __ATOMIC_SEQ_CST) & bit)
+    {
+        scheduler_preempt(sdata + __builtin_ctzl(bit));
+    }
 }
 
 void scheduler_append(thread_t *thread)
 {
-    int pc, pn, preempt, index;
+    int pc, pn, preempt, spare;
     scheduler_t *scheduler;
+    thread_t *current;
     uint32_t flags;
 
     scheduler = scheduler_select(thread);
     acquire_safe_lock(&scheduler->lock, &flags);
 
     preempt = 0;
-    pc = scheduler->thread_current->priority;
+    current = percpu_area(scheduler->id)->thread;
+    pc = current->priority;
     pn = thread->priority;
 
     if(pn == TPR_SRT)
     {
         list_append(&scheduler->srt, thread);
+        scheduler->queued |= SCHED_QUEUE_SRT;
         if(pc < pn)
         {
             preempt = 1;
@@ -212,22 +382,28 @@ void scheduler_append(thread_t *thread)
     else if(pn == TPR_IDLE)
     {
         list_append(&scheduler->idle, thread);
+        scheduler->queued |= SCHED_QUEUE_IDLE;
     }
     else
     {
-        index = (scheduler->index + thread->max_count) % 9,
-        list_append(scheduler->std + index, thread);
-        scheduler->count++;
+        scheduler_enqueue(scheduler, thread);
         if(pc == TPR_IDLE)
         {
             preempt = 1;
         }
     }
 
+    // a preempted thread is picked again right away when nothing else is queued
+    spare = scheduler->count - (current == thread);
+
     if(preempt)
     {
         scheduler_preempt(scheduler);
     }
+    else if(pn != TPR_IDLE && spare > 0)
+    {
+        scheduler_kick(scheduler);
+    }
 
     release_safe_lock(&scheduler->lock, &flags);
 }
@@ -238,17 +414,27 @@ uint64_t schedule_handler(uint64_t rsp)
     uint64_t old_pml4;
     uint64_t new_pml4;
     uint64_t elapsed;
-    uint64_t ticks;
+    uint64_t deadline;
+    uint64_t delta;
     thread_t *thread;
+    thread_t *previous;
 
     scheduler = get_scheduler();
     elapsed = scheduler_elapsed_time(scheduler);
-    thread = scheduler->thread_current;
+    thread = percpu_read(thread);
+    previous = thread;
+
+    // interrupts were enabled, so no RCU reader is active on this core
+    rcu_quiescent();
 
     if(thread)
     {
+        // the thread may run elsewhere once it is queued or its lock is released
+        fpu_switch_out(thread);
+
         thread->rsp = rsp;
         thread->time_used += elapsed;
+        thread->slice = ((elapsed < thread->slice) ? thread->slice - elapsed : 0);
         old_pml4 = thread->parent->pml4;
 
         if(thread == scheduler->thread_idle)
@@ -257,6 +443,7 @@ uint64_t schedule_handler(uint64_t rsp)
         }
         else if(thread->state == RUNNING)
         {
+            percpu_inc(preemptions);
             thread->state = READY;
             scheduler_append(thread);
         }
@@ -274,9 +461,19 @@ uint64_t schedule_handler(uint64_t rsp)
         old_pml4 = 0;
     }
 
+    // timers started on this core expire on its scheduler interrupt
+    timer_tick();
+
     scheduler_update_load(scheduler);
-    ticks = scheduler_next(scheduler);
-    thread = scheduler->thread_current;
+    delta = scheduler_next(scheduler);
+    thread = percpu_read(thread);
+
+    if(thread != previous)
+    {
+        percpu_inc(switches);
+    }
+
+    fpu_switch_in(thread);
 
     rsp = thread->rsp;
     thread->state = RUNNING;
@@ -310,15 +507,64 @@ uint64_t schedule_handler(uint64_t rsp)
         vmm_load_pml4(new_pml4);
     }
 
-    if(ticks)
+    // the interrupt comes at the end of the slice or at the first timer of this core
+    deadline = timer_next_event();
+    if(deadline)
+    {
+        deadline = (deadline > scheduler->tsc0) ? (deadline - scheduler->tsc0) : 1;
+        if(delta == 0 || deadline < delta)
+        {
+            delta = deadline;
+        }
+    }
+
+    if(delta)
+    {
+        scheduler->event = scheduler->tsc0 + delta;
+        scheduler_arm(scheduler, delta);
+    }
+    else
     {
-        lapic_timer_init(ticks, false);
+        scheduler->event = ~0UL;
     }
 
     lapic_write(APIC_EOI, 0);
     return rsp;
 }
 
+static bool scheduler_all_idle()
+{
+    return (__atomic_load_n(&idle_mask, __ATOMIC_SEQ_CST) == all_cores());
+}
+
+// Called by the idle thread with interrupts disabled, right before it halts
+// Once every core is idle the periodic tick is stopped. Each core has already
+// programmed its timer interrupt for its own first timer.
+void scheduler_idle()
+{
+    if(scheduler_all_idle())
+    {
+        time_tick_stop(scheduler_all_idle);
+    }
+}
+
+// Brings the timer interrupt of this core forward to a new deadline, interrupts are disabled
+void scheduler_event(uint64_t deadline)
+{
+    scheduler_t *scheduler;
+    uint64_t now;
+
+    scheduler = get_scheduler();
+    if(deadline >= scheduler->event)
+    {
+        return;
+    }
+
+    now = system_timestamp();
+    scheduler->event = deadline;
+    scheduler_arm(scheduler, (deadline > now) ? (deadline - now) : 1);
+}
+
 void scheduler_init_core(int count, int id, int apic_id, tss_t *tss)
 {
     scheduler_t *scheduler;
@@ -336,10 +582,11 @@ void scheduler_init_core(int count, int id, int apic_id, tss_t *tss)
     rsp = vmm_phys_to_virt(rsp);
 
     scheduler = sdata + id;
+    scheduler->id = id;
     scheduler->rsp = rsp + PAGE_SIZE;
-    scheduler->xstate = rsp;
     scheduler->apic_id = apic_id;
     scheduler->frequency = lapic_timer_calibrate();
+    scheduler->deadline = (cpuid_feature(CPU_FEATURE_TSCDL) && tsc_frequency());
     scheduler->thread_idle = kthreads_create_idle();
     scheduler->tss = tss;
 
@@ -350,7 +597,8 @@ void scheduler_init_core(int count, int id, int apic_id, tss_t *tss)
         list_init(scheduler->std + i, offsetof(thread_t, slink));
     }
 
-    set_scheduler(scheduler);
+    percpu_write(scheduler, scheduler);
+    timer_init_core(id);
 }
 
 void scheduler_init()
@@ -366,3 +614,128 @@ void scheduler_init()
 
     lapic_bcast_ipi(32, true, true);
 }
+
+static void bench_spin(uint64_t *count)
+{
+    while(!bench_stop)
+    {
+        (*count)++;
+    }
+
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+    thread_exit();
+}
+
+static void bench_ping_entry(size_t pair)
+{
+    while(!bench_stop)
+    {
+        thread_signal(bench_pong[pair]);
+        thread_wait();
+        bench_rounds[pair]++;
+    }
+
+    // the partner only exits after it got this last signal
+    bench_closed[pair] = 1;
+    thread_signal(bench_pong[pair]);
+
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+    thread_exit();
+}
+
+static void bench_pong_entry(size_t pair)
+{
+    while(1)
+    {
+        thread_wait();
+        if(bench_closed[pair])
+        {
+            break;
+        }
+        thread_signal(bench_ping[pair]);
+    }
+
+    __atomic_add_fetch(&bench_done, 1, __ATOMIC_RELEASE);
+    thread_exit();
+}
+
+// Sums up a per-core counter over all cores
+static uint64_t scheduler_counter(size_t offset)
+{
+    uint64_t count = 0;
+
+    for(int i = 0; i < core_count; i++)
+    {
+        count += *(uint64_t*)((uint8_t*)percpu_area(i) + offset);
+    }
+
+    return count;
+}
+
+// Runs one spinning thread per core next to pairs of threads that wake each other
+void scheduler_benchmark()
+{
+    uint64_t start, elapsed, spins, rounds, migrations, switches, loads;
+    int pairs, total;
+
+    pairs = (core_count + 1) / 2;
+    total = core_count + 2 * pairs;
+
+    bench_stop = 0;
+    bench_done = 0;
+
+    for(int i = 0; i < pairs; i++)
+    {
+        bench_closed[i] = 0;
+        bench_rounds[i] = 0;
+        bench_pong[i] = kthreads_create("bench-pong", bench_pong_entry, (void*)(size_t)i, TPR_MID);
+        bench_ping[i] = kthreads_create("bench-ping", bench_ping_entry, (void*)(size_t)i, TPR_MID);
+    }
+
+    migrations = scheduler_counter(offsetof(percpu_t, migrations));
+    switches = scheduler_counter(offsetof(percpu_t, switches));
+    loads = scheduler_counter(offsetof(percpu_t, fpu_loads));
+    start = system_timestamp();
+
+    for(int i = 0; i < core_count; i++)
+    {
+        bench_spins[i] = 0;
+        kthreads_run(kthreads_create("bench-spin", bench_spin, bench_spins + i, TPR_MID));
+    }
+
+    for(int i = 0; i < pairs; i++)
+    {
+        kthreads_run(bench_pong[i]);
+        kthreads_run(bench_ping[i]);
+    }
+
+    thread_sleep(TIME_NS);
+    bench_stop = 1;
+    elapsed = system_timestamp() - start;
+
+    while(__atomic_load_n(&bench_done, __ATOMIC_ACQUIRE) < total)
+    {
+        thread_sleep(NANOSECONDS(10, TIME_MS));
+    }
+
+    migrations = scheduler_counter(offsetof(percpu_t, migrations)) - migrations;
+    switches = scheduler_counter(offsetof(percpu_t, switches)) - switches;
+    loads = scheduler_counter(offsetof(percpu_t, fpu_loads)) - loads;
+    spins = 0;
+    rounds = 0;
+
+    for(int i = 0; i < core_count; i++)
+    {
+        spins += bench_spins[i];
+    }
+
+    for(int i = 0; i < pairs; i++)
+    {
+        rounds += bench_rounds[i];
+    }
+
+    kp_info("sched", "%d spinning threads: %lu iterations/s", core_count, (spins * TIME_NS) / elapsed);
+    kp_info("sched", "%d ping-pong threads: %lu round trips/s", 2 * pairs, (rounds * TIME_NS) / elapsed);
+    kp_info("sched", "migrations: %lu", migrations);
+    kp_info("sched", "switches: %lu, extended state loads: %lu", switches, loads);
+}
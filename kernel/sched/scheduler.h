@@ -1,28 +1,41 @@
 #pragma once
 
 #include <kernel/sched/types.h>
+#include <kernel/time/time.h>
 #include <kernel/x86/tss.h>
 #include <kernel/lists.h>
 
-typedef struct {
+#define SCHED_STEAL_BATCH 4 // most threads taken from a sibling at once
+#define SCHED_SLICE       NANOSECONDS(10, TIME_MS)
+#define SCHED_SLICE_MIN   NANOSECONDS(100, TIME_US)
+
+#define SCHED_QUEUE_SRT  (1U << 0)      // policy 0 queue
+#define SCHED_QUEUE_STD  (0x1FFU << 1)  // policy 1 ring
+#define SCHED_QUEUE_IDLE (1U << 10)     // policy 2 queue
+
+#define SCHED_QUEUE_STD_SLOT(i) (1U << (1 + (i)))
+
+typedef struct scheduler {
     uint64_t rsp;             // Address for the scheduling function stack (must be struct offset 0)
-    uint64_t xstate;          // Address for extended state context (must be struct offset 8)
 
+    int id;                   // Core ID
     uint32_t apic_id;         // Local APIC ID
     uint64_t frequency;       // Local APIC counter frequency
+    bool deadline;            // Timer interrupts are programmed as TSC deadlines
 
     uint64_t tsc0;            // Used for calculating elapsed time
     uint64_t tsc1;            // Used for calculating current load
     uint64_t tsc2;            // Used for calculating current load
     uint32_t load;            // Current CPU core load in permille
+    uint64_t event;           // Time the timer interrupt is programmed for
 
     list_t idle;              // Queue for policy 2
     list_t srt;               // Queue for policy 0
     list_t std[9];            // Queue for policy 1
+    uint32_t queued;          // Bitmap of non-empty queues
     int index;                // Index into policy 1 queue
     int count;                // Number of threads in policy 1 queue
 
-    thread_t *thread_current; // Currently executed thread
     thread_t *thread_idle;    // Idle thread for this core
     spinlock_t lock;          // Global lock for accessing this struct
     tss_t *tss;               // TSS descripter for this core
@@ -37,5 +50,9 @@ void scheduler_stop();
 void scheduler_yield();
 
 void scheduler_append(thread_t*);
+void scheduler_idle();
+void scheduler_event(uint64_t);
+void scheduler_resched(int);
+void scheduler_benchmark();
 void scheduler_init_core(int, int, int, tss_t*);
 void scheduler_init();
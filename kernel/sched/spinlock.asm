@@ -1,20 +1,40 @@
 [BITS 64]
+extern lock_stats
+extern lock_acquire_slow
+extern lock_try_slow
+extern lock_release_slow
+
+; A lock is free when the whole word is zero. The low byte is set while it is held,
+; and the high word names the last core queued for it (see locks.c).
 
 global acquire_lock:function (acquire_lock.end - acquire_lock)
 acquire_lock:
-    lock bts dword [rdi], 0  ; Attempt to acquire lock
-    jc .spin
+    cmp dword [lock_stats], 0
+    jne lock_acquire_slow    ; Statistics are recorded in C
+    xor eax, eax
+    mov ecx, 1
+    lock cmpxchg dword [rdi], ecx  ; Attempt to acquire lock
+    jnz lock_acquire_slow    ; Taken, spin or queue up
+    ret
+.end:
+
+global try_acquire_lock:function (try_acquire_lock.end - try_acquire_lock)
+try_acquire_lock:
+    cmp dword [lock_stats], 0
+    jne lock_try_slow        ; Statistics are recorded in C
+    xor eax, eax
+    mov ecx, 1
+    lock cmpxchg dword [rdi], ecx  ; Attempt to acquire lock
+    sete al                  ; Acquired if the lock was free
+    movzx eax, al
     ret
-.spin:
-    pause                    ; Tell CPU we're spinning
-    test dword [rdi], 1      ; Is the lock free?
-    jnz .spin                ; No, not yet
-    jmp acquire_lock         ; Yes, retry
 .end:
 
 global release_lock:function (release_lock.end - release_lock)
 release_lock:
-    mov dword [rdi], 0
+    cmp dword [lock_stats], 0
+    jne lock_release_slow    ; Statistics are recorded in C
+    mov byte [rdi], 0        ; Release lock, queued cores stay in the word
     ret
 .end:
 
@@ -28,7 +48,9 @@ acquire_safe_lock:
 
 global release_safe_lock:function (release_safe_lock.end - release_safe_lock)
 release_safe_lock:
-    mov dword [rdi], 0       ; Release lock
+    push rsi
+    call release_lock        ; Release lock
+    pop rsi
     push word [rsi]          ; Push 16-bit flags register
     popfw                    ; Restore flags register
     ret
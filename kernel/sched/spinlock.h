@@ -1,8 +1,21 @@
 #pragma once
 
+#include <kernel/sysinfo.h>
 #include <kernel/types.h>
 
+#define LOCK_LOCKED 0x000000FFU // Lock is held
+#define LOCK_TAIL   0xFFFF0000U // Last queued core + 1
+#define LOCK_STATS  1024        // Locks tracked in statistics mode
+
+#define RWLOCK_WRITER 0x80000000U // Writer holds or waits for the lock
+
 typedef volatile uint32_t spinlock_t;
+typedef volatile uint32_t rwlock_t;
+
+typedef struct qnode {
+    struct qnode *volatile next;  // Core queued behind this one
+    volatile uint32_t locked;     // Set when this core is first in the queue
+} __attribute__((aligned(64))) qnode_t;
 
 void disable_interrupts(uint32_t*);
 void restore_interrupts(uint32_t*);
@@ -11,4 +24,15 @@ void acquire_safe_lock(spinlock_t*, uint32_t*);
 void release_safe_lock(spinlock_t*, uint32_t*);
 
 void acquire_lock(spinlock_t*);
+int try_acquire_lock(spinlock_t*);
 void release_lock(spinlock_t*);
+
+void read_lock(rwlock_t*);
+void read_unlock(rwlock_t*);
+void write_lock(rwlock_t*);
+void write_unlock(rwlock_t*);
+void write_lock_safe(rwlock_t*, uint32_t*);
+void write_unlock_safe(rwlock_t*, uint32_t*);
+
+void lock_stats_enable();
+void sysinfo_lockstat(sysinfo_t *sys);
@@ -4,6 +4,7 @@
 #include <kernel/mem/heap.h>
 #include <kernel/x86/smp.h>
 #include <kernel/x86/fpu.h>
+#include <kernel/debug.h>
 #include <string.h>
 
 static LIST_INIT(dead, thread_t, slink);
@@ -57,8 +58,7 @@ thread_t *thread_create(const char *name, void *entry, void *arg0, void *arg1, v
     // initialize the rest
     strscpy(thread->name, name, sizeof(thread->name));
     thread->state = READY;
-    thread->gs.krsp = rsp0;
-    thread->gs.ursp = 0;
+    thread->core = -1;
 
     return thread;
 }
@@ -169,6 +169,13 @@ static void thread_wake(timer_t *tm)
 {
     thread_t *thread;
     thread = tm->data;
+
+    // short sleeps can expire on another core before the thread is off its own
+    while(thread->yield)
+    {
+        asm("pause");
+    }
+
     thread->state = READY;
     scheduler_append(thread);
 }
@@ -177,9 +184,11 @@ void thread_sleep(size_t ns)
 {
     size_t now, end;
     thread_t *thread;
+    uint32_t flags;
     timer_t *tm;
 
-    if(ns < NANOSECONDS(1, TIME_MS))
+    // shorter sleeps than a round trip through the scheduler spin
+    if(ns < THREAD_SLEEP_SPIN)
     {
         now = system_timestamp();
         end = now + ns;
@@ -197,15 +206,64 @@ void thread_sleep(size_t ns)
     tm->period = ns;
     tm->data = thread;
 
-    timer_start(tm);
+    disable_interrupts(&flags);
 
+    thread->yield = 1;
     thread->state = SLEEPING;
+    timer_start(tm);
     scheduler_yield();
+
+    restore_interrupts(&flags);
+}
+
+// Sleeps for 10us to 10ms and sorts the oversleep of every wakeup into buckets
+void thread_sleep_benchmark()
+{
+    static const uint64_t durations[] = {10, 20, 50, 100, 200, 500, 1000, 2000, 5000, 10000};
+    static const uint64_t bounds[] = {5, 10, 20, 50, 100, 200, 500, 1000};
+    uint32_t hist[9];
+    uint64_t ns, start, late, total, max;
+    int count, b;
+
+    kp_info("sleep", "oversleep buckets: <5us <10us <20us <50us <100us <200us <500us <1ms >=1ms");
+
+    for(int d = 0; d < 10; d++)
+    {
+        ns = NANOSECONDS(durations[d], TIME_US);
+        count = NANOSECONDS(200, TIME_MS) / ns;
+        count = (count < 20) ? 20 : (count > 1000) ? 1000 : count;
+
+        memset(hist, 0, sizeof(hist));
+        total = 0;
+        max = 0;
+
+        for(int n = 0; n < count; n++)
+        {
+            start = system_timestamp();
+            thread_sleep(ns);
+            late = system_timestamp() - start - ns;
+
+            total += late;
+            max = (late > max) ? late : max;
+
+            b = 0;
+            while(b < 8 && late >= NANOSECONDS(bounds[b], TIME_US))
+            {
+                b++;
+            }
+            hist[b]++;
+        }
+
+        kp_info("sleep", "%lu us x %d: avg +%lu us, max +%lu us | %u %u %u %u %u %u %u %u %u",
+            durations[d], count, total / count / 1000, max / 1000,
+            hist[0], hist[1], hist[2], hist[3], hist[4], hist[5], hist[6], hist[7], hist[8]);
+    }
 }
 
 void thread_idle_cleaning()
 {
     static lock_t lock = 0;
+    process_t *parent;
     thread_t *item;
 
     if(atomic_lock(&lock))
@@ -223,9 +281,12 @@ void thread_idle_cleaning()
         list_pop(&dead);
         process_remove_thread(item);
 
-        // TODO:
-        // When (item->signals & SIGTERM) and (this is the second-to-last thread), then
-        // signal last thread if waiting in process_exit()
+        // the last thread waits in process_exit for the others to end
+        parent = item->parent;
+        if((item->signals & SIGTERM) && parent->threads.length == 1)
+        {
+            thread_signal(parent->threads.head);
+        }
 
         kfree(item);
     }
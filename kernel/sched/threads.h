@@ -1,8 +1,10 @@
 #pragma once
 
 #include <kernel/sched/types.h>
+#include <kernel/time/time.h>
 
 #define STACK_SIZE 4096
+#define THREAD_SLEEP_SPIN NANOSECONDS(5, TIME_US) // shorter sleeps do not block
 
 void thread_wait(); // block?
 void thread_signal(thread_t *thread); // unblock?
@@ -15,3 +17,4 @@ thread_t *thread_create(const char*, void*, void*, void*, void*);
 thread_t *thread_handle();
 
 void thread_idle_cleaning();
+void thread_sleep_benchmark();
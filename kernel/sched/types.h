@@ -38,6 +38,13 @@ typedef struct {
     list_t list;       // List of threads
 } wq_t;
 
+typedef struct {
+    spinlock_t lock;
+    wq_t queue;
+    volatile bool free;
+    thread_t *volatile owner; // Thread holding the mutex
+} mutex_t;
+
 typedef struct {
     size_t r15;    // x86-64 ABI: preserve
     size_t r14;    // x86-64 ABI: preserve
@@ -61,13 +68,35 @@ typedef struct {
     size_t ss;     // stack segment
 } stack_t;
 
+typedef struct {
+    size_t rbx;    // x86-64 ABI: preserve
+    size_t rbp;    // x86-64 ABI: preserve
+    size_t r12;    // x86-64 ABI: preserve
+    size_t r13;    // x86-64 ABI: preserve
+    size_t r14;    // x86-64 ABI: preserve
+    size_t r15;    // x86-64 ABI: preserve
+    size_t ret;    // return address into the syscall entry
+    size_t r11;    // user rflags
+    size_t r10;    // 4th argument
+    size_t r9;     // 6th argument
+    size_t r8;     // 5th argument
+    size_t rcx;    // user rip
+    size_t rdx;    // 3rd argument
+    size_t rsi;    // 2nd argument
+    size_t rdi;    // 1st argument
+    size_t rsp;    // user rsp
+} syscall_frame_t;
+
 struct thread {
     char name[32];              // Thread name
     pid_t tid;                  // Thread ID
     state_t state;              // Current state
     priority_t priority;        // Scheduler priority
     uint8_t max_count;          // Maximal count for variable frequency scheduling
+    int core;                   // Core the thread last ran on
+    int fpu_core;               // Core holding the extended state in its registers
     size_t time_used;           // CPU time consumed
+    size_t slice;               // Remaining time slice in ns
     size_t xstate;              // Address for extended state context (mainly FPU registers)
     size_t rsp0;                // Top address for kernel space stack
     union {
@@ -88,10 +117,6 @@ struct thread {
         int wait;               // Waiting for signal
         spinlock_t lock;        // Synchronization lock
     } sig;
-    struct {                    // Used in swapgs
-        size_t krsp;            // Kernel RSP
-        size_t ursp;            // User RSP
-    } gs;
 };
 
 struct process {
@@ -110,15 +135,22 @@ struct process {
     link_t clink;         // Link in child processes
     link_t plink;         // Link in global processes
     list_t mmap;          // List of memory maps
+    mutex_t *mm_lock;     // Serializes faults and changes to the address space
     spinlock_t lock;      // Lock for this struct
     wq_t wait;            // List for threads in wait() calls
     struct {
         size_t next;      // Next file descriptor ID
         list_t list;      // List of open file descriptors
+        rwlock_t lock;    // Lock for changes to the list
     } fd;
     struct {
         size_t start;     // Data segment start
         size_t end;       // Data segment end
         size_t max;       // Data segment max
     } brk;
+    size_t minflt;        // Number of minor page faults
+    struct {
+        size_t small;     // Faults backed by a 4 KB page
+        size_t large;     // Faults backed by a 2 MB page
+    } pages;
 };
@@ -90,10 +90,10 @@ int wq_wake(wq_t *wq)
     return count;
 }
 
-int wq_wake_one(wq_t *wq)
+// Returns the woken thread, only to be looked at while the caller still holds the queue lock
+thread_t *wq_wake_one(wq_t *wq)
 {
     thread_t *item;
-    int count = 0;
 
     wq_lock(wq);
 
@@ -103,11 +103,10 @@ int wq_wake_one(wq_t *wq)
         item->state = READY;
         item->wq = 0;
         scheduler_append(item);
-        count++;
     }
 
     wq_unlock(wq);
-    return count;
+    return item;
 }
 
 int wq_size(wq_t *wq)
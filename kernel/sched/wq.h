@@ -8,7 +8,7 @@ void wq_unlock(wq_t *wq);
 
 int wq_wait(wq_t *wq);
 int wq_wake(wq_t *wq);
-int wq_wake_one(wq_t *wq);
+thread_t *wq_wake_one(wq_t *wq);
 
 int wq_size(wq_t *wq);
 
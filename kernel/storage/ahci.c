@@ -648,10 +648,6 @@ static int ahci_rebase(ahci_dev_t *dev)
     {
         return -ENOMEM;
     }
-    else
-    {
-        memset((void*)virt, 0, 12288);
-    }
 
     // Set command list base (1 KB)
     port->clb = phys;
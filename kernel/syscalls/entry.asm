@@ -1,6 +1,8 @@
 [BITS 64]
 global syscall_address
+global syscall_fork
 extern syscall_table
+extern process_fork
 extern syscall_count
 extern syscall_post_hook
 
@@ -10,11 +12,10 @@ syscall_entry:
     cmp rax, qword [syscall_count]
     jge .ret
 
-    swapgs
-    mov [gs:8], rsp       ; store user rsp
-    mov rsp, [gs:0]       ; load kernel rsp
-    push qword [gs:8]
-    swapgs
+    swapgs                ; load the kernel GS base (percpu_t)
+    mov [gs:16], rsp      ; store user rsp
+    mov rsp, [gs:8]       ; load kernel rsp
+    push qword [gs:16]
     sti
 
     push rdi              ; rbp, rbx, r12-r15 are callee save registers
@@ -43,10 +44,24 @@ syscall_entry:
     pop rdi
 
     cli
+    swapgs                ; back to the user GS base
     pop rsp               ; load user rsp
 .ret:
     o64 sysret
 
+; The child of fork needs the callee saved registers as well
+syscall_fork:
+    push r15
+    push r14
+    push r13
+    push r12
+    push rbp
+    push rbx
+    mov rdi, rsp          ; syscall_frame_t
+    call process_fork
+    add rsp, 48
+    ret
+
 [SECTION .rodata]
 syscall_address:
     dq syscall_entry
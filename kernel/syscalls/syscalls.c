@@ -1,10 +1,14 @@
 #include <kernel/syscalls/syscalls.h>
 #include <kernel/sched/process.h>
 #include <kernel/sched/threads.h>
+#include <kernel/sched/mutex.h>
 #include <kernel/sched/execve.h>
+#include <kernel/sched/futex.h>
 #include <kernel/time/time.h>
 #include <kernel/x86/ioports.h>
+#include <kernel/mem/mman.h>
 #include <kernel/mem/vmm.h>
+#include <kernel/mem/map.h>
 #include <kernel/vfs/vfs.h>
 #include <kernel/sysinfo.h>
 #include <kernel/types.h>
@@ -97,75 +101,46 @@ static long sys_readdir(int fd, size_t size, dirent_t *dirent)
 
 // returns new break point on success
 // returns an error code on failure
+// pages are allocated by the page fault handler on first touch
 static long sys_brk(size_t brk)
 {
     size_t start, end, max;
     process_t *pr;
-    int status;
 
     pr = process_handle();
-    start = pr->brk.start;
-    end = pr->brk.end;
-    max = pr->brk.max;
-    status = 0;
-
-    if(brk == 0)
-    {
-        return end;
-    }
 
     if(brk & ALIGN_TEST)
     {
         brk = (brk & ALIGN_MASK) + PAGE_SIZE;
     }
 
-    if(brk == end)
-    {
-        return end;
-    }
+    acquire_mutex(pr->mm_lock, false);
 
-    if(brk < start)
-    {
-        return -EFAULT;
-    }
+    start = pr->brk.start;
+    end = pr->brk.end;
+    max = pr->brk.max;
 
-    if(brk > max)
+    if(brk == 0 || brk == end)
     {
-        return -EFAULT;
+        release_mutex(pr->mm_lock);
+        return end;
     }
 
-    if(brk > end)
-    {
-        while(end < brk)
-        {
-            if(vmm_alloc_page(end) < 0)
-            {
-                status = -ENOMEM;
-                break;
-            }
-            end += PAGE_SIZE;
-        }
-    }
-    else
+    if(brk < start || brk > max)
     {
-        while(end > brk)
-        {
-            end -= PAGE_SIZE;
-            if(vmm_free_page(end) < 0)
-            {
-                status = -ENOMEM;
-                break;
-            }
-        }
+        release_mutex(pr->mm_lock);
+        return -EFAULT;
     }
 
-    pr->brk.end = end;
-    if(status < 0)
+    // release pages that were touched when shrinking, untouched ones are not present
+    if(brk < end)
     {
-        return status;
+        vmm_unmap_range(brk, end - brk);
     }
 
-    return end;
+    pr->brk.end = brk;
+    release_mutex(pr->mm_lock);
+    return brk;
 }
 
 static pid_t sys_spawnve(const char *filename, char *argv[], char *envp[], int stdin, int stdout)
@@ -312,39 +287,221 @@ static long sys_signal(pid_t pid, int signal)
     return process_kill(pid);
 }
 
+static int prot_to_flags(int prot)
+{
+    int flags = MAP_LAZY;
+
+    if((prot & PROT_WRITE) == 0)
+    {
+        flags |= MAP_READONLY;
+    }
+
+    if(prot & PROT_EXEC)
+    {
+        flags |= MAP_EXEC;
+    }
+
+    return flags;
+}
+
+// returns the address of the mapping on success
+// only private mappings are supported, pages are populated on first access
+static long sys_mmap(size_t length, int prot, int flags, int fd, size_t offset)
+{
+    process_t *pr;
+    dentry_t *dp;
+    size_t virt;
+    int status;
+
+    if(length == 0)
+    {
+        return -EINVAL;
+    }
+
+    if((prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) == 0)
+    {
+        return -EINVAL;
+    }
+
+    if((flags & MAP_PRIVATE) == 0 || (flags & MAP_SHARED))
+    {
+        return -ENOTSUP;
+    }
+
+    pr = process_handle();
+
+    if(flags & MAP_ANONYMOUS)
+    {
+        acquire_mutex(pr->mm_lock, false);
+        status = mm_map(&pr->mmap, length, prot_to_flags(prot), &virt);
+        release_mutex(pr->mm_lock);
+
+        if(status < 0)
+        {
+            return status;
+        }
+        return virt;
+    }
+
+    if(offset & ALIGN_TEST)
+    {
+        return -EINVAL;
+    }
+
+    status = vfs_pin(fd, &dp);
+    if(status < 0)
+    {
+        return status;
+    }
+
+    acquire_mutex(pr->mm_lock, false);
+    status = mm_map_file(&pr->mmap, dp, offset, length, prot_to_flags(prot), &virt);
+    release_mutex(pr->mm_lock);
+
+    if(status < 0)
+    {
+        vfs_unpin(dp);
+        return status;
+    }
+
+    return virt;
+}
+
+static long sys_munmap(size_t addr, size_t length)
+{
+    process_t *pr;
+    int status;
+
+    pr = process_handle();
+
+    acquire_mutex(pr->mm_lock, false);
+    status = mm_unmap(&pr->mmap, addr, length);
+    release_mutex(pr->mm_lock);
+
+    return status;
+}
+
+static long sys_mprotect(size_t addr, size_t length, int prot)
+{
+    process_t *pr;
+    int status;
+
+    if((prot & (PROT_READ | PROT_WRITE | PROT_EXEC)) == 0)
+    {
+        return -EINVAL;
+    }
+
+    pr = process_handle();
+
+    acquire_mutex(pr->mm_lock, false);
+    status = mm_protect(&pr->mmap, addr, length, prot_to_flags(prot));
+    release_mutex(pr->mm_lock);
+
+    return status;
+}
+
+// returns -EAGAIN when the word no longer holds the expected value
+// a timeout of zero waits until the thread is woken
+static long sys_futex_wait(uint32_t *addr, uint32_t expected, size_t timeout)
+{
+    assert_nonzero(addr);
+    assert_userspace(addr);
+
+    if((size_t)addr & 3)
+    {
+        return -EINVAL;
+    }
+
+    return futex_wait(addr, expected, timeout);
+}
+
+// returns the number of woken threads
+static long sys_futex_wake(uint32_t *addr, int count)
+{
+    assert_nonzero(addr);
+    assert_userspace(addr);
+
+    if((size_t)addr & 3)
+    {
+        return -EINVAL;
+    }
+
+    return futex_wake(addr, count);
+}
+
+// returns the thread ID of the new thread
+static long sys_thread(size_t entry, size_t stack, size_t arg)
+{
+    assert_nonzero(entry);
+    assert_userspace(entry);
+    assert_nonzero(stack);
+    assert_userspace(stack);
+    return process_create_thread(entry, stack, arg);
+}
+
+// sets the word to one and wakes its waiters before the thread ends
+// returns an error code without exiting when the word is invalid
+static long sys_thread_exit(uint32_t *done)
+{
+    assert_nonzero(done);
+    assert_userspace(done);
+
+    if((size_t)done & 3)
+    {
+        return -EINVAL;
+    }
+
+    __atomic_store_n(done, 1, __ATOMIC_SEQ_CST);
+    futex_wake(done, FUTEX_ALL);
+
+    process_exit_thread();
+    return 0;
+}
+
+// implemented in entry.asm
+extern long syscall_fork();
+
 /**************************************************************************************/
 
 const void *syscall_table[] = {
-    sys_exit,    //  0 = exit
-    sys_open,    //  1 = open
-    sys_close,   //  2 = close
-    sys_read,    //  3 = read
-    sys_write,   //  4 = write
-    sys_seek,    //  5 = seek
-    sys_ioctl,   //  6 = ioctl
-    sys_fstat,   //  7 = fstat
-    sys_stat,    //  8 = stat
-    sys_readdir, //  9 = readdir
-    sys_brk,     // 10 = brk
-    sys_spawnve, // 11 = spawnve
-    sys_wait,    // 12 = wait
-    sys_chdir,   // 13 = chdir
-    sys_default, // 14 = fchdir
-    sys_getcwd,  // 15 = getcwd
-    sys_getpid,  // 16 = getpid
-    sys_mount,   // 17 = mount
-    sys_umount,  // 18 = umount
-    sys_mkdir,   // 19 = mkdir
-    sys_rmdir,   // 20 = rmdir
-    sys_create,  // 21 = create
-    sys_remove,  // 22 = remove
-    sys_rename,  // 23 = rename
-    sys_gettime, // 24 = gettime
-    sys_default, // 25 = settime
-    sys_sleep,   // 26 = sleep
-    sys_sysinfo, // 27 = sysinfo
-    sys_mkpipe,  // 28 = mkpipe
-    sys_signal,  // 29 = signal
+    sys_exit,        //  0 = exit
+    sys_open,        //  1 = open
+    sys_close,       //  2 = close
+    sys_read,        //  3 = read
+    sys_write,       //  4 = write
+    sys_seek,        //  5 = seek
+    sys_ioctl,       //  6 = ioctl
+    sys_fstat,       //  7 = fstat
+    sys_stat,        //  8 = stat
+    sys_readdir,     //  9 = readdir
+    sys_brk,         // 10 = brk
+    sys_spawnve,     // 11 = spawnve
+    sys_wait,        // 12 = wait
+    sys_chdir,       // 13 = chdir
+    sys_default,     // 14 = fchdir
+    sys_getcwd,      // 15 = getcwd
+    sys_getpid,      // 16 = getpid
+    sys_mount,       // 17 = mount
+    sys_umount,      // 18 = umount
+    sys_mkdir,       // 19 = mkdir
+    sys_rmdir,       // 20 = rmdir
+    sys_create,      // 21 = create
+    sys_remove,      // 22 = remove
+    sys_rename,      // 23 = rename
+    sys_gettime,     // 24 = gettime
+    sys_default,     // 25 = settime
+    sys_sleep,       // 26 = sleep
+    sys_sysinfo,     // 27 = sysinfo
+    sys_mkpipe,      // 28 = mkpipe
+    sys_signal,      // 29 = signal
+    sys_mmap,        // 30 = mmap
+    sys_munmap,      // 31 = munmap
+    sys_mprotect,    // 32 = mprotect
+    syscall_fork,    // 33 = fork
+    sys_futex_wait,  // 34 = futex_wait
+    sys_futex_wake,  // 35 = futex_wake
+    sys_thread,      // 36 = thread
+    sys_thread_exit, // 37 = thread_exit
 };
 
 const size_t syscall_count = (sizeof(syscall_table)/sizeof(syscall_table[0]));
@@ -363,7 +520,6 @@ void syscall_init()
     write_msr(MSR_STAR, 0x0013000800000000);
     write_msr(MSR_LSTAR, syscall_address);
     write_msr(MSR_SFMASK, 0);
-    write_msr(MSR_GS_BASE, 0);
     write_msr(MSR_FS_BASE, 0);
 }
 
@@ -1,7 +1,6 @@
 #include <kernel/sched/process.h>
 #include <kernel/term/console.h>
 #include <kernel/term/fbmem.h>
-#include <kernel/x86/lapic.h>
 #include <kernel/mem/heap.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/mem/pmm.h>
@@ -25,7 +24,7 @@ int fbmem_close()
         return 0;
     }
 
-    mm_unmap(&pr->mmap, virt);
+    mm_unmap(&pr->mmap, virt, vts->console->memsz);
     virt = 0;
     pr = 0;
 
@@ -92,8 +91,11 @@ int fbmem_toggle(bool active)
     }
 
     // flush tlb
-    vmm_load_pml4(pml4);
-    lapic_bcast_ipi(254, false, true);
+    vmm_flush_range(virt, vts->console->memsz);
+    if(pml4 != pr->pml4)
+    {
+        vmm_load_pml4(pml4);
+    }
 
     restore_interrupts(&flags);
     return 0;
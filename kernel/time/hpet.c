@@ -15,6 +15,7 @@ static uint8_t counter_size;
 static uint8_t timer_count;
 static uint8_t revision;
 static hpet_timer_t *timer;
+static hpet_timer_t *system_timer;
 
 static uint64_t hpet_read(uint16_t reg)
 {
@@ -137,6 +138,7 @@ static int hpet_system_timer()
     irq_request(vector, timer_handler, 0);
 
     // Write configuration
+    system_timer = tm;
     hpet_write(HPET_TM0_CCR + offset, value);
     freq = (tick_freq / TIMER_FREQUENCY);
     value = hpet_read(HPET_CNT);
@@ -147,6 +149,26 @@ static int hpet_system_timer()
     return 0;
 }
 
+// The comparator keeps running while its interrupt is disabled, so the period is kept
+void hpet_tick_enable(bool enable)
+{
+    uint64_t value;
+    hpet_ccr_t *ccr;
+    uint16_t offset;
+
+    if(system_timer == 0)
+    {
+        return;
+    }
+
+    offset = (0x20 * system_timer->id);
+    value = hpet_read(HPET_TM0_CCR + offset);
+    ccr = (hpet_ccr_t*)&value;
+    ccr->int_enb_cnf = (enable ? 1 : 0);
+    ccr->val_set_cnf = 0;
+    hpet_write(HPET_TM0_CCR + offset, value);
+}
+
 uint64_t hpet_timestamp()
 {
     uint64_t ts, rm;
@@ -48,5 +48,6 @@ typedef struct {
     uint8_t periodic;
 } hpet_timer_t;
 
+void hpet_tick_enable(bool enable);
 uint64_t hpet_timestamp();
 int hpet_init();
@@ -8,6 +8,8 @@
 #include <time.h>
 
 static volatile uint64_t ticks = 0;
+static volatile int tick_stopped = 0;
+static spinlock_t tick_lock;
 static uint8_t tm_source; // Timer source
 static uint8_t ts_source; // Timestamp source
 static time_t btu; // Unix timestamp at boot
@@ -50,6 +52,64 @@ int gettime(timeval_t *tv)
     return 0;
 }
 
+// Stops the periodic tick while no core needs it, timers are then armed per core
+// The PIT keeps ticking, it may be the only clock and cannot pause its interrupt.
+// The idle condition is checked again under the lock, so that a core restarting
+// the tick in the meantime is never overtaken.
+bool time_tick_stop(bool (*idle)())
+{
+    uint32_t flags;
+
+    if(tm_source != HPET)
+    {
+        return false;
+    }
+
+    // auto-repeat runs off the tick
+    if(input_kbd_repeating())
+    {
+        return false;
+    }
+
+    acquire_safe_lock(&tick_lock, &flags);
+
+    if(!idle())
+    {
+        release_safe_lock(&tick_lock, &flags);
+        return false;
+    }
+
+    if(!tick_stopped)
+    {
+        hpet_tick_enable(false);
+        tick_stopped = 1;
+    }
+
+    release_safe_lock(&tick_lock, &flags);
+    return true;
+}
+
+void time_tick_start()
+{
+    uint32_t flags;
+
+    // always serialize with time_tick_stop, it may be about to stop the tick
+    acquire_safe_lock(&tick_lock, &flags);
+
+    if(tick_stopped)
+    {
+        hpet_tick_enable(true);
+        tick_stopped = 0;
+    }
+
+    release_safe_lock(&tick_lock, &flags);
+}
+
+bool time_tick_stopped()
+{
+    return tick_stopped;
+}
+
 void timer_wait()
 {
     uint64_t current = ticks;
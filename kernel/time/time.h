@@ -34,5 +34,8 @@ void timer_wait();
 void timer_sleep(uint64_t ms);
 void timer_handler(int, void*);
 uint64_t system_timestamp();
+bool time_tick_stop(bool (*idle)());
+void time_tick_start();
+bool time_tick_stopped();
 int gettime(timeval_t *tv);
 void time_init();
@@ -1,65 +1,286 @@
+#include <kernel/sched/scheduler.h>
+#include <kernel/sched/kthreads.h>
 #include <kernel/time/timer.h>
 #include <kernel/time/time.h>
+#include <kernel/mem/heap.h>
+#include <kernel/x86/smp.h>
 #include <kernel/errno.h>
+#include <kernel/debug.h>
 
-LIST_INIT(timers, timer_t, link);
+// Every core keeps the timers it started in a hierarchical wheel. Level 0 has one slot
+// per wheel tick, every further level covers 64 slots of the level below. Timers are
+// put into the level that fits their distance, and move down a level whenever the
+// clock reaches their slot, so starting and cancelling a timer is O(1). Each core
+// programs its own timer interrupt for its first timer, and expires them there.
 
-static uint64_t next_deadline = ~0UL;
-static spinlock_t lock;
+#define TIMER_SLACK NANOSECONDS(5, TIME_US) // callbacks made this early are on time
+#define TIMER_BENCH 100000
 
-void timer_tick()
+static timer_base_t *bases[SMP_MAX_CORES];
+
+static volatile uint32_t bench_fired;
+static volatile uint64_t bench_late;
+
+static timer_base_t *get_base()
 {
-    timer_t *item, *next;
-    uint32_t flags;
-    uint64_t ts;
-    int64_t dt;
+    int id;
+
+    id = smp_core_id();
+    if(id < 0 || id >= SMP_MAX_CORES)
+    {
+        return 0;
+    }
+
+    return bases[id];
+}
 
-    // We assume that the timer ticks at 1000 Hz, which means that we can make the callback
-    // with an accurary of 500us, assuming the time source is more accurate than the timer source.
-    // When we are more than 500us away from the deadline, we postpone the callback to the next tick.
+// Distance from the given slot to the next pending slot after it, between 1 and 64
+static int timer_distance(uint64_t pending, int index)
+{
+    int shift = (index + 1) & 63;
 
-    if(!next_deadline)
+    if(shift)
     {
-        return;
+        pending = (pending >> shift) | (pending << (64 - shift));
     }
 
-    ts = system_timestamp();
-    dt = ts - next_deadline + NANOSECONDS(500, TIME_US);
-    if(dt < 0)
+    return __builtin_ctzl(pending) + 1;
+}
+
+static void timer_update(timer_base_t *base, int level, int index)
+{
+    if(base->wheel[level][index].length)
     {
-        return;
+        base->pending[level] |= (1UL << index);
+    }
+    else
+    {
+        base->pending[level] &= ~(1UL << index);
     }
+}
+
+static void timer_insert(timer_base_t *base, timer_t *tm)
+{
+    uint64_t expires, delta;
+    int level, index;
 
-    acquire_safe_lock(&lock, &flags);
+    expires = tm->deadline >> TIMER_SHIFT;
+    if(expires < base->clock)
+    {
+        expires = base->clock;
+    }
 
-    while(item = list_head(&timers), item)
+    delta = expires - base->clock;
+    for(level = 0; level < TIMER_LEVELS - 1; level++)
     {
-        dt = ts - item->deadline + NANOSECONDS(500, TIME_US);
-        if(dt < 0)
+        if(delta < (1UL << (TIMER_BITS * (level + 1))))
         {
             break;
         }
+    }
 
-        next = item->link.next;
-        list_pop(&timers);
-        item->callback(item);
+    // timers beyond the last level cascade again until they are due
+    if(delta >= (1UL << (TIMER_BITS * TIMER_LEVELS)))
+    {
+        expires = base->clock + (1UL << (TIMER_BITS * TIMER_LEVELS)) - 1;
+    }
+
+    index = (expires >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+    tm->slot = base->wheel[level] + index;
+    list_append(tm->slot, tm);
+    base->pending[level] |= (1UL << index);
+    base->count++;
+}
+
+static void timer_remove(timer_base_t *base, timer_t *tm)
+{
+    int offset;
+
+    offset = tm->slot - base->wheel[0];
+    list_remove(tm->slot, tm);
+    timer_update(base, offset / TIMER_SLOTS, offset % TIMER_SLOTS);
+    base->count--;
+    tm->slot = 0;
+}
+
+// Moves the timers of the current slot of a level into the levels below
+static void timer_cascade(timer_base_t *base, int level)
+{
+    timer_t *tm;
+    int index;
+
+    index = (base->clock >> (TIMER_BITS * level)) & (TIMER_SLOTS - 1);
+    if(index == 0 && level < TIMER_LEVELS - 1)
+    {
+        timer_cascade(base, level + 1);
+    }
 
-        if(next)
+    while(tm = list_head(base->wheel[level] + index), tm)
+    {
+        timer_remove(base, tm);
+        timer_insert(base, tm);
+    }
+}
+
+// First tick after the current one with a slot or a cascade to process from the given level up
+static uint64_t timer_next_tick(timer_base_t *base, int level)
+{
+    uint64_t next = ~0UL;
+    uint64_t tick;
+    int index, shift;
+
+    for(; level < TIMER_LEVELS; level++)
+    {
+        if(base->pending[level] == 0)
+        {
+            continue;
+        }
+
+        shift = TIMER_BITS * level;
+        index = (base->clock >> shift) & (TIMER_SLOTS - 1);
+        tick = ((base->clock >> shift) + timer_distance(base->pending[level], index)) << shift;
+
+        if(tick < next)
+        {
+            next = tick;
+        }
+    }
+
+    return next;
+}
+
+// Collects all timers due before the limit, the clock stops at the first tick still pending
+static void timer_advance(timer_base_t *base, uint64_t limit, list_t *expired)
+{
+    timer_t *tm, *next;
+    uint64_t target;
+    list_t *slot;
+    int index;
+
+    target = limit >> TIMER_SHIFT;
+
+    while(base->count && base->clock <= target)
+    {
+        index = base->clock & (TIMER_SLOTS - 1);
+        if(index == 0)
+        {
+            timer_cascade(base, 1);
+        }
+
+        slot = base->wheel[0] + index;
+        tm = list_head(slot);
+
+        while(tm)
         {
-            next_deadline = next->deadline;
+            next = tm->link.next;
+            if(tm->deadline <= limit)
+            {
+                timer_remove(base, tm);
+                list_append(expired, tm);
+            }
+            else if(base->clock < target)
+            {
+                timer_remove(base, tm);
+                timer_insert(base, tm);
+            }
+            tm = next;
         }
-        else
+
+        // the rest of this tick is due later
+        if(slot->length)
+        {
+            return;
+        }
+
+        base->clock = timer_next_tick(base, 0);
+        if(base->clock > target + 1)
         {
-            next_deadline = 0;
+            base->clock = target + 1;
         }
     }
 
-    release_safe_lock(&lock, &flags);
+    if(base->count == 0 && base->clock <= target)
+    {
+        base->clock = target + 1;
+    }
+}
+
+void timer_tick()
+{
+    timer_base_t *base;
+    list_t expired;
+    uint32_t flags;
+    timer_t *tm;
+
+    base = get_base();
+    if(base == 0 || base->count == 0)
+    {
+        return;
+    }
+
+    list_init(&expired, offsetof(timer_t, link));
+
+    acquire_safe_lock(&base->lock, &flags);
+    timer_advance(base, system_timestamp() + TIMER_SLACK, &expired);
+    release_lock(&base->lock);
+
+    // callbacks may start timers again
+    while(tm = list_pop(&expired), tm)
+    {
+        tm->callback(tm);
+    }
+
+    restore_interrupts(&flags);
+}
+
+// Returns the time at which this core has to process its timers, or 0 without any
+uint64_t timer_next_event()
+{
+    timer_base_t *base;
+    uint64_t event, tick;
+    timer_t *tm = 0;
+    list_t *slot;
+    int index;
+
+    base = get_base();
+    if(base == 0 || base->count == 0)
+    {
+        return 0;
+    }
+
+    acquire_lock(&base->lock);
+
+    // the earliest timer in the first pending slot of level 0
+    event = ~0UL;
+    if(base->pending[0])
+    {
+        index = base->clock & (TIMER_SLOTS - 1);
+        if((base->pending[0] & (1UL << index)) == 0)
+        {
+            index = (index + timer_distance(base->pending[0], index)) & (TIMER_SLOTS - 1);
+        }
+
+        slot = base->wheel[0] + index;
+        while(tm = list_iterate(slot, tm), tm)
+        {
+            event = (tm->deadline < event) ? tm->deadline : event;
+        }
+    }
+
+    // the higher levels only have to be cascaded in time
+    tick = timer_next_tick(base, 1);
+    if(tick != ~0UL && (tick << TIMER_SHIFT) < event)
+    {
+        event = tick << TIMER_SHIFT;
+    }
+
+    release_lock(&base->lock);
+    return event;
 }
 
 int timer_start(timer_t *tm)
 {
-    timer_t *item = 0;
+    timer_base_t *base;
     uint32_t flags;
     uint64_t ts;
 
@@ -68,58 +289,145 @@ int timer_start(timer_t *tm)
         return -EINVAL;
     }
 
-    acquire_safe_lock(&lock, &flags);
+    disable_interrupts(&flags);
+
+    base = get_base();
+    if(base == 0)
+    {
+        restore_interrupts(&flags);
+        return -ENODEV;
+    }
+
+    acquire_lock(&base->lock);
 
     ts = system_timestamp();
     tm->deadline = ts + tm->period;
+    tm->core = base->id;
 
-    if(tm->deadline < next_deadline)
+    // an empty wheel does not have to catch up with the time
+    if(base->count == 0)
     {
-        next_deadline = tm->deadline;
+        base->clock = ts >> TIMER_SHIFT;
     }
-    else if(!next_deadline)
+
+    timer_insert(base, tm);
+    release_lock(&base->lock);
+
+    // bring the timer interrupt forward when this is the first timer
+    scheduler_event(tm->deadline);
+
+    restore_interrupts(&flags);
+    return 0;
+}
+
+void timer_cancel(timer_t *tm)
+{
+    timer_base_t *base;
+    uint32_t flags;
+
+    base = bases[tm->core];
+    if(base == 0)
     {
-        next_deadline = tm->deadline;
+        return;
     }
 
-    while(item = list_iterate(&timers, item), item)
+    acquire_safe_lock(&base->lock, &flags);
+
+    if(tm->slot)
     {
-        if(item->deadline > tm->deadline)
-        {
-            break;
-        }
+        timer_remove(base, tm);
     }
 
-    if(!item)
+    release_safe_lock(&base->lock, &flags);
+}
+
+void timer_init_core(int id)
+{
+    timer_base_t *base;
+
+    base = kzalloc(sizeof(timer_base_t));
+    if(base == 0)
     {
-        list_append(&timers, tm);
+        kp_crit("timer", "failed to allocate the timer wheel of core %d", id);
     }
-    else
+
+    base->id = id;
+    base->clock = system_timestamp() >> TIMER_SHIFT;
+
+    for(int level = 0; level < TIMER_LEVELS; level++)
     {
-        list_insert_before(&timers, item, tm);
+        for(int i = 0; i < TIMER_SLOTS; i++)
+        {
+            list_init(base->wheel[level] + i, offsetof(timer_t, link));
+        }
     }
 
-    release_safe_lock(&lock, &flags);
-    return 0;
+    bases[id] = base;
 }
 
-void timer_cancel(timer_t *tm)
+static void bench_expired(timer_t *tm)
 {
-    uint32_t flags;
+    __atomic_add_fetch(&bench_late, system_timestamp() - tm->deadline, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bench_fired, 1, __ATOMIC_RELAXED);
+}
 
-    acquire_safe_lock(&lock, &flags);
+// Starts and cancels timers spread over all levels, then lets a batch of short ones expire
+void timer_benchmark()
+{
+    uint64_t start, armed, cancelled, seed;
+    timer_t *timers;
+    int count;
+
+    count = 1000;
+    timers = kzalloc(count * sizeof(timer_t));
+    if(timers == 0)
+    {
+        return;
+    }
 
-    list_remove(&timers, tm);
-    tm = list_head(&timers);
+    armed = 0;
+    cancelled = 0;
+    seed = 1;
 
-    if(tm)
+    for(int round = 0; round < TIMER_BENCH / count; round++)
     {
-        next_deadline = tm->deadline;
+        start = system_timestamp();
+        for(int i = 0; i < count; i++)
+        {
+            // periods from 1us to about 9 minutes
+            seed = seed * 6364136223846793005UL + 1442695040888963407UL;
+            timers[i].callback = bench_expired;
+            timers[i].period = NANOSECONDS(1, TIME_US) << ((seed >> 33) % 30);
+            timer_start(timers + i);
+        }
+        armed += system_timestamp() - start;
+
+        start = system_timestamp();
+        for(int i = 0; i < count; i++)
+        {
+            timer_cancel(timers + (i * 7919) % count);
+        }
+        cancelled += system_timestamp() - start;
     }
-    else
+
+    kp_info("timer", "%d timers started: %lu ns each", TIMER_BENCH, armed / TIMER_BENCH);
+    kp_info("timer", "%d timers cancelled: %lu ns each", TIMER_BENCH, cancelled / TIMER_BENCH);
+
+    bench_fired = 0;
+    bench_late = 0;
+
+    for(int i = 0; i < count; i++)
+    {
+        timers[i].period = NANOSECONDS(10 * (i + 1), TIME_US);
+        timer_start(timers + i);
+    }
+
+    thread_sleep(NANOSECONDS(20, TIME_MS));
+    while(__atomic_load_n(&bench_fired, __ATOMIC_RELAXED) < (uint32_t)count)
     {
-        next_deadline = 0;
+        thread_sleep(NANOSECONDS(1, TIME_MS));
     }
 
-    release_safe_lock(&lock, &flags);
+    kp_info("timer", "%d timers expired: %lu ns late on average", count, bench_late / count);
+    kfree(timers);
 }
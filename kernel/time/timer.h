@@ -2,14 +2,33 @@
 
 #include <kernel/lists.h>
 
+#define TIMER_SHIFT  14 // a wheel tick is 2^14 ns, about 16us
+#define TIMER_BITS   6
+#define TIMER_SLOTS  (1 << TIMER_BITS)
+#define TIMER_LEVELS 6  // the last level reaches about 13 days
+
 typedef struct timer {
     size_t deadline;
     size_t period;
     void (*callback)(struct timer*);
     void *data;
+    int core;
+    list_t *slot;
     link_t link;
 } timer_t;
 
+typedef struct {
+    int id;                                    // Core ID
+    uint64_t clock;                            // Next wheel tick to process
+    uint32_t count;                            // Number of pending timers
+    uint64_t pending[TIMER_LEVELS];            // Bitmaps of non-empty slots
+    list_t wheel[TIMER_LEVELS][TIMER_SLOTS];   // Timers by level and slot
+    spinlock_t lock;                           // Lock for this struct
+} timer_base_t;
+
 void timer_tick();
+uint64_t timer_next_event();
 int timer_start(timer_t *tm);
 void timer_cancel(timer_t *tm);
+void timer_benchmark();
+void timer_init_core(int id);
@@ -36,6 +36,12 @@ uint64_t tsc_timestamp()
     return ts;
 }
 
+// Number of TSC cycles in the given time, for spans of at most a few seconds
+uint64_t tsc_cycles(uint64_t ns)
+{
+    return (ns * frequency) / TIME_NS;
+}
+
 uint64_t tsc_frequency()
 {
     return frequency;
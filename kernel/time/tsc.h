@@ -5,4 +5,5 @@
 uint64_t rdtsc();
 void tsc_calibrate();
 uint64_t tsc_timestamp();
+uint64_t tsc_cycles(uint64_t ns);
 uint64_t tsc_frequency();
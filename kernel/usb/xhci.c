@@ -346,7 +346,6 @@ static int xhci_init_device_context(xhci_t *xhci)
 
     xhci->hco->dcbaap = ctx_phys;
     xhci->dcba = (void*)ctx_virt;
-    memset(xhci->dcba, 0, size);
 
     // Configure "Scratchpad Buffer Array"
     // The location of the Scratchpad Buffer Array is defined by entry 0 of the Device Context Base Address Array
@@ -364,7 +363,6 @@ static int xhci_init_device_context(xhci_t *xhci)
         return -ENOMEM;
     }
 
-    memset((void*)scp_virt, 0, size);
     xhci->dcba[0] = scp_phys;
 
     return 0;
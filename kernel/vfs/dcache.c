@@ -1,19 +1,22 @@
 #include <kernel/vfs/types.h>
-#include <kernel/mem/heap.h>
+#include <kernel/mem/slab.h>
 #include <string.h>
 
+static kmem_cache_t *dentry_cache;
+
 static dentry_t *dentry_alloc()
 {
     dentry_t *item;
     int memsz;
 
     memsz = sizeof(dentry_t) + sizeof(inode_t);
-    item = kzalloc(memsz);
+    item = kmem_cache_alloc(dentry_cache);
     if(item == 0)
     {
         return 0;
     }
 
+    memset(item, 0, memsz);
     item->inode = (inode_t*)(item + 1);
     return item;
 }
@@ -105,7 +108,7 @@ dentry_t *dcache_lookup(dentry_t *parent, const char *name)
 void dcache_delete(dentry_t *item)
 {
     dentry_unlink(item);
-    kfree(item);
+    kmem_cache_free(dentry_cache, item);
 }
 
 void dcache_move(dentry_t *parent, dentry_t *item, const char *name)
@@ -201,7 +204,12 @@ void dcache_purge(dentry_t *root)
     while(item)
     {
         root = item->next;
-        kfree(item);
+        kmem_cache_free(dentry_cache, item);
         item = root;
     }
 }
+
+void dcache_init()
+{
+    dentry_cache = kmem_cache_create("dentry", sizeof(dentry_t) + sizeof(inode_t));
+}
@@ -21,76 +21,110 @@ fd_t *fd_create()
     }
 
     process = process_handle();
-    fd->id = process->fd.next++;
     fd->file = file;
     atomic_inc_fetch(&file->refs);
-    list_insert(&process->fd.list, fd);
+
+    write_lock(&process->fd.lock);
+    fd->id = process->fd.next++;
+    list_insert_rcu(&process->fd.list, fd);
+    write_unlock(&process->fd.lock);
 
     return fd;
 }
 
-fd_t *fd_find(int id)
+// Takes a reference on the file behind a descriptor, released with fd_put
+file_t *fd_get(int id)
 {
     process_t *process;
-    list_t *list;
-    fd_t *fd;
+    file_t *file = 0;
+    uint32_t flags;
+    atomic_t refs;
+    fd_t *fd = 0;
 
     process = process_handle();
-    list = &process->fd.list;
-
-    acquire_lock(&list->lock);
-    fd = list->head;
 
-    while(fd)
+    rcu_read_lock(&flags);
+    while(fd = list_iterate_rcu(&process->fd.list, fd), fd)
     {
-        if(fd->id == id)
+        if(fd->id != id)
         {
-            break;
+            continue;
         }
-        fd = fd->link.next;
+
+        // a file whose last reference is gone is being closed
+        refs = atomic_get(&fd->file->refs);
+        while(refs)
+        {
+            if(__atomic_compare_exchange_n(&fd->file->refs, &refs, refs + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            {
+                file = fd->file;
+                break;
+            }
+        }
+        break;
     }
+    rcu_read_unlock(&flags);
 
-    release_lock(&list->lock);
+    return file;
+}
 
-    return fd;
+// Returns the file context when the last reference was dropped
+file_t *fd_put(file_t *file)
+{
+    if(atomic_dec_fetch(&file->refs))
+    {
+        return 0;
+    }
+
+    return file;
 }
 
-file_t *fd_delete(fd_t *fd)
+// Removes a descriptor, its reference on the file is handed to the caller
+file_t *fd_remove(int id)
 {
     process_t *process;
-    atomic_t refs;
-    file_t *file;
+    file_t *file = 0;
+    fd_t *fd = 0;
 
     process = process_handle();
-    list_remove(&process->fd.list, fd);
 
-    file = fd->file;
-    refs = atomic_dec_fetch(&file->refs);
-    kfree(fd);
+    write_lock(&process->fd.lock);
+    while(fd = list_iterate(&process->fd.list, fd), fd)
+    {
+        if(fd->id == id)
+        {
+            list_remove_rcu(&process->fd.list, fd);
+            file = fd->file;
+            break;
+        }
+    }
+    write_unlock(&process->fd.lock);
 
-    if(!refs)
+    if(fd)
     {
-        return file;
+        rcu_free(&fd->rcu, fd);
     }
 
-    return 0;
+    return file;
 }
 
-fd_t *fd_clone(fd_t *fd, process_t *target)
+fd_t *fd_clone(file_t *file, process_t *target)
 {
-    file_t *file;
+    fd_t *fd;
 
-    file = fd->file;
     fd = kzalloc(sizeof(fd_t));
     if(!fd)
     {
         return 0;
     }
 
-    fd->id = target->fd.next++;
     fd->file = file;
     atomic_inc_fetch(&file->refs);
-    list_insert(&target->fd.list, fd);
+
+    write_lock(&target->fd.lock);
+    fd->id = target->fd.next++;
+    list_insert_rcu(&target->fd.list, fd);
+    write_unlock(&target->fd.lock);
 
     return fd;
 }
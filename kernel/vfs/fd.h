@@ -2,14 +2,21 @@
 
 #include <kernel/vfs/types.h>
 #include <kernel/sched/process.h>
+#include <kernel/sched/rcu.h>
+
+// fd_get walks the list of the process without a lock and takes a reference on the
+// file, so it stays open until fd_put. Changes to the list and walks that may sleep
+// take the rwlock of the list.
 
 typedef struct {
     int id;       // File descriptor ID (per process)
     file_t *file; // File context
     link_t link;  // Link to next
+    rcu_t rcu;    // Deferred free after close
 } fd_t;
 
 fd_t *fd_create();
-fd_t *fd_find(int id);
-file_t *fd_delete(fd_t *fd);
-fd_t *fd_clone(fd_t *fd, process_t *target);
+file_t *fd_get(int id);
+file_t *fd_put(file_t *file);
+file_t *fd_remove(int id);
+fd_t *fd_clone(file_t *file, process_t *target);
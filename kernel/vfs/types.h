@@ -1,5 +1,6 @@
 #pragma once
 
+#include <kernel/sched/rcu.h>
 #include <kernel/atomic.h>
 #include <kernel/lists.h>
 #include <kernel/types.h>
@@ -168,6 +169,7 @@ struct vfs_mp {
     dentry_t dentry;    // Root dentry
     atomic_t numfd;     // Number of open files for this mountpoint
     link_t link;        // Link for list of mountpoints
+    rcu_t rcu;          // Deferred free after unmount
 };
 
 // Device file
@@ -5,6 +5,7 @@
 #include <kernel/vfs/fd.h>
 #include <kernel/sched/process.h>
 #include <kernel/time/time.h>
+#include <kernel/mem/image.h>
 #include <kernel/mem/heap.h>
 #include <kernel/cleanup.h>
 #include <kernel/debug.h>
@@ -13,8 +14,13 @@
 
 DEFINE_AUTOFREE_TYPE(vfs_path_t)
 
+// Filesystems are never unregistered, so their list is walked without a lock. The
+// mountpoint list is walked under its rwlock. Path walks pin the mountpoint they
+// enter, so it cannot be unmounted under them.
+
 static LIST_INIT(fsl, vfs_fs_t, link);
 static LIST_INIT(mpl, vfs_mp_t, link);
+static rwlock_t mpl_lock = 0;
 static dentry_t *root = 0;
 
 static inline void dentry_open(dentry_t *dp)
@@ -31,6 +37,56 @@ static inline void dentry_close(dentry_t *dp)
     atomic_dec_fetch(&dp->numfd);
 }
 
+// Drops a reference of fd_get, the last one closes the file
+int vfs_release(file_t *file)
+{
+    vfs_ops_t *ops;
+    int status;
+
+    if(fd_put(file) == 0)
+    {
+        return 0;
+    }
+
+    status = 0;
+    ops = file->inode->ops;
+
+    if(ops->close)
+    {
+        status = ops->close(file);
+    }
+
+    if(file->dentry)
+    {
+        dentry_close(file->dentry);
+    }
+    kfree(file);
+
+    return status;
+}
+
+static inline void vfs_file_put(file_t **file)
+{
+    if(*file)
+    {
+        vfs_release(*file);
+    }
+}
+
+#define autoput __attribute__((cleanup(vfs_file_put)))
+
+// Drops a descriptor whose file failed to open
+static void vfs_discard(int id)
+{
+    file_t *file;
+
+    file = fd_remove(id);
+    if(file && fd_put(file))
+    {
+        kfree(file);
+    }
+}
+
 static int vfs_validate_name(const char *name, int maxlen)
 {
     if(strlen(name) >= maxlen)
@@ -56,38 +112,67 @@ static int vfs_validate_name(const char *name, int maxlen)
     return 0;
 }
 
+// The entry stays valid after the read section, filesystems are never removed
 static vfs_fs_t *vfs_find_fs(const char *name)
 {
-    vfs_fs_t *curr = fsl.head;
+    vfs_fs_t *curr = 0;
+    uint32_t flags;
 
-    while(curr)
+    rcu_read_lock(&flags);
+    while(curr = list_iterate_rcu(&fsl, curr), curr)
     {
         if(strcmp(curr->name, name) == 0)
         {
-            return curr;
+            break;
         }
-        curr = curr->link.next;
     }
+    rcu_read_unlock(&flags);
 
-    return 0;
+    return curr;
 }
 
+// Called with the mountpoint list locked
 static vfs_mp_t *vfs_find_mp(const char *name)
 {
-    vfs_mp_t *curr = mpl.head;
+    vfs_mp_t *curr = 0;
 
-    while(curr)
+    while(curr = list_iterate(&mpl, curr), curr)
     {
         if(strcmp(curr->name, name) == 0)
         {
-            return curr;
+            break;
         }
-        curr = curr->link.next;
     }
 
-    return 0;
+    return curr;
 }
 
+// A pinned mountpoint counts as busy for vfs_umount
+static vfs_mp_t *vfs_pin_mp(const char *name)
+{
+    vfs_mp_t *mp;
+
+    read_lock(&mpl_lock);
+    mp = vfs_find_mp(name);
+    if(mp)
+    {
+        atomic_inc_fetch(&mp->numfd);
+    }
+    read_unlock(&mpl_lock);
+
+    return mp;
+}
+
+static inline void vfs_unpin_mp(vfs_mp_t **mp)
+{
+    if(*mp)
+    {
+        atomic_dec_fetch(&(*mp)->numfd);
+    }
+}
+
+#define autounpin __attribute__((cleanup(vfs_unpin_mp)))
+
 //  This function will clean a path by
 //  - adding leading slash if missing
 //  - removing trailing slashes
@@ -261,10 +346,11 @@ static char *vfs_read_path(vfs_path_t *path)
 static int vfs_walk_path(const char *pathname, dentry_t **dp, bool mustexist)
 {
     autofree(vfs_path_t) *path = 0;
+    autounpin vfs_mp_t *mp = 0;
     dentry_t *parent, *child;
     inode_t inode, *ip;
+    vfs_mp_t *next;
     vfs_ops_t *ops;
-    vfs_mp_t *mp;
     int status;
 
     path = vfs_new_path(pathname);
@@ -293,11 +379,14 @@ static int vfs_walk_path(const char *pathname, dentry_t **dp, bool mustexist)
 
         if(parent == root)
         {
-            mp = vfs_find_mp(path->curr);
-            if(!mp)
+            next = vfs_pin_mp(path->curr);
+            if(!next)
             {
                 return -ENOENT;
             }
+
+            vfs_unpin_mp(&mp);
+            mp = next;
             parent = &mp->dentry;
             continue;
         }
@@ -446,30 +535,31 @@ int vfs_put_dirent(void *data, const char *name, inode_t *inode)
 
 int vfs_readdir(int id, size_t size, dirent_t *dirent)
 {
+    autoput file_t *file = 0;
+    char name[MAX_SFN];
     int seek, status;
+    inode_t inode;
     vfs_ops_t *ops;
     vfs_mp_t *mp;
     dentry_t *dp;
-    fd_t *fd;
 
-    fd = fd_find(id);
-    if(fd == 0)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
 
-    if((fd->file->flags & O_DIR) == 0)
+    if((file->flags & O_DIR) == 0)
     {
         return -ENOTDIR;
     }
 
-    seek = fd->file->seek;
-    dp = fd->file->dentry;
+    seek = file->seek;
+    dp = file->dentry;
     ops = dp->inode->ops;
-    mp = mpl.head;
 
     vfs_rd_t rd = {
-        .file = fd->file,
+        .file = file,
         .parent = 0,
         .status = 0,
         .dirent = dirent,
@@ -478,7 +568,7 @@ int vfs_readdir(int id, size_t size, dirent_t *dirent)
     };
 
     // special case for . entry
-    if(fd->file->seek == 0)
+    if(file->seek == 0)
     {
         status = vfs_put_dirent(&rd, ".", dp->inode);
         if(status < 0)
@@ -488,7 +578,7 @@ int vfs_readdir(int id, size_t size, dirent_t *dirent)
     }
 
     // special case for .. entry
-    if(fd->file->seek == 1)
+    if(file->seek == 1)
     {
         status = vfs_put_dirent(&rd, "..", dp->parent->inode);
         if(status < 0)
@@ -498,25 +588,35 @@ int vfs_readdir(int id, size_t size, dirent_t *dirent)
     }
 
     // adjust seek
-    seek = fd->file->seek - 2;
+    seek = file->seek - 2;
 
-    // special case for root
+    // special case for root, each entry is copied out after the lock is dropped,
+    // since a fault on the user buffer may sleep
     if(dp == root)
     {
-        while(seek && mp)
+        while(1)
         {
-            seek--;
-            mp = mp->link.next;
-        }
+            read_lock(&mpl_lock);
+            mp = mpl.head;
 
-        while(mp)
-        {
-            status = vfs_put_dirent(&rd, mp->name, &mp->inode);
-            if(status < 0)
+            for(int i = 0; i < seek && mp; i++)
             {
-                return rd.status;
+                mp = mp->link.next;
             }
-            mp = mp->link.next;
+
+            if(mp)
+            {
+                strcpy(name, mp->name);
+                inode = mp->inode;
+            }
+
+            read_unlock(&mpl_lock);
+
+            if(!mp || vfs_put_dirent(&rd, name, &inode) < 0)
+            {
+                break;
+            }
+            seek++;
         }
 
         return rd.status;
@@ -530,7 +630,7 @@ int vfs_readdir(int id, size_t size, dirent_t *dirent)
             rd.parent = dp;
         }
 
-        status = ops->readdir(fd->file, seek, &rd);
+        status = ops->readdir(file, seek, &rd);
         if(status < 0)
         {
             return status;
@@ -538,7 +638,7 @@ int vfs_readdir(int id, size_t size, dirent_t *dirent)
 
         if(rd.status == 0)
         {
-            if(fd->file->seek == dp->positive + 2)
+            if(file->seek == dp->positive + 2)
             {
                 dp->cached = true;
             }
@@ -580,16 +680,16 @@ int vfs_readdir(int id, size_t size, dirent_t *dirent)
 
 int vfs_fstat(int id, stat_t *stat)
 {
+    autoput file_t *file = 0;
     inode_t *ip;
-    fd_t *fd;
 
-    fd = fd_find(id);
-    if(fd == 0)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
 
-    ip = fd->file->inode;
+    ip = file->inode;
     stat->ino = ip->ino;
     stat->flags = ip->flags;
     stat->mode = ip->mode;
@@ -637,17 +737,15 @@ int vfs_stat(const char *pathname, stat_t *stat)
 
 int vfs_read(int id, size_t size, void *buf)
 {
+    autoput file_t *file = 0;
     vfs_ops_t *ops;
-    file_t *file;
-    fd_t *fd;
     int status;
 
-    fd = fd_find(id);
-    if(!fd)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
-    file = fd->file;
 
     if(file->flags & O_DIR)
     {
@@ -692,19 +790,103 @@ int vfs_read(int id, size_t size, void *buf)
     return status;
 }
 
+// Keep the file behind a descriptor alive, e.g. for a memory mapping
+int vfs_pin(int id, dentry_t **dp)
+{
+    autoput file_t *file = 0;
+
+    file = fd_get(id);
+    if(!file)
+    {
+        return -EBADF;
+    }
+
+    if((file->flags & O_READ) == 0)
+    {
+        return -EBADF;
+    }
+
+    if((file->inode->flags & I_FILE) == 0)
+    {
+        return -ENODEV;
+    }
+
+    if(!file->inode->ops->read)
+    {
+        return -ENOTSUP;
+    }
+
+    dentry_open(file->dentry);
+    *dp = file->dentry;
+
+    return 0;
+}
+
+void vfs_pin_dentry(dentry_t *dp)
+{
+    dentry_open(dp);
+}
+
+void vfs_unpin(dentry_t *dp)
+{
+    dentry_close(dp);
+}
+
+// Read from a pinned file without a file descriptor
+// Returns the number of bytes read, which is zero beyond the end of the file
+int vfs_pread(dentry_t *dp, size_t offset, size_t size, void *buf)
+{
+    inode_t *ip;
+    file_t file;
+    int status;
+    size_t pos;
+
+    ip = dp->inode;
+
+    if(offset >= ip->size)
+    {
+        return 0;
+    }
+
+    if(offset + size > ip->size)
+    {
+        size = ip->size - offset;
+    }
+
+    memset(&file, 0, sizeof(file_t));
+    file.flags = O_READ;
+    file.dentry = dp;
+    file.inode = ip;
+
+    for(pos = 0; pos < size; pos += status)
+    {
+        file.seek = offset + pos;
+        status = ip->ops->read(&file, size - pos, buf + pos);
+        if(status < 0)
+        {
+            return status;
+        }
+
+        if(status == 0)
+        {
+            break;
+        }
+    }
+
+    return pos;
+}
+
 int vfs_write(int id, size_t size, void *buf)
 {
+    autoput file_t *file = 0;
     vfs_ops_t *ops;
-    file_t *file;
-    fd_t *fd;
     int status;
 
-    fd = fd_find(id);
-    if(!fd)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
-    file = fd->file;
 
     if(file->flags & O_DIR)
     {
@@ -743,17 +925,15 @@ int vfs_write(int id, size_t size, void *buf)
 
 int vfs_seek(int id, long offset, int origin)
 {
+    autoput file_t *file = 0;
     vfs_ops_t *ops;
-    file_t *file;
     size_t size;
-    fd_t *fd;
 
-    fd = fd_find(id);
-    if(!fd)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
-    file = fd->file;
 
     if(file->flags & O_DIR)
     {
@@ -789,27 +969,27 @@ int vfs_seek(int id, long offset, int origin)
 
 int vfs_ioctl(int id, size_t cmd, size_t val)
 {
+    autoput file_t *file = 0;
     vfs_ops_t *ops;
-    fd_t *fd;
 
-    fd = fd_find(id);
-    if(fd == 0)
+    file = fd_get(id);
+    if(!file)
     {
         return -EBADF;
     }
 
-    if(fd->file->flags & O_DIR)
+    if(file->flags & O_DIR)
     {
         return -EISDIR;
     }
 
-    ops = fd->file->inode->ops;
+    ops = file->inode->ops;
     if(!ops->ioctl)
     {
         return -ENOTSUP;
     }
 
-    return ops->ioctl(fd->file, cmd, val);
+    return ops->ioctl(file, cmd, val);
 }
 
 int vfs_chdir(const char *pathname)
@@ -987,7 +1167,7 @@ int vfs_open(const char *pathname, int flags)
         status = ops->open(fd->file);
         if(status < 0)
         {
-            fd_delete(fd);
+            vfs_discard(fd->id);
             return status;
         }
     }
@@ -997,7 +1177,7 @@ int vfs_open(const char *pathname, int flags)
         status = ops->truncate(ip);
         if(status < 0)
         {
-            fd_delete(fd);
+            vfs_discard(fd->id);
             return status;
         }
     }
@@ -1013,41 +1193,17 @@ int vfs_open(const char *pathname, int flags)
 
 int vfs_close(int id)
 {
-    vfs_ops_t *ops;
     file_t *file;
-    int status;
-    fd_t *fd;
-
-    fd = fd_find(id);
-    if(fd == 0)
-    {
-        return -EBADF;
-    }
 
-    // fd_delete() returns the file context when there are no more references
-    // and then we proceed to close the file
-
-    file = fd_delete(fd);
+    // the reference of the descriptor is dropped like any other, the file
+    // is closed once no other thread uses it anymore
+    file = fd_remove(id);
     if(file == 0)
     {
-        return 0;
-    }
-
-    status = 0;
-    ops = file->inode->ops;
-
-    if(ops->close)
-    {
-        status = ops->close(file);
-    }
-
-    if(file->dentry)
-    {
-        dentry_close(file->dentry);
+        return -EBADF;
     }
-    kfree(file);
 
-    return status;
+    return vfs_release(file);
 }
 
 int vfs_create(const char *pathname, int mode)
@@ -1319,7 +1475,11 @@ int vfs_mount(const char *source, const char *fstype, const char *target)
         return -ENOFS;
     }
 
-    if(vfs_find_mp(target))
+    read_lock(&mpl_lock);
+    mp = vfs_find_mp(target);
+    read_unlock(&mpl_lock);
+
+    if(mp)
     {
         return -EEXIST;
     }
@@ -1371,7 +1531,17 @@ int vfs_mount(const char *source, const char *fstype, const char *target)
     dp->parent = root;
     dp->mp = mp;
 
-    list_insert(&mpl, mp);
+    // another mount of the same target may have been faster
+    write_lock(&mpl_lock);
+    if(vfs_find_mp(target))
+    {
+        write_unlock(&mpl_lock);
+        fs->ops->umount(data);
+        kfree(mp);
+        return -EEXIST;
+    }
+    list_insert_rcu(&mpl, mp);
+    write_unlock(&mpl_lock);
 
     kp_info("vfs", "mounted %s on /%s", fstype, target);
     return 0;
@@ -1383,27 +1553,39 @@ int vfs_umount(const char *target)
     vfs_fs_t *fs;
     int status;
 
+    // the busy check and the removal are atomic against path walks pinning it
+    write_lock(&mpl_lock);
     mp = vfs_find_mp(target);
     if(!mp)
     {
+        write_unlock(&mpl_lock);
         return -EINVAL;
     }
-    fs = mp->fs;
 
     if(mp->numfd)
     {
+        write_unlock(&mpl_lock);
         return -EBUSY;
     }
 
+    list_remove_rcu(&mpl, mp);
+    write_unlock(&mpl_lock);
+    fs = mp->fs;
+
+    // cached executables of this mountpoint are no longer in use
+    image_purge(mp);
+
     status = fs->ops->umount(mp->inode.data);
     if(status < 0)
     {
+        write_lock(&mpl_lock);
+        list_insert_rcu(&mpl, mp);
+        write_unlock(&mpl_lock);
         return status;
     }
 
-    list_remove(&mpl, mp);
     dcache_purge(&mp->dentry);
-    kfree(mp);
+    rcu_free(&mp->rcu, mp);
 
     kp_info("vfs", "unmounted /%s", target);
     return 0;
@@ -1443,7 +1625,7 @@ int vfs_register(const char *fstype, vfs_ops_t *ops)
 
     strcpy(fs->name, fstype);
     fs->ops = ops;
-    list_insert(&fsl, fs);
+    list_insert_rcu(&fsl, fs);
 
     kp_info("vfs", "registered filesystem %s", fstype);
     return 0;
@@ -1478,6 +1660,7 @@ void vfs_init()
         root->parent = root;
     }
 
+    dcache_init();
     devfs_init();
     iso9660_init();
     ext2_init();
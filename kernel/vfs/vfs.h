@@ -3,6 +3,7 @@
 #include <kernel/sched/process.h>
 #include <kernel/vfs/types.h>
 
+void dcache_init();
 void dcache_purge(dentry_t *root);
 void dcache_delete(dentry_t *item);
 void dcache_move(dentry_t *parent, dentry_t *item, const char *name);
@@ -19,12 +20,18 @@ void vfs_proc_fini(process_t *pr);
 int vfs_mkpipe(int *fd);
 int vfs_open(const char *pathname, int flags);
 int vfs_close(int fd);
+int vfs_release(file_t *file);
 
 int vfs_read(int fd, size_t size, void *buf);
 int vfs_write(int fd, size_t size, void *buf);
 int vfs_seek(int fd, long offset, int origin);
 int vfs_ioctl(int fd, size_t cmd, size_t val);
 
+int vfs_pin(int fd, dentry_t **dp);
+void vfs_pin_dentry(dentry_t *dp);
+void vfs_unpin(dentry_t *dp);
+int vfs_pread(dentry_t *dp, size_t offset, size_t size, void *buf);
+
 int vfs_stat(const char *pathname, stat_t *stat);
 int vfs_fstat(int fd, stat_t *stat);
 
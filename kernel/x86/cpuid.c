@@ -162,9 +162,11 @@ static void cpuid_flags()
     check_set_flag(ecx,  9, CPU_FEATURE_SSSE3);
     check_set_flag(ecx, 12, CPU_FEATURE_FMA3);
     check_set_flag(ecx, 13, CPU_FEATURE_CX16);
+    check_set_flag(ecx, 17, CPU_FEATURE_PCID);
     check_set_flag(ecx, 19, CPU_FEATURE_SSE4_1);
     check_set_flag(ecx, 20, CPU_FEATURE_SSE4_2);
     check_set_flag(ecx, 21, CPU_FEATURE_X2APIC);
+    check_set_flag(ecx, 24, CPU_FEATURE_TSCDL);
     check_set_flag(ecx, 25, CPU_FEATURE_AES);
     check_set_flag(ecx, 26, CPU_FEATURE_XSAVE);
     check_set_flag(ecx, 28, CPU_FEATURE_AVX);
@@ -50,6 +50,8 @@ enum {
     CPU_FEATURE_BMI1     = 1UL << 41, // BMI1 instructions
     CPU_FEATURE_BMI2     = 1UL << 42, // BMI2 instructions
     CPU_FEATURE_XSAVE    = 1UL << 43, // XSAVE instructions
+    CPU_FEATURE_PCID     = 1UL << 44, // Process-Context Identifiers
+    CPU_FEATURE_TSCDL    = 1UL << 45, // TSC-Deadline mode of the LAPIC timer
 };
 
 typedef struct {
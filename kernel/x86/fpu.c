@@ -1,12 +1,83 @@
+#include <kernel/sched/scheduler.h>
+#include <kernel/sched/spinlock.h>
+#include <kernel/x86/ioports.h>
+#include <kernel/x86/percpu.h>
 #include <kernel/x86/cpuid.h>
 #include <kernel/x86/fpu.h>
 #include <kernel/debug.h>
 #include <string.h>
 
+// The extended state is switched lazily. Every switch sets CR0.TS unless the next
+// thread still owns the registers of this core, and the first FPU/SSE/AVX instruction
+// afterwards raises #NM to load its state. The registers are only saved when their
+// owner is switched out, so threads that never touch them pay nothing.
+
+#define CR0_TS (1UL << 3)
+
+enum {
+    FPU_FXSAVE,    // legacy area only
+    FPU_XSAVE,     // standard format
+    FPU_XSAVEOPT,  // standard format, skips unmodified and initial components
+    FPU_XSAVES,    // compacted format, skips unmodified and initial components
+};
+
 static int context_size = 512;
 static int context_max_size = 512;
 static uint8_t fxsave[512] __attribute__((aligned(64)));
-int xsave_support = 0;
+static int mode = FPU_FXSAVE;
+
+static void fpu_set_ts(bool set)
+{
+    uint64_t cr0;
+
+    // writing CR0 serializes, so only do it when TS actually changes
+    asm volatile("movq %%cr0, %0" : "=r"(cr0));
+    if(((cr0 & CR0_TS) != 0) != set)
+    {
+        cr0 ^= CR0_TS;
+        asm volatile("movq %0, %%cr0" :: "r"(cr0));
+    }
+}
+
+static void fpu_save(thread_t *thread)
+{
+    void *xstate = (void*)thread->xstate;
+
+    switch(mode)
+    {
+        case FPU_XSAVES:
+            asm volatile("xsaves64 (%0)" :: "r"(xstate), "a"(-1), "d"(-1) : "memory");
+            break;
+        case FPU_XSAVEOPT:
+            asm volatile("xsaveopt64 (%0)" :: "r"(xstate), "a"(-1), "d"(-1) : "memory");
+            break;
+        case FPU_XSAVE:
+            asm volatile("xsave64 (%0)" :: "r"(xstate), "a"(-1), "d"(-1) : "memory");
+            break;
+        default:
+            asm volatile("fxsave64 (%0)" :: "r"(xstate) : "memory");
+            break;
+    }
+}
+
+static void fpu_restore(thread_t *thread)
+{
+    void *xstate = (void*)thread->xstate;
+
+    switch(mode)
+    {
+        case FPU_XSAVES:
+            asm volatile("xrstors64 (%0)" :: "r"(xstate), "a"(-1), "d"(-1) : "memory");
+            break;
+        case FPU_XSAVEOPT:
+        case FPU_XSAVE:
+            asm volatile("xrstor64 (%0)" :: "r"(xstate), "a"(-1), "d"(-1) : "memory");
+            break;
+        default:
+            asm volatile("fxrstor64 (%0)" :: "r"(xstate) : "memory");
+            break;
+    }
+}
 
 int fpu_xstate_size()
 {
@@ -16,9 +87,67 @@ int fpu_xstate_size()
 
 void fpu_xstate_init(thread_t *thread)
 {
+    uint64_t *header;
+
     thread->xstate = thread->rsp0 + 64;
     thread->xstate = (thread->xstate & -64UL);
+    thread->fpu_core = -1;
     memcpy((void*)thread->xstate, fxsave, 32);
+
+    // x87 and SSE are loaded from the legacy area to keep the default control words
+    if(mode != FPU_FXSAVE)
+    {
+        header = (uint64_t*)(thread->xstate + 512);
+        header[0] = 3;
+        header[1] = (mode == FPU_XSAVES) ? ((1UL << 63) | 3) : 0;
+    }
+}
+
+// Copies the extended state of the current thread, saving it first if it is still in the registers
+void fpu_copy(thread_t *dst, thread_t *src)
+{
+    uint32_t flags;
+
+    disable_interrupts(&flags);
+    fpu_switch_out(src);
+    memcpy((void*)dst->xstate, (void*)src->xstate, context_size);
+    restore_interrupts(&flags);
+}
+
+// Called on every switch with interrupts disabled, before the previous thread can run elsewhere
+void fpu_switch_out(thread_t *thread)
+{
+    uint64_t cr0;
+
+    asm volatile("movq %%cr0, %0" : "=r"(cr0));
+    if(!(cr0 & CR0_TS) && percpu_read(fpu_owner) == thread)
+    {
+        fpu_save(thread);
+    }
+}
+
+// Called on every switch with interrupts disabled, once the next thread is known
+void fpu_switch_in(thread_t *thread)
+{
+    fpu_set_ts(percpu_read(fpu_owner) != thread || thread->fpu_core != percpu_read(id));
+}
+
+// Device not available (#NM), the current thread touched the FPU while CR0.TS was set
+void fpu_trap()
+{
+    thread_t *thread;
+
+    asm volatile("clts");
+
+    thread = scheduler_get_thread();
+    if(thread)
+    {
+        fpu_restore(thread);
+        thread->fpu_core = percpu_read(id);
+        percpu_inc(fpu_loads);
+    }
+
+    percpu_write(fpu_owner, thread);
 }
 
 void fpu_init()
@@ -33,6 +162,7 @@ void fpu_init()
     asm volatile("movq %%cr0, %0" : "=r"(cr0));
 
     cr0 &= ~(1UL << 2);  // Clear EM bit (emulated)
+    cr0 &= ~CR0_TS;      // Clear TS bit (task switched) until the default state is saved
     cr0 |=  (1UL << 5);  // Set NE bit (native exception)
     cr0 |=  (1UL << 1);  // Set MP bit (monitor co-processor)
     cr4 |=  (1UL << 9);  // Set OSFXSR bit (enable SSE support)
@@ -61,14 +191,33 @@ void fpu_init()
 
         asm volatile("xsetbv" :: "a"(xcr0lo), "d"(xcr0hi), "c"(0));
 
-        // Context size
+        // Context size and save instruction
         if(init)
         {
             cpuid(0xD, eax, ebx, ecx, edx);
-            xsave_support = 1;
+            mode = FPU_XSAVE;
             context_size = ebx;
             context_max_size = ecx;
-            kp_info("fpu", "xsave: flags = %#x, context size = %d", xcr0lo, context_size);
+
+            asm volatile("cpuid" : "=a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx) : "a"(0xD), "c"(1));
+            if(eax & (1U << 3))
+            {
+                // the compacted size of the XCR0 | IA32_XSS components
+                mode = FPU_XSAVES;
+                context_size = ebx;
+            }
+            else if(eax & (1U << 0))
+            {
+                mode = FPU_XSAVEOPT;
+            }
+
+            kp_info("fpu", "xsave: flags = %#x, context size = %d, mode = %d", xcr0lo, context_size, mode);
+        }
+
+        // no supervisor states are used
+        if(mode == FPU_XSAVES)
+        {
+            write_msr(MSR_XSS, 0);
         }
     }
 
@@ -91,4 +240,8 @@ void fpu_init()
         asm volatile("fxsave %0" : "=m"(fxsave));
         init = 0;
     }
+
+    // the first thread to use the FPU on this core loads its state
+    percpu_write(fpu_owner, 0);
+    fpu_set_ts(true);
 }
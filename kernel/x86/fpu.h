@@ -2,8 +2,12 @@
 
 #include <kernel/sched/threads.h>
 
-extern int xsave_support;
+#define MSR_XSS 0xDA0
 
 int fpu_xstate_size();
 void fpu_xstate_init(thread_t *thread);
+void fpu_copy(thread_t *dst, thread_t *src);
+void fpu_switch_out(thread_t *thread);
+void fpu_switch_in(thread_t *thread);
+void fpu_trap();
 void fpu_init();
@@ -2,7 +2,7 @@
 extern isr_handler
 extern irq_handler
 extern schedule_handler
-extern lapic_write
+extern vmm_tlb_interrupt
 
 [SECTION .text]
 %macro ISR_NOERRCODE 1
@@ -33,6 +33,14 @@ irq%1:
 .end:
 %endmacro
 
+; Interrupts from user mode swap in the kernel GS base, the argument is the offset of cs
+%macro swapgs_user 1
+    test byte [rsp+%1], 3
+    jz %%kernel
+    swapgs
+%%kernel:
+%endmacro
+
 %macro save_registers 0
     push rax
     push rbx
@@ -110,21 +118,25 @@ IRQ n
 
 global irq_common_stub:function (irq_common_stub.end - irq_common_stub)
 irq_common_stub:
+    swapgs_user 24
     save_registers
     mov rdi, rsp
     call irq_handler
     restore_registers
     add rsp, qword 16
+    swapgs_user 8
     iretq
 .end:
 
 global isr_common_stub:function (isr_common_stub.end - isr_common_stub)
 isr_common_stub:
+    swapgs_user 24
     save_registers
     mov rdi, rsp
     call isr_handler
     restore_registers
     add rsp, qword 16
+    swapgs_user 8
     iretq
 .end:
 
@@ -136,13 +148,11 @@ isr_spurious:
 global isr_tlbflush:function (isr_tlbflush.end - isr_tlbflush)
 isr_tlbflush:
     cli
+    swapgs_user 8
     save_registers
-    mov rax, cr3      ; reload cr3
-    mov cr3, rax
-    mov rdi, 0xB0     ; send EOI to lapic
-    mov rsi, 0
-    call lapic_write
+    call vmm_tlb_interrupt  ; flushes the TLB and sends the EOI
     restore_registers
+    swapgs_user 8
     iretq
 .end:
 
@@ -167,36 +177,22 @@ switch_task:
     ret
 .end:
 
-extern xsave_support
 global isr_schedule:function (isr_schedule.end - isr_schedule)
 isr_schedule:
     cli                             ; mask interrupts
+    swapgs_user 8                   ; kernel GS base when coming from user mode
     save_registers                  ; push all general purpose registers to stack
 
-    mov rbp, dr3                    ; address of scheduler struct (rbp is callee save)
-    mov ebx, dword [xsave_support]  ; value of xsave support (ebx is callee save)
-    mov rax, [rbp+0]                ; address of scheduling stack
-
-    mov rcx, [rbp+8]                ; address of extended state context
-    cmp ebx, 0                      ; check for xsave support
-    je .fxs                         ; jump if not supported
-    xsave [rcx]                     ; save context
-.fxs:
-    fxsave [rcx]                    ; save context (legacy)
+    mov rax, [gs:24]                ; address of scheduler struct
+    mov rax, [rax+0]                ; address of scheduling stack
 
     mov rdi, rsp                    ; rdi is first argument for schedule_handler
     mov rsp, rax                    ; switch to scheduling stack
-    call schedule_handler           ; call handler
+    call schedule_handler           ; call handler (extended state is switched lazily)
     mov rsp, rax                    ; load new thread stack
 
-    mov rcx, [rbp+8]                ; address of extended state context
-    cmp ebx, 0                      ; check for xsave support
-    je .fxr                         ; jump if not supported
-    xrstor [rcx]                    ; restore context
-.fxr:
-    fxrstor [rcx]                   ; restore context (legacy)
-
     restore_registers               ; pop all general purpose registers from the stack
+    swapgs_user 8                   ; user GS base when returning to user mode
     iretq                           ; return from interrupt
 .end:
 
@@ -3,6 +3,8 @@
 #include <kernel/x86/isr.h>
 #include <kernel/x86/idt.h>
 #include <kernel/x86/smp.h>
+#include <kernel/x86/fpu.h>
+#include <kernel/mem/vmm.h>
 #include <kernel/debug.h>
 
 static char *exception_messages[] =
@@ -139,6 +141,35 @@ static void isr_dump(isr_stack_t *stack)
 void isr_handler(isr_stack_t *stack)
 {
     process_t *pr;
+    uint64_t addr;
+    int status;
+
+    // extended state of the current thread, loaded on its first use after a switch
+    if(stack->int_no == 7)
+    {
+        fpu_trap();
+        return;
+    }
+
+    // demand paging, also for kernel accesses to user memory
+    if(stack->int_no == 14 && vmm_get_current_pml4() != vmm_get_kernel_pml4())
+    {
+        asm volatile("mov %%cr2, %0" : "=r" (addr));
+
+        // file backed pages may block, which is only allowed when the faulting
+        // context had interrupts enabled, callers copy user memory outside spinlocks
+        if(addr < USER_END && (stack->rflags & 0x200))
+        {
+            asm volatile("sti");
+            status = process_page_fault(addr, stack->error);
+            asm volatile("cli");
+
+            if(status == 0)
+            {
+                return;
+            }
+        }
+    }
 
     if(stack->cs == 0x10)
     {
@@ -1,5 +1,6 @@
 #include <kernel/acpi/acpi.h>
 #include <kernel/time/time.h>
+#include <kernel/x86/ioports.h>
 #include <kernel/x86/lapic.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/debug.h>
@@ -84,6 +85,13 @@ void lapic_timer_init(uint32_t count, bool periodic)
     lapic_write(APIC_TICR, count);
 }
 
+void lapic_timer_deadline(uint64_t tsc)
+{
+    // the mode has to be set before the deadline is written
+    lapic_write(APIC_LVTT, 0x40020);
+    write_msr(MSR_TSC_DEADLINE, tsc);
+}
+
 uint64_t lapic_timer_calibrate()
 {
     uint32_t count;
@@ -2,6 +2,8 @@
 
 #include <kernel/types.h>
 
+#define MSR_TSC_DEADLINE 0x6E0
+
 enum {
     APIC_ID    = 0x020, // ID
     APIC_VER   = 0x030, // Version
@@ -40,6 +42,7 @@ uint8_t lapic_get_id();
 void lapic_timer_mask();
 void lapic_timer_unmask();
 void lapic_timer_init(uint32_t count, bool periodic);
+void lapic_timer_deadline(uint64_t tsc);
 uint64_t lapic_timer_calibrate();
 
 void lapic_enable();
@@ -0,0 +1,76 @@
+#include <kernel/syscalls/syscalls.h>
+#include <kernel/sched/threads.h>
+#include <kernel/time/time.h>
+#include <kernel/x86/ioports.h>
+#include <kernel/x86/percpu.h>
+#include <kernel/x86/smp.h>
+#include <kernel/debug.h>
+
+#define PERCPU_BENCH 1000000
+
+static percpu_t areas[SMP_MAX_CORES];
+static percpu_t boot = { .self = &boot, .id = -1 };
+
+percpu_t *percpu_area(int id)
+{
+    return areas + id;
+}
+
+// The current thread as it was found through DR3 before the per-core area existed
+static __attribute__((noinline)) thread_t *percpu_debug_thread()
+{
+    percpu_t *area;
+    asm volatile("movq %%dr3, %0" : "=r" (area));
+    return area->thread;
+}
+
+void percpu_benchmark()
+{
+    uint64_t start, old, new;
+    thread_t *thread;
+    uint32_t flags;
+
+    // the old path reads DR3, which is only valid while this thread stays on this core
+    disable_interrupts(&flags);
+    asm volatile("movq %0, %%dr3" :: "r" (percpu_read(self)));
+
+    start = system_timestamp();
+    for(int i = 0; i < PERCPU_BENCH; i++)
+    {
+        thread = percpu_debug_thread();
+        asm volatile("" :: "r" (thread));
+    }
+    old = system_timestamp() - start;
+
+    start = system_timestamp();
+    for(int i = 0; i < PERCPU_BENCH; i++)
+    {
+        thread = thread_handle();
+        asm volatile("" :: "r" (thread));
+    }
+    new = system_timestamp() - start;
+
+    restore_interrupts(&flags);
+
+    kp_info("percpu", "thread_handle with DR3: %lu ps per call", (old * 1000) / PERCPU_BENCH);
+    kp_info("percpu", "thread_handle with GS: %lu ps per call", (new * 1000) / PERCPU_BENCH);
+}
+
+// Cores run on a shared area until they know their ID
+void percpu_init_boot()
+{
+    write_msr(MSR_GS_BASE, (uint64_t)&boot);
+}
+
+void percpu_init(int id)
+{
+    percpu_t *area;
+
+    area = areas + id;
+    area->self = area;
+    area->id = id;
+
+    // user mode starts without a GS base of its own
+    write_msr(MSR_GS_BASE, (uint64_t)area);
+    write_msr(MSR_KERNEL_GS_BASE, 0);
+}
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <kernel/sched/types.h>
+#include <kernel/types.h>
+#include <stddef.h>
+
+// The kernel GS base of every core points to its own percpu_t. Kernel code runs with
+// it loaded, and the entry paths swap in the user GS base only while in user mode.
+
+typedef struct percpu {
+    struct percpu *self;          // Address of this area (must be struct offset 0)
+    uint64_t krsp;                // Kernel stack of the current thread (must be struct offset 8)
+    uint64_t ursp;                // User stack while entering a syscall (must be struct offset 16)
+    struct scheduler *scheduler;  // Scheduler of this core (must be struct offset 24)
+    thread_t *thread;             // Currently executed thread
+    int id;                       // Core ID
+    uint64_t switches;            // Context switches
+    uint64_t preemptions;         // Threads switched out while still runnable
+    uint64_t migrations;          // Threads that last ran on another core
+    uint64_t steals;              // Threads taken from other cores
+    uint64_t quiescent;           // Passes through a point outside of RCU readers
+    qnode_t qnode;                // Queue node while waiting for a spinlock
+    thread_t *fpu_owner;          // Thread whose extended state is in the registers
+    uint64_t fpu_loads;           // Extended states loaded on first use after a switch
+} __attribute__((aligned(64))) percpu_t;
+
+#define percpu_read(member) ({ \
+    __typeof__(((percpu_t*)0)->member) __val; \
+    asm volatile("mov %%gs:%c1, %0" : "=r" (__val) : "i" (offsetof(percpu_t, member))); \
+    __val; })
+
+#define percpu_write(member, value) ({ \
+    __typeof__(((percpu_t*)0)->member) __val = (value); \
+    asm volatile("mov %0, %%gs:%c1" :: "r" (__val), "i" (offsetof(percpu_t, member)) : "memory"); })
+
+#define percpu_inc(member) \
+    asm volatile("incq %%gs:%c0" :: "i" (offsetof(percpu_t, member)) : "memory")
+
+percpu_t *percpu_area(int id);
+void percpu_benchmark();
+void percpu_init_boot();
+void percpu_init(int id);
@@ -3,17 +3,20 @@
 #include <kernel/acpi/acpi.h>
 #include <kernel/time/time.h>
 #include <kernel/x86/lapic.h>
+#include <kernel/x86/percpu.h>
 #include <kernel/x86/smp.h>
 #include <kernel/x86/gdt.h>
 #include <kernel/x86/idt.h>
 #include <kernel/x86/irq.h>
 #include <kernel/x86/tss.h>
 #include <kernel/x86/fpu.h>
+#include <kernel/mem/slab.h>
+#include <kernel/mem/pmm.h>
 #include <kernel/mem/vmm.h>
 #include <kernel/debug.h>
 #include <string.h>
 
-static core_t core[16];
+static core_t core[SMP_MAX_CORES];
 static uint8_t core_count;
 static volatile int ap_booted;
 static volatile int core_id;
@@ -47,6 +50,13 @@ int smp_core_count()
 void smp_enable_core(int apic_id)
 {
     uint8_t id;
+
+    if(core_count == SMP_MAX_CORES)
+    {
+        kp_warn("smp", "apic_id: %d (ignored)", apic_id);
+        return;
+    }
+
     id = core_count++;
 
     core[id].present = 1;
@@ -67,15 +77,20 @@ void smp_enable_core(int apic_id)
 static void smp_init_core(int id)
 {
     core[id].tr = tss_init(&core[id].tss, 0);
+    percpu_init(id);
+    pmm_init_core(core_count, id);
+    slab_init_core(id);
     scheduler_init_core(core_count, id, core[id].apic_id, &core[id].tss);
     syscall_init();
 }
 
 void smp_ap_entry()
 {
+    percpu_init_boot();
     gdt_load();
     idt_load();
     pat_load();
+    vmm_init_core();
     vmm_load_kernel_pml4();
     lapic_enable();
     fpu_init();
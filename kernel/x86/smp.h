@@ -3,6 +3,8 @@
 #include <kernel/x86/tss.h>
 #include <kernel/types.h>
 
+#define SMP_MAX_CORES 16
+
 typedef struct {
     uint8_t present;
     uint8_t bsp;
@@ -34,6 +34,11 @@ static char *symtab_lookup(uint64_t address)
     return 0;
 }
 
+const char *strace_symbol(uint64_t address)
+{
+    return symtab_lookup(address);
+}
+
 void strace_init(uint64_t address, uint32_t size)
 {
     if(address > 0)
@@ -15,4 +15,5 @@ struct frame {
 };
 
 void strace(int);
+const char *strace_symbol(uint64_t);
 void strace_init(uint64_t, uint32_t);
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Blocks while *addr equals expected, a timeout of zero waits until woken
+int futex_wait(volatile uint32_t *addr, uint32_t expected, size_t timeout);
+
+// Wakes up to count threads waiting on addr and returns their number
+int futex_wake(volatile uint32_t *addr, int count);
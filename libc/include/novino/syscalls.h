@@ -118,3 +118,27 @@ static inline long syscall(size_t id, size_t arg0, size_t arg1, size_t arg2, siz
 
 #define sys_signal(pid, sig) \
     syscall(29, pid, sig, 0, 0, 0)
+
+#define sys_mmap(length, prot, flags, fd, offset) \
+    syscall(30, length, prot, flags, fd, offset)
+
+#define sys_munmap(addr, length) \
+    syscall(31, (size_t)addr, length, 0, 0, 0)
+
+#define sys_mprotect(addr, length, prot) \
+    syscall(32, (size_t)addr, length, prot, 0, 0)
+
+#define sys_fork() \
+    syscall(33, 0, 0, 0, 0, 0)
+
+#define sys_futex_wait(addr, expected, timeout) \
+    syscall(34, (size_t)addr, expected, timeout, 0, 0)
+
+#define sys_futex_wake(addr, count) \
+    syscall(35, (size_t)addr, count, 0, 0, 0)
+
+#define sys_thread(entry, stack, arg) \
+    syscall(36, (size_t)entry, (size_t)stack, (size_t)arg, 0, 0)
+
+#define sys_thread_exit(done) \
+    syscall(37, (size_t)done, 0, 0, 0, 0)
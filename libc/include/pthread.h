@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Threads, mutexes and condition variables on top of the futex system calls.
+// Attributes are not supported and have to be NULL.
+// Besides these, only malloc, calloc, realloc and free are thread-safe. errno and
+// the stdio buffers are shared by all threads of a process and are not locked.
+
+#define PTHREAD_STACK_SIZE 0x10000
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+#define PTHREAD_COND_INITIALIZER  { 0 }
+
+typedef struct __pthread *pthread_t;
+
+typedef struct {
+    volatile uint32_t state; // 0 = unlocked, 1 = locked, 2 = locked with waiters
+} pthread_mutex_t;
+
+typedef struct {
+    volatile uint32_t seq;   // Changes with every signal
+} pthread_cond_t;
+
+int pthread_create(pthread_t *thread, const void *attr, void *(*func)(void*), void *arg);
+int pthread_join(pthread_t thread, void **retval);
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const void *attr);
+int pthread_mutex_destroy(pthread_mutex_t *mutex);
+int pthread_mutex_lock(pthread_mutex_t *mutex);
+int pthread_mutex_trylock(pthread_mutex_t *mutex);
+int pthread_mutex_unlock(pthread_mutex_t *mutex);
+
+int pthread_cond_init(pthread_cond_t *cond, const void *attr);
+int pthread_cond_destroy(pthread_cond_t *cond);
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex);
+int pthread_cond_signal(pthread_cond_t *cond);
+int pthread_cond_broadcast(pthread_cond_t *cond);
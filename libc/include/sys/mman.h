@@ -0,0 +1,11 @@
+#pragma once
+
+#include <kernel/mem/mman.h>
+#include <stddef.h>
+
+#define MAP_ANON   MAP_ANONYMOUS
+#define MAP_FAILED ((void*)-1)
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset);
+int munmap(void *addr, size_t length);
+int mprotect(void *addr, size_t length, int prot);
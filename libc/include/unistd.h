@@ -12,6 +12,7 @@ extern int optopt;
 
 typedef long pid_t;
 pid_t getpid();
+pid_t fork();
 
 int getopt(int argc, char * const argv[], const char *optstring);
 
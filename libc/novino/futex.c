@@ -0,0 +1,31 @@
+#include <novino/syscalls.h>
+#include <novino/futex.h>
+#include <errno.h>
+
+int futex_wait(volatile uint32_t *addr, uint32_t expected, size_t timeout)
+{
+    int status;
+
+    status = sys_futex_wait(addr, expected, timeout);
+    if(status < 0)
+    {
+        errno = -status;
+        return -1;
+    }
+
+    return 0;
+}
+
+int futex_wake(volatile uint32_t *addr, int count)
+{
+    int status;
+
+    status = sys_futex_wake(addr, count);
+    if(status < 0)
+    {
+        errno = -status;
+        return -1;
+    }
+
+    return status;
+}
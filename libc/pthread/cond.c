@@ -0,0 +1,55 @@
+#include <novino/futex.h>
+#include <pthread.h>
+#include <errno.h>
+
+// Waiters sleep on the sequence number they saw before releasing the mutex, a signal
+// in between changes it and the wait returns at once. Like all condition variables
+// this may wake up spuriously, callers check their predicate in a loop.
+
+int pthread_cond_init(pthread_cond_t *cond, const void *attr)
+{
+    if(attr)
+    {
+        return ENOTSUP;
+    }
+
+    cond->seq = 0;
+    return 0;
+}
+
+int pthread_cond_destroy(pthread_cond_t *cond)
+{
+    return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t *cond, pthread_mutex_t *mutex)
+{
+    uint32_t seq;
+
+    seq = __atomic_load_n(&cond->seq, __ATOMIC_ACQUIRE);
+
+    pthread_mutex_unlock(mutex);
+    futex_wait(&cond->seq, seq, 0);
+
+    // other waiters may block on the mutex already
+    while(__atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE) != 0)
+    {
+        futex_wait(&mutex->state, 2, 0);
+    }
+
+    return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t *cond)
+{
+    __atomic_add_fetch(&cond->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&cond->seq, 1);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t *cond)
+{
+    __atomic_add_fetch(&cond->seq, 1, __ATOMIC_RELEASE);
+    futex_wake(&cond->seq, 0x7FFFFFFF);
+    return 0;
+}
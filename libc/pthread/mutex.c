@@ -0,0 +1,82 @@
+#include <novino/futex.h>
+#include <pthread.h>
+#include <errno.h>
+
+// Unlocking only enters the kernel when the state says that somebody waits. Waiters
+// always set the state to 2, so no wakeup is lost when several threads block.
+
+#define MUTEX_SPIN 100
+
+int pthread_mutex_init(pthread_mutex_t *mutex, const void *attr)
+{
+    if(attr)
+    {
+        return ENOTSUP;
+    }
+
+    mutex->state = 0;
+    return 0;
+}
+
+int pthread_mutex_destroy(pthread_mutex_t *mutex)
+{
+    if(mutex->state)
+    {
+        return EBUSY;
+    }
+
+    return 0;
+}
+
+int pthread_mutex_lock(pthread_mutex_t *mutex)
+{
+    uint32_t state;
+
+    // short critical sections are often left before a sleep would complete
+    for(int i = 0; i < MUTEX_SPIN; i++)
+    {
+        state = 0;
+        if(__atomic_compare_exchange_n(&mutex->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        {
+            return 0;
+        }
+
+        if(state == 2)
+        {
+            break;
+        }
+
+        asm volatile("pause");
+    }
+
+    state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    while(state != 0)
+    {
+        futex_wait(&mutex->state, 2, 0);
+        state = __atomic_exchange_n(&mutex->state, 2, __ATOMIC_ACQUIRE);
+    }
+
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t *mutex)
+{
+    uint32_t state = 0;
+
+    if(!__atomic_compare_exchange_n(&mutex->state, &state, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+    {
+        return EBUSY;
+    }
+
+    return 0;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t *mutex)
+{
+    if(__atomic_exchange_n(&mutex->state, 0, __ATOMIC_RELEASE) == 2)
+    {
+        futex_wake(&mutex->state, 1);
+    }
+
+    return 0;
+}
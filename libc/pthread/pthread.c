@@ -0,0 +1,73 @@
+#include <novino/syscalls.h>
+#include <novino/futex.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <errno.h>
+
+// The control block sits at the bottom of the stack mapping of the thread. The kernel
+// sets done and wakes the joining thread once the thread has left its stack.
+
+struct __pthread {
+    void *(*func)(void*);    // Start function
+    void *arg;               // Argument of the start function
+    void *retval;            // Return value of the start function
+    volatile uint32_t done;  // Set by the kernel when the thread has ended
+};
+
+static void pthread_start(pthread_t thread)
+{
+    thread->retval = thread->func(thread->arg);
+    sys_thread_exit(&thread->done);
+}
+
+int pthread_create(pthread_t *thread, const void *attr, void *(*func)(void*), void *arg)
+{
+    pthread_t self;
+    size_t stack;
+    long status;
+
+    if(attr)
+    {
+        return ENOTSUP;
+    }
+
+    self = mmap(NULL, PTHREAD_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(self == MAP_FAILED)
+    {
+        return errno;
+    }
+
+    self->func = func;
+    self->arg = arg;
+    self->retval = NULL;
+    self->done = 0;
+
+    // the start function is entered like after a call
+    stack = (size_t)self + PTHREAD_STACK_SIZE - 8;
+
+    status = sys_thread(pthread_start, stack, self);
+    if(status < 0)
+    {
+        munmap(self, PTHREAD_STACK_SIZE);
+        return -status;
+    }
+
+    *thread = self;
+    return 0;
+}
+
+int pthread_join(pthread_t thread, void **retval)
+{
+    while(thread->done == 0)
+    {
+        futex_wait(&thread->done, 0, 0);
+    }
+
+    if(retval)
+    {
+        *retval = thread->retval;
+    }
+
+    munmap(thread, PTHREAD_STACK_SIZE);
+    return 0;
+}
@@ -1,8 +1,13 @@
 #include <novino/syscalls.h>
+#include <sys/mman.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
 
+// The heap is shared by all threads of a process, one mutex serializes it
+
 #define HEAP_SBRK_ALIGN 4096
+#define HEAP_MMAP_SIZE  0x20000
 #define HEAP_CHUNK_SIZE sizeof(chunk_t)
 #define HEAP_DATA_ALIGN (2*sizeof(size_t))
 
@@ -20,6 +25,7 @@ typedef struct chunk {
 static chunk_t *heap_free_list = NULL;
 static size_t heap_start = 0;
 static size_t heap_end = 0;
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static int heap_sbrk(long sbrk)
 {
@@ -200,6 +206,35 @@ static chunk_t *find_free_chunk(size_t size)
     return heap_expand(size);
 }
 
+// large allocations get their own mapping outside the brk heap
+static void *map_chunk(size_t size)
+{
+    chunk_t *chunk;
+
+    chunk = mmap(NULL, size + HEAP_CHUNK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(chunk == MAP_FAILED)
+    {
+        return NULL;
+    }
+
+    chunk->prev = 0;
+    chunk->next = 0;
+    chunk->size = size;
+    chunk->free = 0;
+
+    return (chunk + 1);
+}
+
+static int is_mapped(void *ptr)
+{
+    if(ptr >= (void*)heap_start && ptr <= (void*)heap_end)
+    {
+        return 0;
+    }
+
+    return (((size_t)ptr - HEAP_CHUNK_SIZE) & (HEAP_SBRK_ALIGN - 1)) == 0;
+}
+
 int __libc_heap_init()
 {
     chunk_t *first, *last, *middle;
@@ -244,7 +279,7 @@ int __libc_heap_init()
     return 0;
 }
 
-void *malloc(size_t size)
+static void *heap_malloc(size_t size)
 {
     chunk_t *chunk;
 
@@ -257,6 +292,11 @@ void *malloc(size_t size)
     // round size to alignment
     size = align_size(size, HEAP_DATA_ALIGN);
 
+    if(size >= HEAP_MMAP_SIZE)
+    {
+        return map_chunk(size);
+    }
+
     // find a free chunk
     chunk = find_free_chunk(size);
     if(!chunk)
@@ -274,10 +314,17 @@ void *malloc(size_t size)
     return (chunk + 1);
 }
 
-void free(void *ptr)
+static void heap_free(void *ptr)
 {
     chunk_t *chunk;
 
+    if(is_mapped(ptr))
+    {
+        chunk = ptr - HEAP_CHUNK_SIZE;
+        munmap(chunk, chunk->size + HEAP_CHUNK_SIZE);
+        return;
+    }
+
     // invalid
     if(ptr < (void*)heap_start)
     {
@@ -299,6 +346,24 @@ void free(void *ptr)
     glue_chunk(chunk, 1, 1);
 }
 
+void *malloc(size_t size)
+{
+    void *ptr;
+
+    pthread_mutex_lock(&heap_lock);
+    ptr = heap_malloc(size);
+    pthread_mutex_unlock(&heap_lock);
+
+    return ptr;
+}
+
+void free(void *ptr)
+{
+    pthread_mutex_lock(&heap_lock);
+    heap_free(ptr);
+    pthread_mutex_unlock(&heap_lock);
+}
+
 void *calloc(size_t num, size_t size)
 {
     void *ptr;
@@ -319,7 +384,7 @@ void *calloc(size_t num, size_t size)
     return ptr;
 }
 
-void *realloc(void *ptr, size_t size)
+static void *heap_realloc(void *ptr, size_t size)
 {
     size_t orig_size;
     chunk_t *chunk;
@@ -328,12 +393,12 @@ void *realloc(void *ptr, size_t size)
     // special cases
     if(ptr == NULL)
     {
-        return malloc(size);
+        return heap_malloc(size);
     }
 
     if(size == 0)
     {
-        free(ptr);
+        heap_free(ptr);
         return NULL;
     }
 
@@ -342,6 +407,18 @@ void *realloc(void *ptr, size_t size)
     chunk = ptr - HEAP_CHUNK_SIZE;
     orig_size = chunk->size;
 
+    // mapped chunks are always moved
+    if(is_mapped(ptr))
+    {
+        new_ptr = heap_malloc(size);
+        if(new_ptr)
+        {
+            memcpy(new_ptr, ptr, (size < orig_size) ? size : orig_size);
+            heap_free(ptr);
+        }
+        return new_ptr;
+    }
+
     // shrinking
     if(size <= chunk->size)
     {
@@ -370,11 +447,20 @@ void *realloc(void *ptr, size_t size)
     }
 
     // malloc and copy
-    new_ptr = malloc(size);
+    new_ptr = heap_malloc(size);
     if(new_ptr)
     {
         memcpy(new_ptr, ptr, orig_size);
-        free(ptr);
+        heap_free(ptr);
     }
     return new_ptr;
 }
+
+void *realloc(void *ptr, size_t size)
+{
+    pthread_mutex_lock(&heap_lock);
+    ptr = heap_realloc(ptr, size);
+    pthread_mutex_unlock(&heap_lock);
+
+    return ptr;
+}
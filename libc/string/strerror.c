@@ -116,6 +116,9 @@ char *strerror(int errnum)
         case EFAULT:
             str = "Bad address";
             break;
+        case EAGAIN:
+            str = "Resource temporarily unavailable";
+            break;
         default:
             break;
     };
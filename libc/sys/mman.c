@@ -0,0 +1,46 @@
+#include <novino/syscalls.h>
+#include <sys/mman.h>
+#include <errno.h>
+
+// the address is only a hint and is currently ignored
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, long offset)
+{
+    long status;
+
+    status = sys_mmap(length, prot, flags, fd, offset);
+    if(status < 0)
+    {
+        errno = -status;
+        return MAP_FAILED;
+    }
+
+    return (void*)status;
+}
+
+int munmap(void *addr, size_t length)
+{
+    int status;
+
+    status = sys_munmap(addr, length);
+    if(status < 0)
+    {
+        errno = -status;
+        return -1;
+    }
+
+    return 0;
+}
+
+int mprotect(void *addr, size_t length, int prot)
+{
+    int status;
+
+    status = sys_mprotect(addr, length, prot);
+    if(status < 0)
+    {
+        errno = -status;
+        return -1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,17 @@
+#include <novino/syscalls.h>
+#include <unistd.h>
+#include <errno.h>
+
+pid_t fork()
+{
+    pid_t pid;
+
+    pid = sys_fork();
+    if(pid < 0)
+    {
+        errno = -pid;
+        return -1;
+    }
+
+    return pid;
+}
@@ -44,6 +44,7 @@ qemu-system-x86_64 -no-reboot -debugcon stdio -cdrom novino.iso -smp 4 -machine
 # XHCI        : -device qemu-xhci,id=xhci -device usb-hub,bus=xhci.0,port=4 -device usb-mouse,bus=xhci.0 -device usb-kbd,bus=xhci.0,port=4.4
 # Q35 Chipset : -machine q35
 # Network     : -netdev tap,id=mynet0,ifname=tap0,script=no,downscript=no -device rtl8139,netdev=mynet0
+# NUMA        : -m 1G -object memory-backend-ram,id=m0,size=512M -object memory-backend-ram,id=m1,size=512M -numa node,nodeid=0,cpus=0-1,memdev=m0 -numa node,nodeid=1,cpus=2-3,memdev=m1
 
 # menuentry "Novino" {
 #     search --no-floppy --fs-uuid --set=root f8930de6-e51f-49ad-aac1-e59504f2045b